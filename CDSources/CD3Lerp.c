@@ -0,0 +1,382 @@
+//
+//  CD3Lerp.c
+//  COMSOL3DBin
+//
+//  Trilinear interpolation kernels. See CD3Lerp.h.
+//
+//  The C version follows the Wikipedia page on trilinear interpolation:
+//  lerp along x between the four pairs of corners, then along y between
+//  the two results, then along z. The vector versions hold a corner's
+//  three components (and a spare) in one register, or two in the case
+//  of SSE2, and do the same steps for all components at once. AVX-512
+//  goes one further and does two corner pairs in each instruction.
+//
+//  The four point versions do the same steps in the same order, but
+//  each register holds one component of one corner for four points (or
+//  two for SSE2), so no lane is wasted on the spare.
+//
+//  The vector kernels are compiled with target attributes rather than
+//  flags, so the rest of the program still runs on any processor and we
+//  only call them after asking the processor what it can do.
+//
+
+#include <string.h>
+#include "CD3Lerp.h"
+
+//
+//  AVX-512 brings fused multiply-adds with it and GCC will happily fuse
+//  our multiplies and adds, which rounds differently. Tell both
+//  compilers not to.
+//
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define kCD3LerpX86 1
+#include <immintrin.h>
+#endif
+
+//
+//  Kludgy global that lets the caller force a kernel.
+//
+CD3LerpKernel gCD3LerpKernel = kCD3LerpAuto;
+
+//
+//  The best kernel the processor can run, -1 until we first ask. Asking
+//  twice gives the same answer so it doesn't matter if two threads race
+//  to do it.
+//
+static int sBest = -1;
+
+static void LerpC(const double v[8][4], const double rc[3], double EField[3]);
+#ifdef kCD3LerpX86
+static void LerpSSE2(const double v[8][4], const double rc[3],
+                     double EField[3]);
+static void LerpAVX2(const double v[8][4], const double rc[3],
+                     double EField[3]);
+static void LerpAVX512(const double v[8][4], const double rc[3],
+                       double EField[3]);
+#endif
+static void Lerp4C(const double v[8][3][kCD3Lanes],
+                   const double rc[3][kCD3Lanes],
+                   double EField[3][kCD3Lanes]);
+#ifdef kCD3LerpX86
+static void Lerp4SSE2(const double v[8][3][kCD3Lanes],
+                      const double rc[3][kCD3Lanes],
+                      double EField[3][kCD3Lanes]);
+static void Lerp4AVX2(const double v[8][3][kCD3Lanes],
+                      const double rc[3][kCD3Lanes],
+                      double EField[3][kCD3Lanes]);
+#endif
+static CD3LerpKernel Pick(CD3LerpKernel fastest);
+static CD3LerpKernel Best(void);
+
+//
+//  What we found fastest when the choice was left to us. One point at a
+//  time the vector kernels spend nearly as long getting the corners
+//  into registers as they save, so plain C is within a few percent of
+//  the best of them and AVX-512 was the slowest. Four points at a time
+//  AVX2 wins.
+//
+#define kCD3LerpFastest kCD3LerpC
+#define kCD3Lerp4Fastest kCD3LerpAVX2
+
+CD3LerpFn CD3Lerp(void)
+{
+  switch (Pick(kCD3LerpFastest)) {
+#ifdef kCD3LerpX86
+    case kCD3LerpSSE2:
+      return LerpSSE2;
+
+    case kCD3LerpAVX2:
+      return LerpAVX2;
+
+    case kCD3LerpAVX512:
+      return LerpAVX512;
+#endif
+
+    default:
+      return LerpC;
+  }
+}
+
+CD3Lerp4Fn CD3Lerp4(void)
+{
+  switch (Pick(kCD3Lerp4Fastest)) {
+#ifdef kCD3LerpX86
+    case kCD3LerpSSE2:
+      return Lerp4SSE2;
+
+    case kCD3LerpAVX2:
+    case kCD3LerpAVX512:
+      return Lerp4AVX2;
+#endif
+
+    default:
+      return Lerp4C;
+  }
+}
+
+const char* CD3LerpName(void)
+{
+  switch (Pick(kCD3LerpFastest)) {
+    case kCD3LerpSSE2:
+      return "SSE2";
+
+    case kCD3LerpAVX2:
+      return "AVX2";
+
+    case kCD3LerpAVX512:
+      return "AVX-512";
+
+    default:
+      return "C";
+  }
+}
+
+const char* CD3Lerp4Name(void)
+{
+  switch (Pick(kCD3Lerp4Fastest)) {
+    case kCD3LerpSSE2:
+      return "SSE2";
+
+    case kCD3LerpAVX2:
+    case kCD3LerpAVX512:
+      return "AVX2";
+
+    default:
+      return "C";
+  }
+}
+//
+//  The kernel to use for the current setting of gCD3LerpKernel, given
+//  the one to use if it is left to us.
+//
+static CD3LerpKernel Pick(CD3LerpKernel fastest)
+{
+  CD3LerpKernel asked = gCD3LerpKernel;
+  CD3LerpKernel best = Best();
+  if (asked == kCD3LerpAuto) {
+    asked = fastest;
+  }
+  return (asked > best) ? best : asked;
+}
+//
+//  The best kernel the processor can run.
+//
+static CD3LerpKernel Best(void)
+{
+  int best = __atomic_load_n(&sBest, __ATOMIC_RELAXED);
+  if (best >= 0) {
+    return (CD3LerpKernel) best;
+  }
+  best = kCD3LerpC;
+#ifdef kCD3LerpX86
+  __builtin_cpu_init();
+  best = kCD3LerpSSE2;
+  if (__builtin_cpu_supports("avx2")) {
+    best = kCD3LerpAVX2;
+  }
+  if (__builtin_cpu_supports("avx512f")) {
+    best = kCD3LerpAVX512;
+  }
+#endif
+  __atomic_store_n(&sBest, best, __ATOMIC_RELAXED);
+  return (CD3LerpKernel) best;
+}
+
+static void LerpC(const double v[8][4], const double rc[3], double EField[3])
+{
+  int i;
+  double irc[3];
+  double c00, c01, c10, c11, c0, c1; // Interpolation steps
+  for (i = 0; i < 3; i++) {
+    irc[i] = 1.0 - rc[i];
+  }
+  for (i = 0; i < 3; i++) {
+    c00 = irc[0]*v[0][i] + rc[0]*v[1][i];
+    c10 = irc[0]*v[2][i] + rc[0]*v[3][i];
+    c01 = irc[0]*v[4][i] + rc[0]*v[5][i];
+    c11 = irc[0]*v[6][i] + rc[0]*v[7][i];
+    c0 = irc[1] * c00 + rc[1] * c10;
+    c1 = irc[1] * c01 + rc[1] * c11;
+    EField[i] = irc[2] * c0 + rc[2] * c1;
+  }
+}
+
+static void Lerp4C(const double v[8][3][kCD3Lanes],
+                   const double rc[3][kCD3Lanes],
+                   double EField[3][kCD3Lanes])
+{
+  int i, j;
+  double irc[3];
+  double c00, c01, c10, c11, c0, c1;
+  for (j = 0; j < kCD3Lanes; j++) {
+    for (i = 0; i < 3; i++) {
+      irc[i] = 1.0 - rc[i][j];
+    }
+    for (i = 0; i < 3; i++) {
+      c00 = irc[0]*v[0][i][j] + rc[0][j]*v[1][i][j];
+      c10 = irc[0]*v[2][i][j] + rc[0][j]*v[3][i][j];
+      c01 = irc[0]*v[4][i][j] + rc[0][j]*v[5][i][j];
+      c11 = irc[0]*v[6][i][j] + rc[0][j]*v[7][i][j];
+      c0 = irc[1] * c00 + rc[1][j] * c10;
+      c1 = irc[1] * c01 + rc[1][j] * c11;
+      EField[i][j] = irc[2] * c0 + rc[2][j] * c1;
+    }
+  }
+}
+
+#ifdef kCD3LerpX86
+//
+//  SSE2 holds x and y of a corner in one register and z in another.
+//
+static void LerpSSE2(const double v[8][4], const double rc[3],
+                     double EField[3])
+{
+  int h;
+  double out[4];
+  __m128d r0 = _mm_set1_pd(rc[0]), ir0 = _mm_set1_pd(1.0 - rc[0]);
+  __m128d r1 = _mm_set1_pd(rc[1]), ir1 = _mm_set1_pd(1.0 - rc[1]);
+  __m128d r2 = _mm_set1_pd(rc[2]), ir2 = _mm_set1_pd(1.0 - rc[2]);
+  __m128d c00, c10, c01, c11, c0, c1;
+  for (h = 0; h < 4; h += 2) {
+    c00 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[0][h])),
+                     _mm_mul_pd(r0, _mm_loadu_pd(&v[1][h])));
+    c10 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[2][h])),
+                     _mm_mul_pd(r0, _mm_loadu_pd(&v[3][h])));
+    c01 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[4][h])),
+                     _mm_mul_pd(r0, _mm_loadu_pd(&v[5][h])));
+    c11 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[6][h])),
+                     _mm_mul_pd(r0, _mm_loadu_pd(&v[7][h])));
+    c0 = _mm_add_pd(_mm_mul_pd(ir1, c00), _mm_mul_pd(r1, c10));
+    c1 = _mm_add_pd(_mm_mul_pd(ir1, c01), _mm_mul_pd(r1, c11));
+    _mm_storeu_pd(&out[h],
+                  _mm_add_pd(_mm_mul_pd(ir2, c0), _mm_mul_pd(r2, c1)));
+  }
+  memcpy(EField, out, 3 * sizeof(double));
+}
+//
+//  AVX2 holds a whole corner in one register.
+//
+__attribute__((target("avx2")))
+static void LerpAVX2(const double v[8][4], const double rc[3],
+                     double EField[3])
+{
+  double out[4];
+  __m256d r0 = _mm256_set1_pd(rc[0]), ir0 = _mm256_set1_pd(1.0 - rc[0]);
+  __m256d r1 = _mm256_set1_pd(rc[1]), ir1 = _mm256_set1_pd(1.0 - rc[1]);
+  __m256d r2 = _mm256_set1_pd(rc[2]), ir2 = _mm256_set1_pd(1.0 - rc[2]);
+  __m256d c00, c10, c01, c11, c0, c1;
+  c00 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[0])),
+                      _mm256_mul_pd(r0, _mm256_loadu_pd(v[1])));
+  c10 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[2])),
+                      _mm256_mul_pd(r0, _mm256_loadu_pd(v[3])));
+  c01 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[4])),
+                      _mm256_mul_pd(r0, _mm256_loadu_pd(v[5])));
+  c11 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[6])),
+                      _mm256_mul_pd(r0, _mm256_loadu_pd(v[7])));
+  c0 = _mm256_add_pd(_mm256_mul_pd(ir1, c00), _mm256_mul_pd(r1, c10));
+  c1 = _mm256_add_pd(_mm256_mul_pd(ir1, c01), _mm256_mul_pd(r1, c11));
+  _mm256_storeu_pd(out, _mm256_add_pd(_mm256_mul_pd(ir2, c0),
+                                      _mm256_mul_pd(r2, c1)));
+  memcpy(EField, out, 3 * sizeof(double));
+}
+//
+//  AVX-512 holds two corners in a register. Loads give us v0|v1 and so
+//  on, which we shuffle into v0|v2 and v1|v3 so one x step gives both
+//  c00|c10, then c00|c01 and c10|c11 so one y step gives c0|c1.
+//
+__attribute__((target("avx512f")))
+static void LerpAVX512(const double v[8][4], const double rc[3],
+                       double EField[3])
+{
+  double out[4];
+  __m512d r0 = _mm512_set1_pd(rc[0]), ir0 = _mm512_set1_pd(1.0 - rc[0]);
+  __m512d r1 = _mm512_set1_pd(rc[1]), ir1 = _mm512_set1_pd(1.0 - rc[1]);
+  __m256d r2 = _mm256_set1_pd(rc[2]), ir2 = _mm256_set1_pd(1.0 - rc[2]);
+  __m512d v01 = _mm512_loadu_pd(v[0]), v23 = _mm512_loadu_pd(v[2]);
+  __m512d v45 = _mm512_loadu_pd(v[4]), v67 = _mm512_loadu_pd(v[6]);
+  __m512d xy0, xy1, c, c0, c1;
+  xy0 = _mm512_add_pd(
+          _mm512_mul_pd(ir0, _mm512_shuffle_f64x2(v01, v23, 0x44)),
+          _mm512_mul_pd(r0, _mm512_shuffle_f64x2(v01, v23, 0xee)));
+  xy1 = _mm512_add_pd(
+          _mm512_mul_pd(ir0, _mm512_shuffle_f64x2(v45, v67, 0x44)),
+          _mm512_mul_pd(r0, _mm512_shuffle_f64x2(v45, v67, 0xee)));
+  c0 = _mm512_shuffle_f64x2(xy0, xy1, 0x44);
+  c1 = _mm512_shuffle_f64x2(xy0, xy1, 0xee);
+  c = _mm512_add_pd(_mm512_mul_pd(ir1, c0), _mm512_mul_pd(r1, c1));
+  _mm256_storeu_pd(out,
+                   _mm256_add_pd(
+                     _mm256_mul_pd(ir2, _mm512_castpd512_pd256(c)),
+                     _mm256_mul_pd(r2, _mm512_extractf64x4_pd(c, 1))));
+  memcpy(EField, out, 3 * sizeof(double));
+}
+//
+//  SSE2 does the four points two at a time.
+//
+static void Lerp4SSE2(const double v[8][3][kCD3Lanes],
+                      const double rc[3][kCD3Lanes],
+                      double EField[3][kCD3Lanes])
+{
+  int h, i;
+  __m128d one = _mm_set1_pd(1.0);
+  __m128d r0, r1, r2, ir0, ir1, ir2;
+  __m128d c00, c10, c01, c11, c0, c1;
+  for (h = 0; h < kCD3Lanes; h += 2) {
+    r0 = _mm_loadu_pd(&rc[0][h]);
+    r1 = _mm_loadu_pd(&rc[1][h]);
+    r2 = _mm_loadu_pd(&rc[2][h]);
+    ir0 = _mm_sub_pd(one, r0);
+    ir1 = _mm_sub_pd(one, r1);
+    ir2 = _mm_sub_pd(one, r2);
+    for (i = 0; i < 3; i++) {
+      c00 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[0][i][h])),
+                       _mm_mul_pd(r0, _mm_loadu_pd(&v[1][i][h])));
+      c10 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[2][i][h])),
+                       _mm_mul_pd(r0, _mm_loadu_pd(&v[3][i][h])));
+      c01 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[4][i][h])),
+                       _mm_mul_pd(r0, _mm_loadu_pd(&v[5][i][h])));
+      c11 = _mm_add_pd(_mm_mul_pd(ir0, _mm_loadu_pd(&v[6][i][h])),
+                       _mm_mul_pd(r0, _mm_loadu_pd(&v[7][i][h])));
+      c0 = _mm_add_pd(_mm_mul_pd(ir1, c00), _mm_mul_pd(r1, c10));
+      c1 = _mm_add_pd(_mm_mul_pd(ir1, c01), _mm_mul_pd(r1, c11));
+      _mm_storeu_pd(&EField[i][h],
+                    _mm_add_pd(_mm_mul_pd(ir2, c0), _mm_mul_pd(r2, c1)));
+    }
+  }
+}
+//
+//  AVX2 does all four points at once.
+//
+__attribute__((target("avx2")))
+static void Lerp4AVX2(const double v[8][3][kCD3Lanes],
+                      const double rc[3][kCD3Lanes],
+                      double EField[3][kCD3Lanes])
+{
+  int i;
+  __m256d one = _mm256_set1_pd(1.0);
+  __m256d r0 = _mm256_loadu_pd(rc[0]), ir0 = _mm256_sub_pd(one, r0);
+  __m256d r1 = _mm256_loadu_pd(rc[1]), ir1 = _mm256_sub_pd(one, r1);
+  __m256d r2 = _mm256_loadu_pd(rc[2]), ir2 = _mm256_sub_pd(one, r2);
+  __m256d c00, c10, c01, c11, c0, c1;
+  for (i = 0; i < 3; i++) {
+    c00 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[0][i])),
+                        _mm256_mul_pd(r0, _mm256_loadu_pd(v[1][i])));
+    c10 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[2][i])),
+                        _mm256_mul_pd(r0, _mm256_loadu_pd(v[3][i])));
+    c01 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[4][i])),
+                        _mm256_mul_pd(r0, _mm256_loadu_pd(v[5][i])));
+    c11 = _mm256_add_pd(_mm256_mul_pd(ir0, _mm256_loadu_pd(v[6][i])),
+                        _mm256_mul_pd(r0, _mm256_loadu_pd(v[7][i])));
+    c0 = _mm256_add_pd(_mm256_mul_pd(ir1, c00), _mm256_mul_pd(r1, c10));
+    c1 = _mm256_add_pd(_mm256_mul_pd(ir1, c01), _mm256_mul_pd(r1, c11));
+    _mm256_storeu_pd(EField[i], _mm256_add_pd(_mm256_mul_pd(ir2, c0),
+                                              _mm256_mul_pd(r2, c1)));
+  }
+}
+#endif
@@ -0,0 +1,69 @@
+//
+//  CD3Lerp.h
+//  COMSOL3DBin
+//
+//  The trilinear interpolation at the heart of Get3DEAtPoint. Given the
+//  field at the eight corners of a cell and the reduced coordinates of a
+//  point in it, work out the field at the point. There is a plain C
+//  version and, on x86, SSE2, AVX2 and AVX-512 versions that do all three
+//  components of each step at once. There are also versions that do four
+//  points at once, one in each lane, for CD3GetEAtPoints.
+//
+//  The vector versions do exactly the same multiplies and adds in the
+//  same order as the C one, with no fused multiply-adds, so every version
+//  gives bit for bit the same answer.
+//
+
+#ifndef __COMSOL3DBin__CD3Lerp__
+#define __COMSOL3DBin__CD3Lerp__
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+//
+//  The kernels we have. gCD3LerpKernel picks one. kCD3LerpAuto, the
+//  default, means the one that was fastest when we measured it, which
+//  was plain C for one point and AVX2 for four. Asking for one the
+//  processor can't run gets the best it can. AVX-512 has no four point
+//  version and uses the AVX2 one.
+//
+typedef enum CD3LerpKernelTag {
+  kCD3LerpAuto = 0,
+  kCD3LerpC,
+  kCD3LerpSSE2,
+  kCD3LerpAVX2,
+  kCD3LerpAVX512
+} CD3LerpKernel;
+extern CD3LerpKernel gCD3LerpKernel;
+//
+//  v holds the corners in the order v<z><y><x>, each padded out to four
+//  values so a vector load of a corner never strays outside the array.
+//  rc is the reduced coordinate along each axis.
+//
+typedef void (*CD3LerpFn)(const double v[8][4], const double rc[3],
+                          double EField[3]);
+//
+//  The four point kernels hold lane j of each array for point j, so v is
+//  v[corner][component][point], rc is rc[axis][point] and EField is
+//  EField[component][point].
+//
+#define kCD3Lanes 4
+typedef void (*CD3Lerp4Fn)(const double v[8][3][kCD3Lanes],
+                           const double rc[3][kCD3Lanes],
+                           double EField[3][kCD3Lanes]);
+//
+//  CD3Lerp and CD3Lerp4 return the kernels for the current setting of
+//  gCD3LerpKernel. Looking one up isn't free, so fields do it once when
+//  they are loaded and keep the answer. The names are for reports.
+//
+CD3LerpFn CD3Lerp(void);
+CD3Lerp4Fn CD3Lerp4(void);
+const char* CD3LerpName(void);
+const char* CD3Lerp4Name(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* defined(__COMSOL3DBin__CD3Lerp__) */
@@ -0,0 +1,218 @@
+//
+//  CDPack.c
+//  COMSOL3DBin
+//
+//  FPC style compression of field values. See CDPack.h for the plan and
+//  M. Burtscher and P. Ratanaworabhan, "FPC: A High-Speed Compressor
+//  for Double-Precision Floating-Point Data", IEEE Transactions on
+//  Computers 58 (2009) for the details.
+//
+//  Values go out in pairs. Each pair starts with a byte holding a four
+//  bit code for each value, first value in the high nibble, followed by
+//  the kept bytes of the first residual and then of the second, low
+//  byte first. The top bit of a code says whether FCM (0) or DFCM (1)
+//  made the prediction and the other three the number of leading zero
+//  bytes dropped. Eight byte values can lose 0 to 8 bytes, which will
+//  not fit in three bits, so a count of 4 is never used (we keep an
+//  extra zero byte instead) and codes 4 to 7 stand for 5 to 8.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "CDPack.h"
+
+//
+//  Entries in each prediction table. Every component of a block gets
+//  two of these.
+//
+#define kCDPackTable (1 << 12)
+
+//
+//  The state of the two predictors for one component.
+//
+typedef struct CDPredictTag {
+  uint64_t mFCM[kCDPackTable];      // Value that followed each hash
+  uint64_t mDFCM[kCDPackTable];     // Difference that followed each hash
+  uint64_t mHash;                   // Hash of recent values
+  uint64_t mDHash;                  // Hash of recent differences
+  uint64_t mLast;                   // Last value seen
+} CDPredict;
+
+//
+//  Helpers.
+//
+static uint64_t Load(const unsigned char* p, int size);
+static void Store(unsigned char* p, int size, uint64_t v);
+static void Predict(const CDPredict* pr, uint64_t mask,
+                    uint64_t* fcm, uint64_t* dfcm);
+static void Update(CDPredict* pr, uint64_t v, int size, uint64_t mask);
+
+size_t CDPackBound(size_t n, int size)
+{
+  return n * size + (n + 1) / 2;
+}
+
+size_t CDPack(const void* vals, size_t n, int size, int nComp,
+              unsigned char* out)
+{
+  size_t i, o = 0, h = 0;
+  int lz, code, k;
+  uint64_t v, fcm, dfcm, r, dr;
+  uint64_t mask = (size == 8) ? ~(uint64_t) 0 :
+                  (((uint64_t) 1 << (8 * size)) - 1);
+  CDPredict* pr = (CDPredict*) calloc(nComp, sizeof(CDPredict));
+  CDPredict* p;
+  if (pr == NULL) {
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    p = &pr[i % nComp];
+    v = Load((const unsigned char*) vals + i * size, size);
+    Predict(p, mask, &fcm, &dfcm);
+    Update(p, v, size, mask);
+    //
+    //  Keep whichever residual has more leading zeros.
+    //
+    r = v ^ fcm;
+    dr = v ^ dfcm;
+    code = 0;
+    if (dr < r) {
+      r = dr;
+      code = 8;
+    }
+    for (lz = 0; (lz < size) && ((r >> (8 * (size - 1 - lz))) & 0xff) == 0;
+         lz++) {
+    }
+    if (size == 8) {
+      if (lz == 4) {
+        lz = 3;
+      }
+      code |= (lz > 4) ? lz - 1 : lz;
+    } else {
+      code |= lz;
+    }
+    if ((i & 1) == 0) {
+      h = o++;
+      out[h] = (unsigned char) (code << 4);
+    } else {
+      out[h] |= (unsigned char) code;
+    }
+    for (k = 0; k < size - lz; k++) {
+      out[o++] = (unsigned char) (r >> (8 * k));
+    }
+  }
+  free(pr);
+  return o;
+}
+
+bool CDUnpack(const unsigned char* in, size_t inLength, void* vals,
+              size_t n, int size, int nComp)
+{
+  size_t i, o = 0, h = 0;
+  int lz, code, k;
+  uint64_t v, fcm, dfcm, r;
+  uint64_t mask = (size == 8) ? ~(uint64_t) 0 :
+                  (((uint64_t) 1 << (8 * size)) - 1);
+  CDPredict* pr = (CDPredict*) calloc(nComp, sizeof(CDPredict));
+  CDPredict* p;
+  bool success = false;
+  if (pr == NULL) {
+    return false;
+  }
+  for (i = 0; i < n; i++) {
+    if ((i & 1) == 0) {
+      if (o >= inLength) {
+        goto Finish;
+      }
+      h = o++;
+      code = in[h] >> 4;
+    } else {
+      code = in[h] & 0x0f;
+    }
+    lz = code & 7;
+    if ((size == 8) && (lz > 3)) {
+      ++lz;
+    }
+    if ((lz > size) || (o + (size - lz) > inLength)) {
+      goto Finish;
+    }
+    r = 0;
+    for (k = 0; k < size - lz; k++) {
+      r |= (uint64_t) in[o++] << (8 * k);
+    }
+    p = &pr[i % nComp];
+    Predict(p, mask, &fcm, &dfcm);
+    v = r ^ ((code & 8) ? dfcm : fcm);
+    Update(p, v, size, mask);
+    Store((unsigned char*) vals + i * size, size, v);
+  }
+  success = (o == inLength);
+Finish:
+  free(pr);
+  return success;
+}
+
+//
+//  Values are moved through memcpy so they need not be aligned.
+//
+static uint64_t Load(const unsigned char* p, int size)
+{
+  uint16_t v16;
+  uint32_t v32;
+  uint64_t v64;
+  switch (size) {
+    case 2:
+      memcpy(&v16, p, sizeof(v16));
+      return v16;
+
+    case 4:
+      memcpy(&v32, p, sizeof(v32));
+      return v32;
+
+    default:
+      memcpy(&v64, p, sizeof(v64));
+      return v64;
+  }
+}
+
+static void Store(unsigned char* p, int size, uint64_t v)
+{
+  uint16_t v16 = (uint16_t) v;
+  uint32_t v32 = (uint32_t) v;
+  switch (size) {
+    case 2:
+      memcpy(p, &v16, sizeof(v16));
+      break;
+
+    case 4:
+      memcpy(p, &v32, sizeof(v32));
+      break;
+
+    default:
+      memcpy(p, &v, sizeof(v));
+      break;
+  }
+}
+
+static void Predict(const CDPredict* pr, uint64_t mask,
+                    uint64_t* fcm, uint64_t* dfcm)
+{
+  *fcm = pr->mFCM[pr->mHash];
+  *dfcm = (pr->mDFCM[pr->mDHash] + pr->mLast) & mask;
+}
+//
+//  The hashes mix in the top bits of each value and difference, where
+//  the sign, exponent and leading mantissa bits live.
+//
+static void Update(CDPredict* pr, uint64_t v, int size, uint64_t mask)
+{
+  int shift = 8 * size - 16;
+  int dShift = (size > 2) ? 8 * size - 24 : 0;
+  uint64_t d = (v - pr->mLast) & mask;
+  pr->mFCM[pr->mHash] = v;
+  pr->mHash = ((pr->mHash << 6) ^ (v >> shift)) & (kCDPackTable - 1);
+  pr->mDFCM[pr->mDHash] = d;
+  pr->mDHash = ((pr->mDHash << 2) ^ (d >> dShift)) & (kCDPackTable - 1);
+  pr->mLast = v;
+}
@@ -0,0 +1,52 @@
+//
+//  CDPack.h
+//  COMSOL3DBin
+//
+//  Lossless compression for blocks of field values. Field maps are
+//  smooth and often padded with long runs of zeros, which suits the
+//  FPC scheme of Burtscher and Ratanaworabhan: each value is predicted
+//  from the ones before it by two hash-table predictors (FCM and DFCM),
+//  XORed with the better prediction, and only the non-zero low bytes of
+//  the result are kept, with a four bit code saying which predictor won
+//  and how many leading zero bytes were dropped.
+//
+//  Values can be 2, 4 or 8 bytes wide and may be interleaved components
+//  of a vector. Each component gets its own predictors so that Ex never
+//  tries to predict Ey. The packed bytes do not depend on the byte
+//  order of the machine, and every block stands alone so blocks can be
+//  unpacked in any order, or not at all.
+//
+
+#ifndef __COMSOL3DBin__CDPack__
+#define __COMSOL3DBin__CDPack__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+//
+//  The most bytes CDPack can produce from n values of size bytes.
+//
+size_t CDPackBound(size_t n, int size);
+//
+//  Pack n values of size bytes each, nComp components to a point, from
+//  vals into out, which must hold CDPackBound(n, size) bytes. Returns
+//  the number of bytes used.
+//
+size_t CDPack(const void* vals, size_t n, int size, int nComp,
+              unsigned char* out);
+//
+//  Unpack inLength bytes from in into n values. Returns false if the
+//  packed data are not exactly n values long.
+//
+bool CDUnpack(const unsigned char* in, size_t inLength, void* vals,
+              size_t n, int size, int nComp);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* defined(__COMSOL3DBin__CDPack__) */
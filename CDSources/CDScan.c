@@ -0,0 +1,716 @@
+//
+//  CDScan.c
+//  COMSOL3DBin
+//
+//  Fast buffered reader for the numeric body of COMSOL (and FEMM) text
+//  exports. See CDScan.h for the overall plan.
+//
+//  The number parser follows the scheme in D. Lemire, "Number parsing at
+//  a gigabyte per second", Software: Practice and Experience 51 (2021).
+//  We collect up to 19 significant digits into a 64 bit integer w and a
+//  decimal exponent q so that the value is w * 10^q. Then
+//   1. if w < 2^53 and |q| <= 22 both w and 10^q are exact doubles and a
+//      single multiply or divide gives the correctly rounded result
+//      (Clinger's fast path).
+//   2. otherwise we multiply w by a 128 bit truncation of 5^q and pick
+//      the rounded binary mantissa out of the top bits of the product
+//      (Eisel-Lemire). With an exact w this is always right.
+//   3. anything else goes to strtod.
+//  The table of powers of five only covers 10^-96 to 10^96. Field maps
+//  never need more and values outside that simply take the slow path.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <float.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "CDScan.h"
+
+//
+//  How much we read at a time and how much must be left in the buffer
+//  before we trust a token not to be cut off by the end of the block.
+//
+#define kCDScanBuffSize (1 << 20)
+#define kCDScanMinAvail 256
+//
+//  How far a mapped scanner moves between giving pages back.
+//
+#define kCDScanReleaseSize (4 << 20)
+//
+//  Range of the power of five table.
+//
+#define kCDMinPow5 (-96)
+#define kCDMaxPow5 96
+
+//
+//  Helpers.
+//
+static bool Refill(CDScan* s);
+static void Release(CDScan* s);
+static void SkipSpace(CDScan* s);
+static const char* SlowParse(const char* p, const char* end, double* v);
+static bool EiselLemire(uint64_t w, int q, uint64_t* bits);
+static void Mul128(uint64_t a, uint64_t b, uint64_t* hi, uint64_t* lo);
+static int LeadingZeros(uint64_t w);
+
+#define IsDigit(c) ((unsigned) ((c) - '0') < 10)
+#define IsSpace(c) (((c) == ' ') || ((c) == '\t') || ((c) == '\n') || \
+                    ((c) == '\r') || ((c) == '\v') || ((c) == '\f'))
+
+//
+//  Exact powers of ten for the Clinger fast path.
+//
+static const double sPow10[23] = {
+  1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+//
+//  128 bit approximations of 5^q, most significant bit set, high word
+//  first. For q >= 0 they are truncated, for q < 0 they are rounded up
+//  as Lemire requires. Generated with the table_generation script from
+//  the fast_float project.
+//
+static const uint64_t sPow5[kCDMaxPow5 - kCDMinPow5 + 1][2] = {
+  {0x88b402f7fd75539bULL, 0x11dbcb0218ebb414ULL}, /* 5^-96 */
+  {0xaae103b5fcd2a881ULL, 0xd652bdc29f26a119ULL}, /* 5^-95 */
+  {0xd59944a37c0752a2ULL, 0x4be76d3346f0495fULL}, /* 5^-94 */
+  {0x857fcae62d8493a5ULL, 0x6f70a4400c562ddbULL}, /* 5^-93 */
+  {0xa6dfbd9fb8e5b88eULL, 0xcb4ccd500f6bb952ULL}, /* 5^-92 */
+  {0xd097ad07a71f26b2ULL, 0x7e2000a41346a7a7ULL}, /* 5^-91 */
+  {0x825ecc24c873782fULL, 0x8ed400668c0c28c8ULL}, /* 5^-90 */
+  {0xa2f67f2dfa90563bULL, 0x728900802f0f32faULL}, /* 5^-89 */
+  {0xcbb41ef979346bcaULL, 0x4f2b40a03ad2ffb9ULL}, /* 5^-88 */
+  {0xfea126b7d78186bcULL, 0xe2f610c84987bfa8ULL}, /* 5^-87 */
+  {0x9f24b832e6b0f436ULL, 0x0dd9ca7d2df4d7c9ULL}, /* 5^-86 */
+  {0xc6ede63fa05d3143ULL, 0x91503d1c79720dbbULL}, /* 5^-85 */
+  {0xf8a95fcf88747d94ULL, 0x75a44c6397ce912aULL}, /* 5^-84 */
+  {0x9b69dbe1b548ce7cULL, 0xc986afbe3ee11abaULL}, /* 5^-83 */
+  {0xc24452da229b021bULL, 0xfbe85badce996168ULL}, /* 5^-82 */
+  {0xf2d56790ab41c2a2ULL, 0xfae27299423fb9c3ULL}, /* 5^-81 */
+  {0x97c560ba6b0919a5ULL, 0xdccd879fc967d41aULL}, /* 5^-80 */
+  {0xbdb6b8e905cb600fULL, 0x5400e987bbc1c920ULL}, /* 5^-79 */
+  {0xed246723473e3813ULL, 0x290123e9aab23b68ULL}, /* 5^-78 */
+  {0x9436c0760c86e30bULL, 0xf9a0b6720aaf6521ULL}, /* 5^-77 */
+  {0xb94470938fa89bceULL, 0xf808e40e8d5b3e69ULL}, /* 5^-76 */
+  {0xe7958cb87392c2c2ULL, 0xb60b1d1230b20e04ULL}, /* 5^-75 */
+  {0x90bd77f3483bb9b9ULL, 0xb1c6f22b5e6f48c2ULL}, /* 5^-74 */
+  {0xb4ecd5f01a4aa828ULL, 0x1e38aeb6360b1af3ULL}, /* 5^-73 */
+  {0xe2280b6c20dd5232ULL, 0x25c6da63c38de1b0ULL}, /* 5^-72 */
+  {0x8d590723948a535fULL, 0x579c487e5a38ad0eULL}, /* 5^-71 */
+  {0xb0af48ec79ace837ULL, 0x2d835a9df0c6d851ULL}, /* 5^-70 */
+  {0xdcdb1b2798182244ULL, 0xf8e431456cf88e65ULL}, /* 5^-69 */
+  {0x8a08f0f8bf0f156bULL, 0x1b8e9ecb641b58ffULL}, /* 5^-68 */
+  {0xac8b2d36eed2dac5ULL, 0xe272467e3d222f3fULL}, /* 5^-67 */
+  {0xd7adf884aa879177ULL, 0x5b0ed81dcc6abb0fULL}, /* 5^-66 */
+  {0x86ccbb52ea94baeaULL, 0x98e947129fc2b4e9ULL}, /* 5^-65 */
+  {0xa87fea27a539e9a5ULL, 0x3f2398d747b36224ULL}, /* 5^-64 */
+  {0xd29fe4b18e88640eULL, 0x8eec7f0d19a03aadULL}, /* 5^-63 */
+  {0x83a3eeeef9153e89ULL, 0x1953cf68300424acULL}, /* 5^-62 */
+  {0xa48ceaaab75a8e2bULL, 0x5fa8c3423c052dd7ULL}, /* 5^-61 */
+  {0xcdb02555653131b6ULL, 0x3792f412cb06794dULL}, /* 5^-60 */
+  {0x808e17555f3ebf11ULL, 0xe2bbd88bbee40bd0ULL}, /* 5^-59 */
+  {0xa0b19d2ab70e6ed6ULL, 0x5b6aceaeae9d0ec4ULL}, /* 5^-58 */
+  {0xc8de047564d20a8bULL, 0xf245825a5a445275ULL}, /* 5^-57 */
+  {0xfb158592be068d2eULL, 0xeed6e2f0f0d56712ULL}, /* 5^-56 */
+  {0x9ced737bb6c4183dULL, 0x55464dd69685606bULL}, /* 5^-55 */
+  {0xc428d05aa4751e4cULL, 0xaa97e14c3c26b886ULL}, /* 5^-54 */
+  {0xf53304714d9265dfULL, 0xd53dd99f4b3066a8ULL}, /* 5^-53 */
+  {0x993fe2c6d07b7fabULL, 0xe546a8038efe4029ULL}, /* 5^-52 */
+  {0xbf8fdb78849a5f96ULL, 0xde98520472bdd033ULL}, /* 5^-51 */
+  {0xef73d256a5c0f77cULL, 0x963e66858f6d4440ULL}, /* 5^-50 */
+  {0x95a8637627989aadULL, 0xdde7001379a44aa8ULL}, /* 5^-49 */
+  {0xbb127c53b17ec159ULL, 0x5560c018580d5d52ULL}, /* 5^-48 */
+  {0xe9d71b689dde71afULL, 0xaab8f01e6e10b4a6ULL}, /* 5^-47 */
+  {0x9226712162ab070dULL, 0xcab3961304ca70e8ULL}, /* 5^-46 */
+  {0xb6b00d69bb55c8d1ULL, 0x3d607b97c5fd0d22ULL}, /* 5^-45 */
+  {0xe45c10c42a2b3b05ULL, 0x8cb89a7db77c506aULL}, /* 5^-44 */
+  {0x8eb98a7a9a5b04e3ULL, 0x77f3608e92adb242ULL}, /* 5^-43 */
+  {0xb267ed1940f1c61cULL, 0x55f038b237591ed3ULL}, /* 5^-42 */
+  {0xdf01e85f912e37a3ULL, 0x6b6c46dec52f6688ULL}, /* 5^-41 */
+  {0x8b61313bbabce2c6ULL, 0x2323ac4b3b3da015ULL}, /* 5^-40 */
+  {0xae397d8aa96c1b77ULL, 0xabec975e0a0d081aULL}, /* 5^-39 */
+  {0xd9c7dced53c72255ULL, 0x96e7bd358c904a21ULL}, /* 5^-38 */
+  {0x881cea14545c7575ULL, 0x7e50d64177da2e54ULL}, /* 5^-37 */
+  {0xaa242499697392d2ULL, 0xdde50bd1d5d0b9e9ULL}, /* 5^-36 */
+  {0xd4ad2dbfc3d07787ULL, 0x955e4ec64b44e864ULL}, /* 5^-35 */
+  {0x84ec3c97da624ab4ULL, 0xbd5af13bef0b113eULL}, /* 5^-34 */
+  {0xa6274bbdd0fadd61ULL, 0xecb1ad8aeacdd58eULL}, /* 5^-33 */
+  {0xcfb11ead453994baULL, 0x67de18eda5814af2ULL}, /* 5^-32 */
+  {0x81ceb32c4b43fcf4ULL, 0x80eacf948770ced7ULL}, /* 5^-31 */
+  {0xa2425ff75e14fc31ULL, 0xa1258379a94d028dULL}, /* 5^-30 */
+  {0xcad2f7f5359a3b3eULL, 0x096ee45813a04330ULL}, /* 5^-29 */
+  {0xfd87b5f28300ca0dULL, 0x8bca9d6e188853fcULL}, /* 5^-28 */
+  {0x9e74d1b791e07e48ULL, 0x775ea264cf55347eULL}, /* 5^-27 */
+  {0xc612062576589ddaULL, 0x95364afe032a819eULL}, /* 5^-26 */
+  {0xf79687aed3eec551ULL, 0x3a83ddbd83f52205ULL}, /* 5^-25 */
+  {0x9abe14cd44753b52ULL, 0xc4926a9672793543ULL}, /* 5^-24 */
+  {0xc16d9a0095928a27ULL, 0x75b7053c0f178294ULL}, /* 5^-23 */
+  {0xf1c90080baf72cb1ULL, 0x5324c68b12dd6339ULL}, /* 5^-22 */
+  {0x971da05074da7beeULL, 0xd3f6fc16ebca5e04ULL}, /* 5^-21 */
+  {0xbce5086492111aeaULL, 0x88f4bb1ca6bcf585ULL}, /* 5^-20 */
+  {0xec1e4a7db69561a5ULL, 0x2b31e9e3d06c32e6ULL}, /* 5^-19 */
+  {0x9392ee8e921d5d07ULL, 0x3aff322e62439fd0ULL}, /* 5^-18 */
+  {0xb877aa3236a4b449ULL, 0x09befeb9fad487c3ULL}, /* 5^-17 */
+  {0xe69594bec44de15bULL, 0x4c2ebe687989a9b4ULL}, /* 5^-16 */
+  {0x901d7cf73ab0acd9ULL, 0x0f9d37014bf60a11ULL}, /* 5^-15 */
+  {0xb424dc35095cd80fULL, 0x538484c19ef38c95ULL}, /* 5^-14 */
+  {0xe12e13424bb40e13ULL, 0x2865a5f206b06fbaULL}, /* 5^-13 */
+  {0x8cbccc096f5088cbULL, 0xf93f87b7442e45d4ULL}, /* 5^-12 */
+  {0xafebff0bcb24aafeULL, 0xf78f69a51539d749ULL}, /* 5^-11 */
+  {0xdbe6fecebdedd5beULL, 0xb573440e5a884d1cULL}, /* 5^-10 */
+  {0x89705f4136b4a597ULL, 0x31680a88f8953031ULL}, /* 5^-9 */
+  {0xabcc77118461cefcULL, 0xfdc20d2b36ba7c3eULL}, /* 5^-8 */
+  {0xd6bf94d5e57a42bcULL, 0x3d32907604691b4dULL}, /* 5^-7 */
+  {0x8637bd05af6c69b5ULL, 0xa63f9a49c2c1b110ULL}, /* 5^-6 */
+  {0xa7c5ac471b478423ULL, 0x0fcf80dc33721d54ULL}, /* 5^-5 */
+  {0xd1b71758e219652bULL, 0xd3c36113404ea4a9ULL}, /* 5^-4 */
+  {0x83126e978d4fdf3bULL, 0x645a1cac083126eaULL}, /* 5^-3 */
+  {0xa3d70a3d70a3d70aULL, 0x3d70a3d70a3d70a4ULL}, /* 5^-2 */
+  {0xccccccccccccccccULL, 0xcccccccccccccccdULL}, /* 5^-1 */
+  {0x8000000000000000ULL, 0x0000000000000000ULL}, /* 5^0 */
+  {0xa000000000000000ULL, 0x0000000000000000ULL}, /* 5^1 */
+  {0xc800000000000000ULL, 0x0000000000000000ULL}, /* 5^2 */
+  {0xfa00000000000000ULL, 0x0000000000000000ULL}, /* 5^3 */
+  {0x9c40000000000000ULL, 0x0000000000000000ULL}, /* 5^4 */
+  {0xc350000000000000ULL, 0x0000000000000000ULL}, /* 5^5 */
+  {0xf424000000000000ULL, 0x0000000000000000ULL}, /* 5^6 */
+  {0x9896800000000000ULL, 0x0000000000000000ULL}, /* 5^7 */
+  {0xbebc200000000000ULL, 0x0000000000000000ULL}, /* 5^8 */
+  {0xee6b280000000000ULL, 0x0000000000000000ULL}, /* 5^9 */
+  {0x9502f90000000000ULL, 0x0000000000000000ULL}, /* 5^10 */
+  {0xba43b74000000000ULL, 0x0000000000000000ULL}, /* 5^11 */
+  {0xe8d4a51000000000ULL, 0x0000000000000000ULL}, /* 5^12 */
+  {0x9184e72a00000000ULL, 0x0000000000000000ULL}, /* 5^13 */
+  {0xb5e620f480000000ULL, 0x0000000000000000ULL}, /* 5^14 */
+  {0xe35fa931a0000000ULL, 0x0000000000000000ULL}, /* 5^15 */
+  {0x8e1bc9bf04000000ULL, 0x0000000000000000ULL}, /* 5^16 */
+  {0xb1a2bc2ec5000000ULL, 0x0000000000000000ULL}, /* 5^17 */
+  {0xde0b6b3a76400000ULL, 0x0000000000000000ULL}, /* 5^18 */
+  {0x8ac7230489e80000ULL, 0x0000000000000000ULL}, /* 5^19 */
+  {0xad78ebc5ac620000ULL, 0x0000000000000000ULL}, /* 5^20 */
+  {0xd8d726b7177a8000ULL, 0x0000000000000000ULL}, /* 5^21 */
+  {0x878678326eac9000ULL, 0x0000000000000000ULL}, /* 5^22 */
+  {0xa968163f0a57b400ULL, 0x0000000000000000ULL}, /* 5^23 */
+  {0xd3c21bcecceda100ULL, 0x0000000000000000ULL}, /* 5^24 */
+  {0x84595161401484a0ULL, 0x0000000000000000ULL}, /* 5^25 */
+  {0xa56fa5b99019a5c8ULL, 0x0000000000000000ULL}, /* 5^26 */
+  {0xcecb8f27f4200f3aULL, 0x0000000000000000ULL}, /* 5^27 */
+  {0x813f3978f8940984ULL, 0x4000000000000000ULL}, /* 5^28 */
+  {0xa18f07d736b90be5ULL, 0x5000000000000000ULL}, /* 5^29 */
+  {0xc9f2c9cd04674edeULL, 0xa400000000000000ULL}, /* 5^30 */
+  {0xfc6f7c4045812296ULL, 0x4d00000000000000ULL}, /* 5^31 */
+  {0x9dc5ada82b70b59dULL, 0xf020000000000000ULL}, /* 5^32 */
+  {0xc5371912364ce305ULL, 0x6c28000000000000ULL}, /* 5^33 */
+  {0xf684df56c3e01bc6ULL, 0xc732000000000000ULL}, /* 5^34 */
+  {0x9a130b963a6c115cULL, 0x3c7f400000000000ULL}, /* 5^35 */
+  {0xc097ce7bc90715b3ULL, 0x4b9f100000000000ULL}, /* 5^36 */
+  {0xf0bdc21abb48db20ULL, 0x1e86d40000000000ULL}, /* 5^37 */
+  {0x96769950b50d88f4ULL, 0x1314448000000000ULL}, /* 5^38 */
+  {0xbc143fa4e250eb31ULL, 0x17d955a000000000ULL}, /* 5^39 */
+  {0xeb194f8e1ae525fdULL, 0x5dcfab0800000000ULL}, /* 5^40 */
+  {0x92efd1b8d0cf37beULL, 0x5aa1cae500000000ULL}, /* 5^41 */
+  {0xb7abc627050305adULL, 0xf14a3d9e40000000ULL}, /* 5^42 */
+  {0xe596b7b0c643c719ULL, 0x6d9ccd05d0000000ULL}, /* 5^43 */
+  {0x8f7e32ce7bea5c6fULL, 0xe4820023a2000000ULL}, /* 5^44 */
+  {0xb35dbf821ae4f38bULL, 0xdda2802c8a800000ULL}, /* 5^45 */
+  {0xe0352f62a19e306eULL, 0xd50b2037ad200000ULL}, /* 5^46 */
+  {0x8c213d9da502de45ULL, 0x4526f422cc340000ULL}, /* 5^47 */
+  {0xaf298d050e4395d6ULL, 0x9670b12b7f410000ULL}, /* 5^48 */
+  {0xdaf3f04651d47b4cULL, 0x3c0cdd765f114000ULL}, /* 5^49 */
+  {0x88d8762bf324cd0fULL, 0xa5880a69fb6ac800ULL}, /* 5^50 */
+  {0xab0e93b6efee0053ULL, 0x8eea0d047a457a00ULL}, /* 5^51 */
+  {0xd5d238a4abe98068ULL, 0x72a4904598d6d880ULL}, /* 5^52 */
+  {0x85a36366eb71f041ULL, 0x47a6da2b7f864750ULL}, /* 5^53 */
+  {0xa70c3c40a64e6c51ULL, 0x999090b65f67d924ULL}, /* 5^54 */
+  {0xd0cf4b50cfe20765ULL, 0xfff4b4e3f741cf6dULL}, /* 5^55 */
+  {0x82818f1281ed449fULL, 0xbff8f10e7a8921a4ULL}, /* 5^56 */
+  {0xa321f2d7226895c7ULL, 0xaff72d52192b6a0dULL}, /* 5^57 */
+  {0xcbea6f8ceb02bb39ULL, 0x9bf4f8a69f764490ULL}, /* 5^58 */
+  {0xfee50b7025c36a08ULL, 0x02f236d04753d5b4ULL}, /* 5^59 */
+  {0x9f4f2726179a2245ULL, 0x01d762422c946590ULL}, /* 5^60 */
+  {0xc722f0ef9d80aad6ULL, 0x424d3ad2b7b97ef5ULL}, /* 5^61 */
+  {0xf8ebad2b84e0d58bULL, 0xd2e0898765a7deb2ULL}, /* 5^62 */
+  {0x9b934c3b330c8577ULL, 0x63cc55f49f88eb2fULL}, /* 5^63 */
+  {0xc2781f49ffcfa6d5ULL, 0x3cbf6b71c76b25fbULL}, /* 5^64 */
+  {0xf316271c7fc3908aULL, 0x8bef464e3945ef7aULL}, /* 5^65 */
+  {0x97edd871cfda3a56ULL, 0x97758bf0e3cbb5acULL}, /* 5^66 */
+  {0xbde94e8e43d0c8ecULL, 0x3d52eeed1cbea317ULL}, /* 5^67 */
+  {0xed63a231d4c4fb27ULL, 0x4ca7aaa863ee4bddULL}, /* 5^68 */
+  {0x945e455f24fb1cf8ULL, 0x8fe8caa93e74ef6aULL}, /* 5^69 */
+  {0xb975d6b6ee39e436ULL, 0xb3e2fd538e122b44ULL}, /* 5^70 */
+  {0xe7d34c64a9c85d44ULL, 0x60dbbca87196b616ULL}, /* 5^71 */
+  {0x90e40fbeea1d3a4aULL, 0xbc8955e946fe31cdULL}, /* 5^72 */
+  {0xb51d13aea4a488ddULL, 0x6babab6398bdbe41ULL}, /* 5^73 */
+  {0xe264589a4dcdab14ULL, 0xc696963c7eed2dd1ULL}, /* 5^74 */
+  {0x8d7eb76070a08aecULL, 0xfc1e1de5cf543ca2ULL}, /* 5^75 */
+  {0xb0de65388cc8ada8ULL, 0x3b25a55f43294bcbULL}, /* 5^76 */
+  {0xdd15fe86affad912ULL, 0x49ef0eb713f39ebeULL}, /* 5^77 */
+  {0x8a2dbf142dfcc7abULL, 0x6e3569326c784337ULL}, /* 5^78 */
+  {0xacb92ed9397bf996ULL, 0x49c2c37f07965404ULL}, /* 5^79 */
+  {0xd7e77a8f87daf7fbULL, 0xdc33745ec97be906ULL}, /* 5^80 */
+  {0x86f0ac99b4e8dafdULL, 0x69a028bb3ded71a3ULL}, /* 5^81 */
+  {0xa8acd7c0222311bcULL, 0xc40832ea0d68ce0cULL}, /* 5^82 */
+  {0xd2d80db02aabd62bULL, 0xf50a3fa490c30190ULL}, /* 5^83 */
+  {0x83c7088e1aab65dbULL, 0x792667c6da79e0faULL}, /* 5^84 */
+  {0xa4b8cab1a1563f52ULL, 0x577001b891185938ULL}, /* 5^85 */
+  {0xcde6fd5e09abcf26ULL, 0xed4c0226b55e6f86ULL}, /* 5^86 */
+  {0x80b05e5ac60b6178ULL, 0x544f8158315b05b4ULL}, /* 5^87 */
+  {0xa0dc75f1778e39d6ULL, 0x696361ae3db1c721ULL}, /* 5^88 */
+  {0xc913936dd571c84cULL, 0x03bc3a19cd1e38e9ULL}, /* 5^89 */
+  {0xfb5878494ace3a5fULL, 0x04ab48a04065c723ULL}, /* 5^90 */
+  {0x9d174b2dcec0e47bULL, 0x62eb0d64283f9c76ULL}, /* 5^91 */
+  {0xc45d1df942711d9aULL, 0x3ba5d0bd324f8394ULL}, /* 5^92 */
+  {0xf5746577930d6500ULL, 0xca8f44ec7ee36479ULL}, /* 5^93 */
+  {0x9968bf6abbe85f20ULL, 0x7e998b13cf4e1ecbULL}, /* 5^94 */
+  {0xbfc2ef456ae276e8ULL, 0x9e3fedd8c321a67eULL}, /* 5^95 */
+  {0xefb3ab16c59b14a2ULL, 0xc5cfe94ef3ea101eULL}, /* 5^96 */
+};
+
+/****************************************************************/
+//
+//  Scanner.
+//
+/****************************************************************/
+bool CDScanInit(CDScan* s, FILE* ifp)
+{
+  if (CDScanInitMapped(s, ifp)) {
+    return true;
+  }
+  return CDScanInitBuffered(s, ifp);
+}
+//
+//  Map the whole file read-only and start scanning at the current
+//  position of the FILE.
+//
+bool CDScanInitMapped(CDScan* s, FILE* ifp)
+{
+  struct stat st;
+  long offset = ftell(ifp);
+  void* map;
+  s->mFile = ifp;
+  s->mBuff = NULL;
+  s->mBuffSize = 0;
+  s->mMap = NULL;
+  s->mMapLength = 0;
+  s->mPos = s->mEnd = NULL;
+  s->mDone = s->mNextDone = NULL;
+  s->mEOF = true;
+  if ((offset < 0) || (fstat(fileno(ifp), &st) != 0) ||
+      !S_ISREG(st.st_mode) || (st.st_size <= offset)) {
+    return false;
+  }
+  map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+             fileno(ifp), 0);
+  if (MAP_FAILED == map) {
+    return false;
+  }
+  madvise(map, (size_t) st.st_size, MADV_SEQUENTIAL);
+  s->mMap = map;
+  s->mMapLength = (size_t) st.st_size;
+  s->mPos = (const char*) map + offset;
+  s->mEnd = (const char*) map + st.st_size;
+  s->mDone = (const char*) map;
+  s->mNextDone = s->mPos + kCDScanReleaseSize;
+  return true;
+}
+
+bool CDScanInitBuffered(CDScan* s, FILE* ifp)
+{
+  s->mFile = ifp;
+  s->mEOF = false;
+  s->mMap = NULL;
+  s->mMapLength = 0;
+  s->mBuffSize = kCDScanBuffSize;
+  s->mBuff = (char*) malloc(s->mBuffSize + 1);
+  if (NULL == s->mBuff) {
+    return false;
+  }
+  s->mBuff[0] = 0;
+  s->mPos = s->mEnd = s->mBuff;
+  s->mDone = s->mNextDone = NULL;
+  return true;
+}
+
+void CDScanInitText(CDScan* s, const char* start, const char* end,
+                    bool mapped)
+{
+  s->mFile = NULL;
+  s->mBuff = NULL;
+  s->mBuffSize = 0;
+  s->mMap = NULL;
+  s->mMapLength = 0;
+  s->mPos = start;
+  s->mEnd = end;
+  s->mDone = start;
+  s->mNextDone = mapped ? start + kCDScanReleaseSize : NULL;
+  s->mEOF = true;
+}
+
+void CDScanFinish(CDScan* s)
+{
+  if ((NULL == s->mMap) && (NULL != s->mNextDone)) {
+    s->mPos = s->mEnd;
+    Release(s);
+  }
+  if (NULL != s->mBuff) {
+    free(s->mBuff);
+    s->mBuff = NULL;
+  }
+  if (NULL != s->mMap) {
+    munmap(s->mMap, s->mMapLength);
+    s->mMap = NULL;
+  }
+  s->mPos = s->mEnd = NULL;
+}
+//
+//  Read the next number. We top the buffer up whenever less than
+//  kCDScanMinAvail characters remain so that CDParseDouble always
+//  sees a whole token.
+//
+bool CDScanDouble(CDScan* s, double* v)
+{
+  const char* p;
+  SkipSpace(s);
+  if (s->mPos >= s->mEnd) {
+    return false;
+  }
+  p = CDParseDouble(s->mPos, s->mEnd, v);
+  if (NULL == p) {
+    return false;
+  }
+  s->mPos = p;
+  if ((NULL != s->mNextDone) && (p >= s->mNextDone)) {
+    Release(s);
+  }
+  return true;
+}
+
+bool CDScanAtEnd(CDScan* s)
+{
+  SkipSpace(s);
+  return s->mPos >= s->mEnd;
+}
+//
+//  Count in steps so that a mapped scanner can give pages back between
+//  them. inToken carries a token that straddles a step.
+//
+size_t CDScanCountTokens(CDScan* s)
+{
+  size_t n = 0;
+  bool inToken = false;
+  const char* p = s->mPos;
+  const char* stop;
+  while (p < s->mEnd) {
+    stop = s->mEnd;
+    if ((NULL != s->mNextDone) && (s->mNextDone < stop)) {
+      stop = s->mNextDone;
+    }
+    for (; p < stop; p++) {
+      if (IsSpace(*p)) {
+        inToken = false;
+      } else if (!inToken) {
+        inToken = true;
+        n++;
+      }
+    }
+    s->mPos = p;
+    if ((NULL != s->mNextDone) && (p >= s->mNextDone)) {
+      Release(s);
+    }
+  }
+  return n;
+}
+//
+//  Step over white space, refilling as we go. A mapped file is always
+//  at EOF so it never refills.
+//
+static void SkipSpace(CDScan* s)
+{
+  const char* p;
+  for (;;) {
+    p = s->mPos;
+    while ((p < s->mEnd) && IsSpace(*p)) {
+      p++;
+    }
+    s->mPos = p;
+    if ((s->mEnd - p >= kCDScanMinAvail) || s->mEOF) {
+      break;
+    }
+    Refill(s);
+  }
+}
+//
+//  Give back the whole pages of mapped text between mDone and mPos. They
+//  are still in the page cache, and come straight back if anyone looks
+//  at them again, but they no longer count against us.
+//
+static void Release(CDScan* s)
+{
+  uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+  uintptr_t from = ((uintptr_t) s->mDone + page - 1) & ~(page - 1);
+  uintptr_t to = (uintptr_t) s->mPos & ~(page - 1);
+  if (to > from) {
+    madvise((void*) from, to - from, MADV_DONTNEED);
+    s->mDone = (const char*) to;
+  }
+  s->mNextDone = s->mPos + kCDScanReleaseSize;
+}
+//
+//  Slide the unread tail to the front of the buffer and fill the
+//  rest from the file.
+//
+static bool Refill(CDScan* s)
+{
+  size_t nLeft = s->mEnd - s->mPos;
+  size_t nRead;
+  memmove(s->mBuff, s->mPos, nLeft);
+  nRead = fread(s->mBuff + nLeft, 1, s->mBuffSize - nLeft, s->mFile);
+  if (nRead < s->mBuffSize - nLeft) {
+    s->mEOF = true;
+  }
+  s->mPos = s->mBuff;
+  s->mEnd = s->mBuff + nLeft + nRead;
+  s->mBuff[nLeft + nRead] = 0;
+  return nRead > 0;
+}
+
+/****************************************************************/
+//
+//  Parser.
+//
+/****************************************************************/
+const char* CDParseDouble(const char* p, const char* end, double* v)
+{
+  const char* start = p;
+  bool negative = false;
+  bool anyDigit = false;
+  bool truncated = false;
+  uint64_t w = 0;
+  uint64_t bits;
+  int nDigit = 0;           // Significant digits held in w
+  int q = 0;                // Decimal exponent
+  double d;
+  if ((p < end) && ((*p == '-') || (*p == '+'))) {
+    negative = (*p == '-');
+    p++;
+  }
+  //
+  //  Integer part. Leading zeros are not significant.
+  //
+  while ((p < end) && (*p == '0')) {
+    anyDigit = true;
+    p++;
+  }
+  while ((p < end) && IsDigit(*p)) {
+    if (nDigit < 19) {
+      w = w * 10 + (*p - '0');
+      nDigit++;
+    } else {
+      q++;
+      if (*p != '0') {
+        truncated = true;
+      }
+    }
+    anyDigit = true;
+    p++;
+  }
+  //
+  //  Fraction.
+  //
+  if ((p < end) && (*p == '.')) {
+    p++;
+    if (nDigit == 0) {
+      while ((p < end) && (*p == '0')) {
+        anyDigit = true;
+        q--;
+        p++;
+      }
+    }
+    while ((p < end) && IsDigit(*p)) {
+      if (nDigit < 19) {
+        w = w * 10 + (*p - '0');
+        nDigit++;
+        q--;
+      } else if (*p != '0') {
+        truncated = true;
+      }
+      anyDigit = true;
+      p++;
+    }
+  }
+  if (!anyDigit) {
+    //
+    //  Could be nan or inf. Let the library decide.
+    //
+    return SlowParse(start, end, v);
+  }
+  //
+  //  Exponent. An 'e' with no digits after it is not part of the number.
+  //
+  if ((p < end) && ((*p == 'e') || (*p == 'E'))) {
+    const char* ep = p + 1;
+    bool eNeg = false;
+    int e = 0;
+    if ((ep < end) && ((*ep == '-') || (*ep == '+'))) {
+      eNeg = (*ep == '-');
+      ep++;
+    }
+    if ((ep < end) && IsDigit(*ep)) {
+      while ((ep < end) && IsDigit(*ep)) {
+        if (e < 100000) {
+          e = e * 10 + (*ep - '0');
+        }
+        ep++;
+      }
+      q += eNeg ? -e : e;
+      p = ep;
+    }
+  }
+  if (truncated) {
+    return SlowParse(start, end, v);
+  }
+  if (w == 0) {
+    *v = negative ? -0.0 : 0.0;
+    return p;
+  }
+  //
+  //  Clinger's fast path needs arithmetic done in plain double.
+  //
+#if (defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0)) || \
+    (defined(__FLT_EVAL_METHOD__) && (__FLT_EVAL_METHOD__ == 0))
+  if ((w <= ((uint64_t) 1 << 53)) && (q >= -22) && (q <= 22)) {
+    d = (double) w;
+    if (q < 0) {
+      d /= sPow10[-q];
+    } else {
+      d *= sPow10[q];
+    }
+    *v = negative ? -d : d;
+    return p;
+  }
+#endif
+  if ((q >= kCDMinPow5) && (q <= kCDMaxPow5) && EiselLemire(w, q, &bits)) {
+    if (negative) {
+      bits |= (uint64_t) 1 << 63;
+    }
+    memcpy(&d, &bits, sizeof(d));
+    *v = d;
+    return p;
+  }
+  return SlowParse(start, end, v);
+}
+//
+//  strtod needs a NUL terminated string so copy the token out first.
+//  Absurdly long tokens get a buffer from the heap.
+//
+static const char* SlowParse(const char* p, const char* end, double* v)
+{
+  char token[256];
+  char* buff = token;
+  char* stop;
+  size_t n = 0;
+  while ((p + n < end) && !IsSpace(p[n])) {
+    n++;
+  }
+  if (n >= sizeof(token)) {
+    buff = (char*) malloc(n + 1);
+    if (NULL == buff) {
+      return NULL;
+    }
+  }
+  memcpy(buff, p, n);
+  buff[n] = 0;
+  *v = strtod(buff, &stop);
+  n = stop - buff;
+  if (buff != token) {
+    free(buff);
+  }
+  return (n == 0) ? NULL : p + n;
+}
+//
+//  Eisel-Lemire. Produces the IEEE bits of w * 10^q (without the sign)
+//  or returns false if the result would be subnormal or infinite, which
+//  we leave to strtod.
+//
+static bool EiselLemire(uint64_t w, int q, uint64_t* bits)
+{
+  const uint64_t* pow5 = sPow5[q - kCDMinPow5];
+  uint64_t hi, lo, hi2, lo2, mantissa;
+  int lz, upperBit, shift, power2;
+  lz = LeadingZeros(w);
+  w <<= lz;
+  Mul128(w, pow5[0], &hi, &lo);
+  //
+  //  Only when the bits below the 55 we keep are all ones could the
+  //  truncated part of 5^q carry into them. Then refine with the low
+  //  word of the table entry.
+  //
+  if ((hi & 0x1FF) == 0x1FF) {
+    Mul128(w, pow5[1], &hi2, &lo2);
+    lo += hi2;
+    if (hi2 > lo) {
+      hi++;
+    }
+  }
+  upperBit = (int) (hi >> 63);
+  shift = upperBit + 64 - 52 - 3;
+  mantissa = hi >> shift;
+  power2 = ((((152170 + 65536) * q) >> 16) + 63) + upperBit - lz + 1023;
+  if (power2 <= 0) {
+    return false;
+  }
+  //
+  //  Exact halfway cases can only occur for small q and must round to even.
+  //
+  if ((lo <= 1) && (q >= -4) && (q <= 23) && ((mantissa & 3) == 1)) {
+    if ((mantissa << shift) == hi) {
+      mantissa &= ~(uint64_t) 1;
+    }
+  }
+  mantissa += (mantissa & 1);
+  mantissa >>= 1;
+  if (mantissa >= ((uint64_t) 2 << 52)) {
+    mantissa = (uint64_t) 1 << 52;
+    power2++;
+  }
+  mantissa &= ~((uint64_t) 1 << 52);
+  if (power2 >= 0x7FF) {
+    return false;
+  }
+  *bits = mantissa | ((uint64_t) power2 << 52);
+  return true;
+}
+
+static void Mul128(uint64_t a, uint64_t b, uint64_t* hi, uint64_t* lo)
+{
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 r = (unsigned __int128) a * b;
+  *hi = (uint64_t) (r >> 64);
+  *lo = (uint64_t) r;
+#else
+  uint64_t aLo = a & 0xFFFFFFFF, aHi = a >> 32;
+  uint64_t bLo = b & 0xFFFFFFFF, bHi = b >> 32;
+  uint64_t ll = aLo * bLo, lh = aLo * bHi, hl = aHi * bLo, hh = aHi * bHi;
+  uint64_t mid = (ll >> 32) + (lh & 0xFFFFFFFF) + (hl & 0xFFFFFFFF);
+  *lo = (mid << 32) | (ll & 0xFFFFFFFF);
+  *hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+static int LeadingZeros(uint64_t w)
+{
+#if defined(__GNUC__)
+  return __builtin_clzll(w);
+#else
+  int n = 0;
+  while ((w & ((uint64_t) 1 << 63)) == 0) {
+    w <<= 1;
+    n++;
+  }
+  return n;
+#endif
+}
@@ -0,0 +1,103 @@
+//
+//  CDScan.h
+//  COMSOL3DBin
+//
+//  Fast buffered reader for the numeric body of COMSOL (and FEMM) text
+//  exports. Instead of calling fscanf once per value we pull the file in
+//  large blocks and convert the text to doubles with our own parser.
+//  The parser is exact: simple values take the Clinger fast path, longer
+//  mantissas are handled with the Eisel-Lemire 128 bit product method,
+//  and anything it cannot prove correct (more than 19 digits, NaN, Inf,
+//  very large or small exponents) is handed to strtod. Every value is
+//  therefore correctly rounded, just as it was with fscanf.
+//
+//  Wherever it can the scanner memory-maps the whole file and parses
+//  straight out of the mapping, so the text is never copied and several
+//  converters working on the same export share its pages in the page
+//  cache. Pipes and other things that cannot be mapped fall back to
+//  large buffered reads. As a mapped scanner moves through the file it
+//  hands the pages it has finished with back to the system, so reading
+//  a big export doesn't leave the whole text resident.
+//
+
+#ifndef __COMSOL3DBin__CDScan__
+#define __COMSOL3DBin__CDScan__
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+//
+//  A CDScan walks a block of text. mPos is the next unread character
+//  and mEnd is one past the last valid one. For a mapped file the block
+//  is the whole file. Otherwise it lives in mBuff and is topped up from
+//  mFile when it runs low.
+//
+typedef struct CDScanTag {
+  FILE* mFile;              // Where the text comes from
+  char* mBuff;              // Read buffer (NUL terminated at mEnd)
+  size_t mBuffSize;         // Capacity of mBuff
+  void* mMap;               // Mapping of the whole file, or NULL
+  size_t mMapLength;        // and its length
+  const char* mPos;         // Next character to look at
+  const char* mEnd;         // One past last valid character
+  const char* mDone;        // Mapped text before here has been given back
+  const char* mNextDone;    // Give back more when mPos passes this
+  bool mEOF;                // mFile has no more to give us
+} CDScan;
+
+//
+//  Init attaches a scanner to a FILE that is already positioned at the
+//  start of the text to scan (usually just after the header). It maps
+//  the file if it can and otherwise reads it through a buffer. It only
+//  returns false if neither works. The Mapped and Buffered versions
+//  force one way or the other. The FILE may be closed once the scanner
+//  is set up if it was mapped. Every successful call of an Init should
+//  be balanced by a call to CDScanFinish.
+//
+bool CDScanInit(CDScan* s, FILE* ifp);
+bool CDScanInitMapped(CDScan* s, FILE* ifp);
+bool CDScanInitBuffered(CDScan* s, FILE* ifp);
+void CDScanFinish(CDScan* s);
+//
+//  InitText points a scanner at a block of text the caller owns, such as
+//  one slice of a mapped file. It cannot fail and Finish leaves the text
+//  in place, so several scanners can share one mapping. Set mapped only
+//  if the text really is part of a read-only file mapping, since then
+//  the scanner gives pages back as it finishes with them, including
+//  what is left when it is Finished.
+//
+void CDScanInitText(CDScan* s, const char* start, const char* end,
+                    bool mapped);
+//
+//  Skip white space and read the next number. Returns false at end of
+//  input or if the next token is not a number.
+//
+bool CDScanDouble(CDScan* s, double* v);
+//
+//  True if nothing but white space is left.
+//
+bool CDScanAtEnd(CDScan* s);
+//
+//  Count the white space separated tokens left in a mapped or InitText
+//  scanner, leaving it at the end. This is much cheaper than parsing
+//  them and lets us work out where each slice of a file starts in the
+//  data before any of them is converted.
+//
+size_t CDScanCountTokens(CDScan* s);
+//
+//  The parser itself. Converts the number starting at p (no leading
+//  white space) and returns a pointer just past it, or NULL if p does
+//  not start a number. It never reads at or beyond end.
+//
+const char* CDParseDouble(const char* p, const char* end, double* v);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* defined(__COMSOL3DBin__CDScan__) */
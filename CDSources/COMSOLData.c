@@ -30,9 +30,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
 
 //#include "Debug.h"
 #include "COMSOLData.h"
+#include "CDScan.h"
 
 //
 //  These two kludgy globals are used to pass filenames to the binary
@@ -40,6 +44,66 @@
 //
 const char* gFieldFileName = NULL;
 const char* gModelFileName = NULL;
+//
+//  Number of threads to use for the heavy lifting. 0 means one per
+//  online processor.
+//
+int gCDNThread = 0;
+//
+//  We only split the data section between threads if each would get
+//  at least this many bytes of text. Below that the threads cost more
+//  than they save.
+//
+#define kCDMinChunkBytes (1 << 20)
+
+//
+//  One slice of the data section as seen by one reader thread. The
+//  slice runs from mStart to mEnd, both at line boundaries, and holds
+//  mNVal values starting at value number mFirst of the whole file.
+//  Each thread keeps its own range info for the coordinate columns
+//  and they are merged once all the threads are done.
+//
+typedef struct CDChunkTag {
+  CDData* mData;
+  const char* mStart;
+  const char* mEnd;
+  size_t mFirst;            // Index of first value in the file
+  size_t mNVal;             // Number of values in this slice
+  size_t mBad;              // Index of first value we failed to read
+  CDRange* mRange;          // Per-dimension ranges for this slice
+  bool mOK;
+  bool mWritten;            // Our part of the field went out safely
+} CDChunk;
+
+//
+//  When the field goes to a file instead of memory each reader gathers
+//  it in a block of this many values and writes the block out with
+//  pwrite at its place in the file. Keeping the position with the data
+//  means the slices of a parallel read can go out in any order.
+//
+#define kCDOutBlock 4096
+
+typedef struct CDOutTag {
+  CDData* mData;
+  double* mPos;             // Where the next field value goes
+  double* mEnd;             // Flush when mPos gets here (NULL never)
+  double* mBlock;           // Start of the current block
+  size_t mFirst;            // Index of mBlock[0] in the whole field
+  bool mOK;                 // No write has failed
+  double mBuff[kCDOutBlock];
+} CDOut;
+
+static CDError InitData(CDData* dp, const char* fname, bool interleave,
+                        FILE* ofp, long offset);
+static void OutInit(CDOut* o, CDData* dp, size_t first);
+static void OutFlush(CDOut* o);
+
+static CDError ReadSerial(CDData* dp, CDScan* scan, const char* fname);
+static CDError ReadParallel(CDData* dp, CDScan* scan, int nThread,
+                            const char* fname);
+static void* CountChunk(void* arg);
+static void* ReadChunk(void* arg);
+static void RunChunks(CDChunk* chunks, int nChunk, void* (*fn)(void*));
 
 
 /*
@@ -66,104 +130,45 @@ static char sgCDErrorStr[256];
 //  are clearly separate.
 //
 /****************************************************************/
+//
+//  RangeInit sets up a range ready to have values fed to it.
+//
+void CDRangeInit(CDRange* r)
+{
+  r->mMin = DBL_MAX;
+  r->mMax = -DBL_MAX;
+  r->mDelta = 0.0;
+  r->mFirst = 0.0;
+  r->mNRep = 0;
+  r->mNVal = 0;
+  r->mActive = false;
+}
 /*
  *  Init  is passed a filename. It opens the file, parses the header
  *  and then sucks the data into storage.
  */
 CDError CDInit(CDData* dp, const char* fname)
 {
-  CDError theErr;
-  int line, expr, nExpr, i;
-  size_t nChar;
-  dp->mExprNames = NULL;
-  dp->mDStore = NULL;
-  dp->mRange = NULL;
-  dp->mFileName = NULL;
-  //
-  //  Let's try to open the file for reading.
-  //
-  FILE* ifp = fopen(fname, "rt");
-  if (ifp == NULL) {
-    fprintf(stderr, "CDInit: Failed to open file %s.", fname);
-    return kCDCantOpenIn;
-  }
-  gFieldFileName = fname;
-  //
-  //  Store copy of file name.
-  //
-  nChar = strlen(fname);
-  dp->mFileName = (char *) malloc((nChar+2) * sizeof(char));
-  if (dp->mFileName == NULL) {
-    fprintf(stderr, "CDInit: No space for file name %s.", fname);
-    return kCDAllocFailed;
-  }
-  strncpy(dp->mFileName, fname, nChar);
-  dp->mFileName[nChar] = 0;
-  //
-  //  Read in the header.
-  //
-  theErr = CDParseHeader(ifp, dp);
-  if (theErr != kCDNoErr) {
-      sgCDErrorVal = dp->mNHeadline;
-      return kCDIncompleteHeader;
-  }
-
-  //
-  //  Get space for data.
-  //
-  nExpr = dp->mNExpression + dp->mNDimension;
-  dp->mDStore = (double**) malloc(nExpr * sizeof(double *));
-  if (dp->mDStore == NULL) {
-    fprintf(stderr, "CDInit: Failed to get space for %d expressions of data.",
-            nExpr);
-    return kCDAllocFailed;
-  }
-  for (i = 0; i < nExpr; i++) {
-    dp->mDStore[i] = (double *) malloc(dp->mNLine * sizeof(double));
-    if (NULL == dp->mDStore[i]) return kCDAllocFailed;
-  }
-  dp->mRange = (CDRange *) malloc(nExpr * sizeof(CDRange));
-  //
-  //  Read in the data, collecting range info as we go.
-  //  Note that I split the arrays up as I pull them in.
-  //
-  for (expr = 0; expr < nExpr; expr++) {
-    dp->mRange[expr].mMax = -DBL_MAX;
-    dp->mRange[expr].mMin = DBL_MAX;
-  }
-  for (expr = 0; expr < nExpr; expr++) {
-    printf("At %d have %d from %g to %g.\n",
-           expr,
-           dp->mRange[expr].mNVal,
-           dp->mRange[expr].mMin,
-           dp->mRange[expr].mMax);
-  }
-  for (line = 0; line < dp->mNLine; line++) {
-    for (expr = 0; expr < nExpr; expr++) {
-      double v;
-      fscanf(ifp, "%lg", &v);
-      dp->mDStore[expr][line] = v;
-//      printf("%f,",v);
-      if (expr < dp->mNDimension) {
-        if (v < dp->mRange[expr].mMin) {
-          dp->mRange[expr].mMin = v;
-        } else if (v > dp->mRange[expr].mMax) {
-          dp->mRange[expr].mMax = v;
-        }
-      }
-    }
-//  printf("\n");
-  }
-  for (expr = 0; expr < nExpr; expr++) {
-    printf("At %d have %d from %lg to %lg by %lg\n",
-           expr,
-           dp->mRange[expr].mNVal,
-           dp->mRange[expr].mMin,
-           dp->mRange[expr].mMax,
-           dp->mRange[expr].mDelta);
-  }
-  CDAnalyse(dp);
-  return kCDNoErr;
+  return InitData(dp, fname, false, NULL, 0);
+}
+//
+//  InitField reads the same file but only keeps the expressions, stored
+//  interleaved line by line in mField. The coordinates are looked at on
+//  the way past to find the ranges and the grid structure and then
+//  thrown away, so the storage is just the size of the field itself.
+//
+CDError CDInitField(CDData* dp, const char* fname)
+{
+  return InitData(dp, fname, true, NULL, 0);
+}
+//
+//  StreamField is InitField with the field written to ofp, starting
+//  offset bytes in, instead of being kept. Only a block of it is ever
+//  in memory so the file can be bigger than RAM.
+//
+CDError CDStreamField(CDData* dp, const char* fname, FILE* ofp, long offset)
+{
+  return InitData(dp, fname, true, ofp, offset);
 }
 //
 //  CDFinish must be called after any call to CDInit once you are done
@@ -175,15 +180,29 @@ void CDFinish(CDData* dp)
   if (NULL != dp->mExprNames) {
     free(dp->mExprNames);
   }
-  if (dp->mNLine > 0) {
+  if (NULL != dp->mDStore) {
     for (line = 0; line < dp->mNDimension + dp->mNExpression; line++) {
       if (NULL != dp->mDStore[line]) {
         free(dp->mDStore[line]);
       }
     }
     free(dp->mDStore);
-    free(dp->mRange);
   }
+  free(dp->mField);
+  free(dp->mRange);
+}
+//
+//  How many threads to use. Honour gCDNThread if it has been set and
+//  otherwise ask how many processors we have.
+//
+int CDNThread(void)
+{
+  long n;
+  if (gCDNThread > 0) {
+    return gCDNThread;
+  }
+  n = sysconf(_SC_NPROCESSORS_ONLN);
+  return (n > 0) ? (int) n : 1;
 }
 
 /****************************************************************/
@@ -314,6 +333,149 @@ void CDWriteErrorOn(FILE* ofp, CDError theErr)
 //        Internal Helpers
 //
 /****************************************************************/
+/*
+ *  InitData does the work for all the Inits. With interleave false every
+ *  column gets its own array in mDStore. With it true only mField is
+ *  allocated and mDStore stays NULL, unless we have an ofp in which case
+ *  the field goes there and nothing is allocated.
+ */
+static CDError InitData(CDData* dp, const char* fname, bool interleave,
+                        FILE* ofp, long offset)
+{
+  CDError theErr;
+  int expr, nExpr, i, nThread;
+  size_t nChar;
+  CDScan scan;
+  FILE* ifp;
+  dp->mExprNames = NULL;
+  dp->mDStore = NULL;
+  dp->mField = NULL;
+  dp->mRange = NULL;
+  dp->mFileName = NULL;
+  dp->mNLine = 0;
+  dp->mOutFD = -1;
+  dp->mOutOffset = offset;
+  if (NULL != ofp) {
+    if (fflush(ofp) != 0) {
+      fprintf(stderr, "CDInit: Failed to flush output file.\n");
+      return kCDError;
+    }
+    dp->mOutFD = fileno(ofp);
+  }
+  //
+  //  Let's try to open the file for reading.
+  //
+  ifp = fopen(fname, "rt");
+  if (ifp == NULL) {
+    fprintf(stderr, "CDInit: Failed to open file %s.", fname);
+    return kCDCantOpenIn;
+  }
+  gFieldFileName = fname;
+  //
+  //  Store copy of file name.
+  //
+  nChar = strlen(fname);
+  dp->mFileName = (char *) malloc((nChar+2) * sizeof(char));
+  if (dp->mFileName == NULL) {
+    fprintf(stderr, "CDInit: No space for file name %s.", fname);
+    return kCDAllocFailed;
+  }
+  strncpy(dp->mFileName, fname, nChar);
+  dp->mFileName[nChar] = 0;
+  //
+  //  Read in the header.
+  //
+  theErr = CDParseHeader(ifp, dp);
+  if (theErr != kCDNoErr) {
+      sgCDErrorVal = dp->mNHeadline;
+      return kCDIncompleteHeader;
+  }
+
+  //
+  //  Get space for data.
+  //
+  nExpr = dp->mNExpression + dp->mNDimension;
+  if (dp->mOutFD >= 0) {
+    //
+    //  Streaming. Nothing to allocate.
+    //
+  } else if (interleave) {
+    dp->mField = (double*) malloc((size_t) dp->mNLine * dp->mNExpression *
+                                  sizeof(double));
+    if (dp->mField == NULL) {
+      fprintf(stderr, "CDInit: Failed to get space for %d lines of data.",
+              dp->mNLine);
+      return kCDAllocFailed;
+    }
+  } else {
+    dp->mDStore = (double**) malloc(nExpr * sizeof(double *));
+    if (dp->mDStore == NULL) {
+      fprintf(stderr, "CDInit: Failed to get space for %d expressions of data.",
+              nExpr);
+      return kCDAllocFailed;
+    }
+    for (i = 0; i < nExpr; i++) {
+      dp->mDStore[i] = NULL;
+    }
+    for (i = 0; i < nExpr; i++) {
+      dp->mDStore[i] = (double *) malloc(dp->mNLine * sizeof(double));
+      if (NULL == dp->mDStore[i]) return kCDAllocFailed;
+    }
+  }
+  dp->mRange = (CDRange *) malloc(nExpr * sizeof(CDRange));
+  if (dp->mRange == NULL) {
+    return kCDAllocFailed;
+  }
+  //
+  //  Read in the data, collecting range info as we go.
+  //  Note that I split the arrays up as I pull them in.
+  //
+  for (expr = 0; expr < nExpr; expr++) {
+    CDRangeInit(&dp->mRange[expr]);
+  }
+  for (expr = 0; expr < nExpr; expr++) {
+    printf("At %d have %d from %g to %g.\n",
+           expr,
+           dp->mRange[expr].mNVal,
+           dp->mRange[expr].mMin,
+           dp->mRange[expr].mMax);
+  }
+  //
+  //  The data section is pure numbers so we hand it to the fast
+  //  scanner rather than calling fscanf once per value. If the file
+  //  is mapped and big enough we carve it up between several threads.
+  //
+  if (!CDScanInit(&scan, ifp)) {
+    fprintf(stderr, "CDInit: Failed to get space for read buffer.\n");
+    fclose(ifp);
+    return kCDAllocFailed;
+  }
+  nThread = CDNThread();
+  if ((NULL != scan.mMap) && (nThread > 1) &&
+      (scan.mEnd - scan.mPos) / nThread < kCDMinChunkBytes) {
+    nThread = (int) ((scan.mEnd - scan.mPos) / kCDMinChunkBytes);
+  }
+  if ((NULL != scan.mMap) && (nThread > 1)) {
+    theErr = ReadParallel(dp, &scan, nThread, fname);
+  } else {
+    theErr = ReadSerial(dp, &scan, fname);
+  }
+  CDScanFinish(&scan);
+  fclose(ifp);
+  if (theErr != kCDNoErr) {
+    return theErr;
+  }
+  for (expr = 0; expr < nExpr; expr++) {
+    printf("At %d have %d from %lg to %lg by %lg\n",
+           expr,
+           dp->mRange[expr].mNVal,
+           dp->mRange[expr].mMin,
+           dp->mRange[expr].mMax,
+           dp->mRange[expr].mDelta);
+  }
+  CDAnalyse(dp);
+  return kCDNoErr;
+}
 /*
  *  Get info from the file header.
  *  Start by pulling out the info about the numbers of
@@ -439,7 +601,6 @@ CDError CDParseHeader(FILE* ifp, CDData* dp)
 void CDAnalyse(CDData* dp)
 {
   int nRep[3], d;
-  double v;
   int nPoint;
   /*
    *  Let's see if we can figure out the grid structure of the file.
@@ -447,16 +608,13 @@ void CDAnalyse(CDData* dp)
    *  For dimensions that do vary, the lower the dimension number
    *  the faster the variation should be.
    *  We found the ranges of the dimensions as we read them in,
+   *  along with how many lines repeat the first value of each,
    *  so figure out which ones are active.
    */
   for (d = 0; d < dp->mNDimension; d++) {
     if (dp->mRange[d].mMax - dp->mRange[d].mMin > 0) {
       dp->mRange[d].mActive = true;
-      v = dp->mDStore[d][0];
-      nRep[d] = 0;
-      while (dp->mDStore[d][nRep[d]] == v) {
-        nRep[d]++;
-      }
+      nRep[d] = dp->mRange[d].mNRep;
     } else {
       dp->mRange[d].mActive = false;
       nRep[d] = dp->mNLine;
@@ -484,3 +642,353 @@ void CDAnalyse(CDData* dp)
   }
 
 }
+//
+//  Track is fed the value of coordinate dimension d on each line in
+//  turn. As well as the min and max it counts how many lines at the
+//  start share the value on the first, which is what CDAnalyse needs to
+//  work out the grid. The count stops growing at the first change.
+//
+#define Track(r, v, line) \
+  do { \
+    if ((v) < (r)->mMin) { \
+      (r)->mMin = (v); \
+    } \
+    if ((v) > (r)->mMax) { \
+      (r)->mMax = (v); \
+    } \
+    if ((r)->mNRep == 0) { \
+      (r)->mFirst = (v); \
+      (r)->mNRep = 1; \
+    } else if (((r)->mNRep == (unsigned int) (line)) && \
+               ((v) == (r)->mFirst)) { \
+      (r)->mNRep++; \
+    } \
+  } while (0)
+//
+//  Put one field value into an output, flushing it if the block is full.
+//
+#define OutPut(o, v) \
+  do { \
+    *(o)->mPos++ = (v); \
+    if ((o)->mPos == (o)->mEnd) { \
+      OutFlush(o); \
+    } \
+  } while (0)
+//
+//  ReadSerial pulls the data section in one value at a time, collecting
+//  range info as it goes. Note that I split the arrays up as I pull them
+//  in, or, when we only want the field, drop the expressions into mField
+//  in the order they arrive.
+//
+static CDError ReadSerial(CDData* dp, CDScan* scan, const char* fname)
+{
+  int line, expr;
+  int nExpr = dp->mNExpression + dp->mNDimension;
+  CDOut out;
+  double v;
+  OutInit(&out, dp, 0);
+  for (line = 0; line < dp->mNLine; line++) {
+    for (expr = 0; expr < nExpr; expr++) {
+      if (!CDScanDouble(scan, &v)) {
+        fprintf(stderr, "CDInit: Ran out of data at line %d of %s.\n",
+                line, fname);
+        return kCDBadStructure;
+      }
+      if (expr < dp->mNDimension) {
+        Track(&dp->mRange[expr], v, line);
+        if (NULL == out.mPos) {
+          dp->mDStore[expr][line] = v;
+        }
+      } else if (NULL != out.mPos) {
+        OutPut(&out, v);
+      } else {
+        dp->mDStore[expr][line] = v;
+      }
+    }
+  }
+  OutFlush(&out);
+  if (!out.mOK) {
+    fprintf(stderr, "CDInit: Failed to write field from %s.\n", fname);
+    return kCDError;
+  }
+  return kCDNoErr;
+}
+//
+//  ReadParallel splits the mapped data section into nThread slices that
+//  start and end on line boundaries. A first parallel pass counts the
+//  values in each slice so that we know where each one lands in the
+//  output, then a second pass parses them straight into place. Every
+//  thread writes only its own lines and its own ranges so they never
+//  need to talk to each other.
+//
+static CDError ReadParallel(CDData* dp, CDScan* scan, int nThread,
+                            const char* fname)
+{
+  CDChunk* chunks;
+  CDRange* ranges;
+  CDRange* r;
+  const char* p;
+  const char* cut;
+  size_t length = scan->mEnd - scan->mPos;
+  int nExpr = dp->mNExpression + dp->mNDimension;
+  size_t nWant = (size_t) dp->mNLine * nExpr;
+  size_t first = 0, bad, line0;
+  int c, d, nDim = dp->mNDimension;
+  bool repRun[3] = { true, true, true };
+  CDError theErr = kCDNoErr;
+  chunks = (CDChunk*) malloc(nThread * sizeof(CDChunk));
+  ranges = (CDRange*) malloc(nThread * (nDim + 1) * sizeof(CDRange));
+  if ((NULL == chunks) || (NULL == ranges) || (nDim > 3)) {
+    free(chunks);
+    free(ranges);
+    return ReadSerial(dp, scan, fname);
+  }
+  //
+  //  Cut the text into roughly equal slices, pushing each cut forward
+  //  to just past the next newline so that no number is split.
+  //
+  p = scan->mPos;
+  for (c = 0; c < nThread; c++) {
+    chunks[c].mData = dp;
+    chunks[c].mStart = p;
+    if (c == nThread - 1) {
+      cut = scan->mEnd;
+    } else {
+      cut = scan->mPos + length / nThread * (c + 1);
+      if (cut < p) {
+        cut = p;
+      }
+      cut = (const char*) memchr(cut, '\n', scan->mEnd - cut);
+      cut = (NULL == cut) ? scan->mEnd : cut + 1;
+    }
+    chunks[c].mEnd = p = cut;
+    chunks[c].mRange = ranges + c * (nDim + 1);
+    chunks[c].mOK = true;
+    chunks[c].mWritten = true;
+  }
+  RunChunks(chunks, nThread, CountChunk);
+  for (c = 0; c < nThread; c++) {
+    chunks[c].mFirst = first;
+    first += chunks[c].mNVal;
+  }
+  if (first < nWant) {
+    fprintf(stderr, "CDInit: Ran out of data at line %d of %s.\n",
+            (int) (first / nExpr), fname);
+    theErr = kCDBadStructure;
+    goto Finish;
+  }
+  RunChunks(chunks, nThread, ReadChunk);
+  //
+  //  Report the earliest problem, just as the serial reader would have,
+  //  and otherwise merge the ranges.
+  //
+  bad = nWant;
+  for (c = 0; c < nThread; c++) {
+    if (!chunks[c].mOK && (chunks[c].mBad < bad)) {
+      bad = chunks[c].mBad;
+    }
+  }
+  if (bad < nWant) {
+    fprintf(stderr, "CDInit: Ran out of data at line %d of %s.\n",
+            (int) (bad / nExpr), fname);
+    theErr = kCDBadStructure;
+    goto Finish;
+  }
+  for (c = 0; c < nThread; c++) {
+    if (!chunks[c].mWritten) {
+      fprintf(stderr, "CDInit: Failed to write field from %s.\n", fname);
+      theErr = kCDError;
+      goto Finish;
+    }
+  }
+  //
+  //  The run of lines repeating the first value carries on into the next
+  //  slice only if it reached right to the end of this one and the next
+  //  slice starts with the same value.
+  //
+  for (c = 0; c < nThread; c++) {
+    for (d = 0; d < nDim; d++) {
+      r = &chunks[c].mRange[d];
+      if (r->mNRep == 0) {
+        continue;
+      }
+      if (r->mMin < dp->mRange[d].mMin) {
+        dp->mRange[d].mMin = r->mMin;
+      }
+      if (r->mMax > dp->mRange[d].mMax) {
+        dp->mRange[d].mMax = r->mMax;
+      }
+      line0 = chunks[c].mFirst / nExpr;
+      if ((size_t) d < chunks[c].mFirst % nExpr) {
+        line0++;
+      }
+      if (dp->mRange[d].mNRep == 0) {
+        dp->mRange[d].mFirst = r->mFirst;
+        dp->mRange[d].mNRep = r->mNRep;
+      } else if (repRun[d] && (line0 == dp->mRange[d].mNRep) &&
+                 (r->mFirst == dp->mRange[d].mFirst)) {
+        dp->mRange[d].mNRep += r->mNRep;
+      } else {
+        repRun[d] = false;
+      }
+    }
+  }
+Finish:
+  free(chunks);
+  free(ranges);
+  return theErr;
+}
+//
+//  Run fn on every chunk, one thread each. If we can't get a thread we
+//  just do that chunk ourselves.
+//
+static void RunChunks(CDChunk* chunks, int nChunk, void* (*fn)(void*))
+{
+  pthread_t* threads;
+  bool* started;
+  int c;
+  threads = (pthread_t*) malloc(nChunk * sizeof(pthread_t));
+  started = (bool*) malloc(nChunk * sizeof(bool));
+  if ((NULL == threads) || (NULL == started)) {
+    for (c = 0; c < nChunk; c++) {
+      fn(&chunks[c]);
+    }
+  } else {
+    for (c = 0; c < nChunk; c++) {
+      started[c] = (pthread_create(&threads[c], NULL, fn, &chunks[c]) == 0);
+      if (!started[c]) {
+        fn(&chunks[c]);
+      }
+    }
+    for (c = 0; c < nChunk; c++) {
+      if (started[c]) {
+        pthread_join(threads[c], NULL);
+      }
+    }
+  }
+  free(threads);
+  free(started);
+}
+
+static void* CountChunk(void* arg)
+{
+  CDChunk* cp = (CDChunk*) arg;
+  CDScan scan;
+  CDScanInitText(&scan, cp->mStart, cp->mEnd, true);
+  cp->mNVal = CDScanCountTokens(&scan);
+  CDScanFinish(&scan);
+  return NULL;
+}
+//
+//  Parse one slice into place. Values past the end of the data are
+//  ignored, just as the serial reader never looks at them. A token the
+//  parser can't finish, or one that turns out to hold more than one
+//  number, marks the slice bad. Line numbers handed to Track are
+//  counted from the first line this slice sees of each dimension.
+//
+static void* ReadChunk(void* arg)
+{
+  CDChunk* cp = (CDChunk*) arg;
+  CDData* dp = cp->mData;
+  CDScan scan;
+  int nExpr = dp->mNExpression + dp->mNDimension;
+  int nDim = dp->mNDimension;
+  size_t idx = cp->mFirst;
+  size_t last = cp->mFirst + cp->mNVal;
+  size_t nWant = (size_t) dp->mNLine * nExpr;
+  size_t line = idx / nExpr;
+  size_t line0 = line;
+  int expr = (int) (idx % nExpr);
+  int d;
+  CDOut out;
+  double v;
+  for (d = 0; d < nDim; d++) {
+    CDRangeInit(&cp->mRange[d]);
+  }
+  OutInit(&out, dp, line * dp->mNExpression +
+                    ((expr > nDim) ? expr - nDim : 0));
+  if (last > nWant) {
+    last = nWant;
+  }
+  CDScanInitText(&scan, cp->mStart, cp->mEnd, true);
+  for (; idx < last; idx++) {
+    if (!CDScanDouble(&scan, &v)) {
+      cp->mOK = false;
+      cp->mBad = idx;
+      break;
+    }
+    if (expr < nDim) {
+      Track(&cp->mRange[expr], v,
+            line - line0 - ((expr < (int) (cp->mFirst % nExpr)) ? 1 : 0));
+      if (NULL == out.mPos) {
+        dp->mDStore[expr][line] = v;
+      }
+    } else if (NULL != out.mPos) {
+      OutPut(&out, v);
+    } else {
+      dp->mDStore[expr][line] = v;
+    }
+    if (++expr == nExpr) {
+      expr = 0;
+      line++;
+    }
+  }
+  if (cp->mOK && (last == cp->mFirst + cp->mNVal) && !CDScanAtEnd(&scan)) {
+    cp->mOK = false;
+    cp->mBad = (last > cp->mFirst) ? last - 1 : last;
+  }
+  OutFlush(&out);
+  cp->mWritten = out.mOK;
+  CDScanFinish(&scan);
+  return NULL;
+}
+//
+//  Set up an output for field values starting with value number first.
+//  It points straight into mField if we have one, at the block buffer
+//  if we are streaming to a file, and nowhere if the field is going into
+//  the mDStore columns.
+//
+static void OutInit(CDOut* o, CDData* dp, size_t first)
+{
+  o->mData = dp;
+  o->mFirst = first;
+  o->mOK = true;
+  if (NULL != dp->mField) {
+    o->mBlock = o->mPos = dp->mField + first;
+    o->mEnd = NULL;
+  } else if (dp->mOutFD >= 0) {
+    o->mBlock = o->mPos = o->mBuff;
+    o->mEnd = o->mBuff + kCDOutBlock;
+  } else {
+    o->mBlock = o->mPos = o->mEnd = NULL;
+  }
+}
+//
+//  Write out whatever is in the block. pwrite may do only part of the
+//  job so we go round until it is all gone.
+//
+static void OutFlush(CDOut* o)
+{
+  const char* p = (const char*) o->mBlock;
+  size_t nVal = o->mPos - o->mBlock;
+  size_t nLeft = nVal * sizeof(double);
+  off_t where = o->mData->mOutOffset + (off_t) (o->mFirst * sizeof(double));
+  ssize_t nDone;
+  if (NULL == o->mEnd) {
+    return;
+  }
+  while (o->mOK && (nLeft > 0)) {
+    nDone = pwrite(o->mData->mOutFD, p, nLeft, where);
+    if (nDone < 0) {
+      if (errno != EINTR) {
+        o->mOK = false;
+      }
+    } else {
+      p += nDone;
+      nLeft -= nDone;
+      where += nDone;
+    }
+  }
+  o->mFirst += nVal;
+  o->mPos = o->mBlock;
+}
@@ -32,6 +32,7 @@
 #include <stdio.h>
 #include <float.h>
 #include <stdbool.h>
+#include <sys/types.h>
 
 #if defined(__cplusplus)
 extern "C" {
@@ -43,6 +44,11 @@ extern "C" {
 //
 extern const char* gFieldFileName;
 extern const char* gModelFileName;
+//
+//  Number of threads to use when reading and processing data. 0, the
+//  default, means one per processor.
+//
+extern int gCDNThread;
 
 /*
  *  CDError is an enumerated type for the various
@@ -68,11 +74,15 @@ typedef enum CDErrorTag {
 //  about a dimension. Each dimension has a max value, a min
 //  value, a number of different values in the range, and the
 //  resulting increment from one value to the next (delta).
+//  While reading we also note the value on the first line and how
+//  many lines in a row start with it, which gives away the grid.
 //
 typedef struct CDRangeTag {
   double mMin;
   double mMax;
   double mDelta;
+  double mFirst;
+  unsigned int mNRep;
   unsigned int mNVal;
   bool mActive;
 } CDRange;
@@ -90,6 +100,9 @@ typedef struct CDDataTag {
   int mNHeadline;           // Number of lines parsed in header
   char** mExprNames;        // Array of expression names
   double** mDStore;         // Array of arrays of data. First coords.
+  double* mField;           // Or just the expressions, interleaved
+  int mOutFD;               // Or streamed to this file (-1 if not)
+  off_t mOutOffset;         // at this offset
   CDRange* mRange;          // Array of range info for each dimension
   char* mFileName;
 } CDData;
@@ -103,11 +116,30 @@ void CDRangeInit(CDRange* r);
 //
 CDError CDInit(CDData* dp, const char* fname);
 //
+//  InitField does the same but keeps only the expressions, interleaved
+//  one line after another in mField, and leaves mDStore NULL. The
+//  coordinates are used for the range info and then dropped. A caller
+//  may take over mField as long as it sets it back to NULL.
+//
+CDError CDInitField(CDData* dp, const char* fname);
+//
+//  StreamField is like InitField but writes the interleaved expressions
+//  to ofp, starting offset bytes into the file, rather than keeping
+//  them. mField stays NULL. Everything else is filled in as usual so the
+//  caller can work out the grid and write a header afterwards.
+//
+CDError CDStreamField(CDData* dp, const char* fname, FILE* ofp, long offset);
+//
 //  Finish tidies up after us, releasing our storage. Every call of
 //  CDInit should be balanced by a call to CDFinish.
 //
 void CDFinish(CDData* dp);
 //
+//  The number of threads we will actually use, from gCDNThread or the
+//  number of processors.
+//
+int CDNThread(void);
+//
 //  Accessors.
 //
 double CDGetValueAtIndex(CDData* dp, unsigned int dim, unsigned int index[3]);
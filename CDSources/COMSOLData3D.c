@@ -28,22 +28,116 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include "COMSOLData3D.h"
+#include "CDScan.h"
+#include "CDPack.h"
+#include "CD3Lerp.h"
 
 //
 //  Forward declarations for file scope helper functions.
 //
-static CDError Init3D(CD3Data* dp, const CDData* cdp);
-static CDError Init2D(CD3Data* dp, const CDData* cdp);
+struct CD3NodeTag;
+static CDError InitFrom(CD3Data* dp, CDData* cdp, const char* fname);
+static CDError Init3D(CD3Data* dp, CDData* cdp);
+static CDError Init2D(CD3Data* dp, CDData* cdp);
 static bool GetAxEAtPoint(const CD3Data* dp, const double coord[3], double* EField);
 static bool Get3DEAtPoint(const CD3Data* dp, const double coord[3], double* EField);
 static bool Get2DEAtPoint(const CD3Data* dp, const double coord[2], double* EField);
+static bool GrowArray(double** vals, unsigned int n);
+static void* MakeHeader(const CD3Data* dp, CD3GridLayout layout,
+                        CD3ValueType type, const double scale[3]);
+static int64_t NPoint(const CD3Data* dp);
+static int64_t NValue(const CD3Data* dp, CD3GridLayout layout);
+static uint64_t NPlane(const CD3Data* dp, CD3GridLayout layout);
+static uint64_t PointAt(const CD3Data* dp, CD3GridLayout layout,
+                        uint32_t ix, uint32_t iy, uint32_t iz);
+static int64_t SourceIndex(const CD3Data* dp, CD3GridLayout layout,
+                           int64_t j);
+static inline void Corners3D(const CD3Data* dp, const int64_t index[3],
+                             int64_t idx[8]);
+static int MortonBits(const CD3Data* dp, int bits[3]);
+static bool MakeMorton(CD3Data* dp);
+static uint64_t MortonSpread(const int bits[3], int axis, uint32_t v);
+static uint64_t DataOffset(void);
+static size_t ValueSize(CD3ValueType type);
+static void StoreValues(const CD3Data* dp, CD3GridLayout layout,
+                        int64_t start, int64_t n, CD3ValueType type,
+                        const double scale[3], void* out);
+static bool WriteValues(const CD3Data* dp, FILE* ofp, CD3GridLayout layout,
+                        int64_t nValue, CD3ValueType type,
+                        const double scale[3]);
+static bool WritePacked(const CD3Data* dp, FILE* ofp,
+                        const CD3HeadV2* head, const double scale[3]);
+static bool LoadPacked(CD3Data* dp, FILE* ifp, const CD3HeadV2* head,
+                       bool swap);
+static bool NeedBlock(const CD3Data* dp, uint64_t idx);
+static void FreeBlocks(struct CD3BlocksTag* bp);
+static bool GetCorners(const CD3Data* dp, const int64_t idx[], int nCorner,
+                       int nComp, double v[][4]);
+static bool GetLanes(const CD3Data* dp, const int64_t idx[8], int lane,
+                     double v[8][3][kCD3Lanes]);
+static void Lerp3D(const CD3Data* dp, const double v[8][4],
+                   const double rc[3], double* EField);
+static const CD3Data* Owner(const CD3Data* dp, const double coord[3]);
+static const CD3Data* WalkOwner(const CD3Data* dp, const double coord[3]);
+static const CD3Data* WalkTree(const struct CD3NodeTag* tree, int node,
+                               const double coord[3]);
+static bool NodeHolds(const struct CD3NodeTag* np, const double coord[3]);
+static bool HasBox(const CD3Data* dp);
+static int CountTree(const CD3Data* dp);
+static bool CompileTree(const CD3Data* dp, struct CD3IndexTag* ip);
+static void TreeBox(const struct CD3IndexTag* ip, double lo[3], double hi[3],
+                    double smallest[3]);
+static bool BoxMeets(const struct CD3NodeTag* np, const double lo[3],
+                     const double hi[3]);
+static bool BoxHolds(const struct CD3NodeTag* np, const double lo[3],
+                     const double hi[3]);
+static void Resolve(const struct CD3NodeTag* tree, int node,
+                    const double lo[3], const double hi[3], int* cell,
+                    unsigned char* exact);
+static void FreeIndex(struct CD3IndexTag* ip);
+static void Batch3D(const CD3Data* dp, size_t m, const size_t* which,
+                    const double* coords, size_t step, size_t plane,
+                    bool check, double* EField, bool* valid);
+static void Batch2D(const CD3Data* dp, size_t m, const size_t* which,
+                    const double* coords, size_t step, size_t plane,
+                    bool check, double* EField, bool* valid);
+static float HalfToFloat(uint16_t h);
+static uint16_t DoubleToHalf(double x);
+static bool ReadHeadV1(CD3Data* dp, const CD3Header* head,
+                       uint64_t* dataOffset);
+static bool ReadHeadV2(CD3Data* dp, CD3HeadV2* head, bool* swap);
+static bool CheckShape(const CD3Data* dp);
+static void Prepare(CD3Data* dp);
+static bool LoadField(CD3Data* dp, FILE* ifp, uint64_t dataOffset,
+                      uint64_t nValue, bool swap);
+static uint32_t Swap32(uint32_t v);
+static uint64_t Swap64(uint64_t v);
+static uint16_t Swap16(uint16_t v);
 
 //
-//  Define this if you want to bounds check every value.
+//  CD3BoundsCheck makes CD3GetEAtPoint check that every point it hands
+//  on really is inside the field it hands it to. The accessors below it
+//  trust their callers and check nothing. Build with CD3Unchecked
+//  defined to leave the check out.
 //
+#ifndef CD3Unchecked
 #define CD3BoundsCheck 1
+#endif
+//
+//  Guess at the number of characters in a line of a FEMM file. Used
+//  only to size the first allocation.
+//
+#define kFEMMLineGuess 48
+//
+//  How many points Batch3D fetches the corners of before it
+//  interpolates any of them. A multiple of kCD3Lanes.
+//
+#define kCD3Ahead 16
 
 //
 //  Global for magic number.
@@ -54,6 +148,105 @@ uint32_t gCD3Magic = 'CD3B';
 //
 uint32_t gCD3HeadLength = 512;
 //
+//  Kludgy global that decides whether CD3ReadBinary maps the field or
+//  reads it into private memory.
+//
+bool gCD3MapBinary = true;
+//
+//  Binary file version to write.
+//
+int gCD3FileVersion = 2;
+//
+//  and how to store the values in it.
+//
+CD3ValueType gCD3WriteType = kCD3Double;
+//
+//  Half values are scaled so the largest in each component comes out
+//  at this, well clear of both overflow at 65504 and the denormals.
+//
+#define kCD3HalfTop 16384.0
+//
+//  Points CD3GetEAtPoints sorts out at a time.
+//
+#define kCD3Batch 256
+//
+//  Most bits a Morton code may have. Beyond this the padding alone would
+//  be more memory than anyone has.
+//
+#define kCD3MortonMaxBits 40
+//
+//  Whether to pack the values written and in how many z planes at a time,
+//  and whether reading a packed file leaves the blocks packed until
+//  they are needed.
+//
+bool gCD3Compress = false;
+int gCD3BlockPlanes = 4;
+bool gCD3LazyBlocks = true;
+//
+//  Layout to write 3D fields in.
+//
+CD3GridLayout gCD3WriteLayout = kCD3RowMajor;
+//
+//  What we keep of a packed file. The packed bytes are either a mapping
+//  of the whole file (mBase 0) or a copy of the blocks read in (mBase the
+//  offset of the first one). The values are unpacked into mValues, which
+//  is the field's mField or mNarrow, a block at a time as queries first
+//  touch them. mReady says which blocks are done. It is read without the
+//  lock, so a block is unpacked completely before it is marked ready.
+//
+typedef struct CD3BlocksTag {
+  const unsigned char* mPacked;         // The packed blocks
+  void* mPackMap;                       // Mapping they live in, or NULL
+  size_t mPackMapLength;                // and its length
+  uint64_t mBase;                       // File offset of mPacked[0]
+  uint64_t* mOffset;                    // File offsets of blocks, nBlock+1
+  uint64_t mNBlock;                     // Number of blocks
+  uint64_t mBlockValues;                // Values in each full block
+  uint64_t mNValue;                     // Values in the whole field
+  int mSize;                            // Bytes in each value
+  int mNComp;                           // Components at each point
+  void* mValues;                        // Where the values go
+  unsigned char* mReady;                // 1 when a block is unpacked
+  bool mLockInit;                       // mLock needs destroying
+  pthread_mutex_t mLock;                // Held while unpacking
+} CD3Blocks;
+//
+//  The index of a tree of fields. CD3BuildIndex compiles the tree into
+//  mTree, one array of nodes in breadth first order, so the daughters of
+//  a node sit next to each other and a walk down the tree runs forward
+//  through a single block of memory rather than chasing pointers round
+//  the heap. The grid covers every box in the tree with mN cells along
+//  each axis. For each cell mCell is the deepest node that every point in
+//  the cell passes through on its way down the tree. If mExact is set
+//  that node's field owns all of the cell (or, if it is -1, nobody does)
+//  and we are done; otherwise the walk carries on from there. Cells are a
+//  little fattened when they are classified so rounding can't put a
+//  point in the wrong one.
+//
+typedef struct CD3NodeTag {
+  double mMin[3];                       // Box that routes points here
+  double mMax[3];
+  int mFirst;                           // First daughter in mTree
+  int mNSub;                            // and how many there are
+  const CD3Data* mData;                 // Field that owns points, or NULL
+} CD3Node;
+
+typedef struct CD3IndexTag {
+  CD3Node* mTree;                       // The tree, root first
+  int mNNode;                           // Nodes in it
+  double mMin[3];                       // Box the grid covers
+  double mMax[3];
+  double mInv[3];                       // Cells per unit length
+  int mN[3];                            // Cells along each axis
+  int* mCell;                           // Node to start at, for each cell
+  unsigned char* mExact;                // and whether that is the answer
+} CD3Index;
+//
+//  At most this many index cells along an axis. We aim for two cells
+//  across the smallest field.
+//
+#define kCD3IndexSide 64
+//
 //  Init fills in the data structure using the information in the file.
 //  BEWARE: CDInit allocates a lot of storage. We MUST ensure that that
 //  storage gets disposed of before we leave. This means that once CDInit
@@ -63,24 +256,113 @@ uint32_t gCD3HeadLength = 512;
 CDError CD3Init(CD3Data* dp, const char* fname)
 {
   CDError theErr;
-  int dim, nActive = 0;
   //
-  //  Start by constructing a CDData from the file.
+  //  Start by constructing a CDData from the file. We only ask it for
+  //  the field, already interleaved the way we want it, so the one
+  //  copy of the data is built in place as the text streams past.
+  //
+  CDData cData;
+  theErr = CDInitField(&cData, fname);
+  if (theErr != kCDNoErr) {
+    goto ErrorExit;
+  }
+  theErr = InitFrom(dp, &cData, fname);
+ErrorExit:
+  //
+  //  This makes sure that we dispose of the remaining storage in CData.
+  //  ALL code paths exit through here (hence the label!
   //
+  CDFinish(&cData);
+  return theErr;
+}
+//
+//  StreamBinary converts a COMSOL text file straight into a binary file
+//  without ever holding the field. We write a place holder header, let
+//  CDStreamField drop the field in behind it as it is parsed, and then
+//  go back and write the real header once we know the shape of the grid.
+//  dp is filled in as for CD3Init except that mField stays NULL.
+//
+CDError CD3StreamBinary(CD3Data* dp, const char* fname, FILE* ofp)
+{
+  CDError theErr;
   CDData cData;
-  theErr = CDInit(&cData, fname);
+  void* head;
+  int64_t npoint;
+  uint64_t dataOffset = DataOffset();
+  //
+  //  The place holder is all zeros so a file left behind by a crash
+  //  will never pass for a valid one.
+  //
+  head = calloc(1, dataOffset);
+  if (head == NULL) {
+    fprintf(stderr, "CD3StreamBinary: Could not allocate header.\n");
+    return kCDAllocFailed;
+  }
+  if (fwrite(head, 1, dataOffset, ofp) != dataOffset) {
+    fprintf(stderr, "CD3StreamBinary: Failed to write header.\n");
+    free(head);
+    return kCDError;
+  }
+  free(head);
+  head = NULL;
+  theErr = CDStreamField(&cData, fname, ofp, (long) dataOffset);
   if (theErr != kCDNoErr) {
     goto ErrorExit;
   }
+  theErr = InitFrom(dp, &cData, fname);
+  if (theErr != kCDNoErr) {
+    goto ErrorExit;
+  }
+  //
+  //  Now we know what we have go back and fill in the header. Any lines
+  //  beyond the grid were written too, so trim them off.
+  //
+  head = MakeHeader(dp, kCD3RowMajor, kCD3Double, dp->mScale);
+  npoint = NPoint(dp);
+  if ((head == NULL) || (npoint < 0)) {
+    theErr = kCDError;
+    goto ErrorExit;
+  }
+  if ((fseek(ofp, 0L, SEEK_SET) != 0) ||
+      (fwrite(head, 1, dataOffset, ofp) != dataOffset) ||
+      (fflush(ofp) != 0) ||
+      (ftruncate(fileno(ofp),
+                 (off_t) (dataOffset + npoint * sizeof(double))) != 0) ||
+      (fseek(ofp, 0L, SEEK_END) != 0)) {
+    fprintf(stderr, "CD3StreamBinary: Failed to write header.\n");
+    theErr = kCDError;
+    goto ErrorExit;
+  }
+  printf("CD3StreamBinary wrote %lld data values.\n", (long long) npoint);
+ErrorExit:
+  free(head);
+  CDFinish(&cData);
+  return theErr;
+}
+//
+//  InitFrom finishes off a CD3Data once CDInitField or CDStreamField has
+//  read the file into a CDData. It takes the field over if there is one.
+//
+static CDError InitFrom(CD3Data* dp, CDData* cdp, const char* fname)
+{
+  int dim, nActive = 0;
   //
-  //  And filling in default elems in the CD3Data.
+  //  Fill in default elems in the CD3Data.
   //
   dp->mType = kCD3Error;
   dp->mStride = 0;
   dp->mNSubField = 0;
-  dp->mSubField[0] = dp->mSubField[1] = NULL;
-  dp->mSubField[2] = dp->mSubField[3] = NULL;
+  dp->mSubField = NULL;
   dp->mField = NULL;
+  dp->mMap = NULL;
+  dp->mMapLength = 0;
+  dp->mNarrow = NULL;
+  dp->mValueType = kCD3Double;
+  dp->mScale[0] = dp->mScale[1] = dp->mScale[2] = 1.0;
+  dp->mBlocks = NULL;
+  dp->mLayout = kCD3RowMajor;
+  dp->mMorton = NULL;
+  dp->mIndex = NULL;
   dp->mFieldName = fname;
   //
   //  Have a real file nicely parsed out. Figure out which kind it was.
@@ -89,38 +371,28 @@ CDError CD3Init(CD3Data* dp, const char* fname)
   //  I did the tests on separate lines to make debugging a little easier.
   //  Start with needing three actual dimensions.
   //
-  if (cData.mNDimension != 3) {
+  if (cdp->mNDimension != 3) {
     fprintf(stderr,
             "Expected three dimensions, found %d.\n",
-            cData.mNDimension);
-    theErr = kCDBadStructure;
-    goto ErrorExit;
+            cdp->mNDimension);
+    return kCDBadStructure;
   }
   //
   //  Then find out how many are active.
   //
   for (dim = 0; dim < 3; dim++) {
-    if (cData.mRange[dim].mActive)
+    if (cdp->mRange[dim].mActive)
       nActive++;
   }
   if (nActive == 2) {
-    theErr = Init2D(dp, &cData);
+    return Init2D(dp, cdp);
   } else if (nActive == 3) {
-    theErr = Init3D(dp, &cData);
-  } else {
-    fprintf(stderr,
-            "Expected two or three active dimensions, found %d.\n",
-            nActive);
-    theErr = kCDBadStructure;
-    goto ErrorExit;
+    return Init3D(dp, cdp);
   }
-ErrorExit:
-  //
-  //  This makes sure that we dispose of the remaining storage in CData.
-  //  ALL code paths exit through here (hence the label!
-  //
-  CDFinish(&cData);
-  return theErr;
+  fprintf(stderr,
+          "Expected two or three active dimensions, found %d.\n",
+          nActive);
+  return kCDBadStructure;
 }
 //
 //  InitFEMM does the same for a file extracted from FEMM
@@ -131,25 +403,24 @@ ErrorExit:
 //  stored with the y dimension varying fastest.
 //  UNLIKE the COMSOL data we have no information on how many
 //  entries there will be in the file. There is no header to
-//  help us here. However, the lines are all roughly the same
-//  length because they are written with a fixed format. Thus
-//  we can get a good estimate of the amount of space needed
-//  for the arrays by counting the number of characters in the
-//  first line and dividing the file length by that.
+//  help us here. The lines are written with a fixed format so
+//  the file length gives us a fair guess at the number of lines
+//  and we grow the arrays if the guess was short.
+//  The text is pulled in by the same scanner that CDInit uses.
 //
 CDError CD3InitFEMM(CD3Data* dp, const char* fname)
 {
   int line = 0;
-  char linebuff[1024];
-  char* string;
-  unsigned int nCharPerLine;
   unsigned int nLine;
   unsigned long fileSize;
   unsigned int nXCopy = 0;
   struct stat st;
-  double *xVals, *yVals, *exVals, *eyVals;
+  double *xVals = NULL, *yVals = NULL, *exVals = NULL, *eyVals = NULL;
+  double vals[4];
   bool xSame = true;
-  int row, col;
+  int row, col, nRead;
+  CDError theErr = kCDNoErr;
+  CDScan scan;
   //
   //  Make sure that we can read the file.
   //
@@ -158,59 +429,34 @@ CDError CD3InitFEMM(CD3Data* dp, const char* fname)
     fprintf(stderr, "Failed to open file %s.\n",fname);
     return kCDCantOpenIn;
   }
-  string = fgets(linebuff, 1024, ifp);
-  if (NULL == ifp) {
-    fprintf(stderr, "Could not read from file %s.\n", fname);
-    return kCDCantOpenIn;
-  }
-  //
-  //  Use that and the filesize to get the number of lines and thus
-  //  the number of entries in each array.
-  //
-  nCharPerLine = (unsigned int) strlen(string) - 2;
   if (fstat(fileno(ifp), &st) != 0) {
     fprintf(stderr, "Cannot stat file %s.\n", fname);
+    fclose(ifp);
     return kCDCantOpenIn;
   }
   fileSize = st.st_size;
-  nLine = (unsigned int) (fileSize / nCharPerLine);
-  printf("File %s has about %d lines.\n", fname, nLine);
-  //
-  //  Now we can get space for the data.
-  //
-  xVals = (double *) malloc(nLine * sizeof(double));
-  if (xVals == NULL) {
-    fprintf(stderr, "Failed to alocate %d slots for x values.\n", nLine);
-    return kCDAllocFailed;
-  }
-  yVals = (double *) malloc(nLine * sizeof(double));
-  if (yVals == NULL) {
-    fprintf(stderr, "Failed to alocate %d slots for y values.\n", nLine);
-    free(xVals);
-    return kCDAllocFailed;
-  }
-  exVals = (double *) malloc(nLine * sizeof(double));
-  if (exVals == NULL) {
-    fprintf(stderr, "Failed to alocate %d slots for Ex values.\n", nLine);
-    free(xVals);
-    free(yVals);
-    return kCDAllocFailed;
-  }
-  eyVals = (double *) malloc(nLine * sizeof(double));
-  if (eyVals == NULL) {
-    fprintf(stderr, "Failed to alocate %d slots for Ey values.\n", nLine);
-    free(xVals);
-    free(yVals);
-    free(exVals);
-    return kCDAllocFailed;
+  nLine = (unsigned int) (fileSize / kFEMMLineGuess) + 16;
+  if (!CDScanInit(&scan, ifp)) {
+    fprintf(stderr, "Could not read from file %s.\n", fname);
+    fclose(ifp);
+    return kCDCantOpenIn;
   }
   //
   //  Fill in default elems in the CD3Data.
   //
   dp->mType = kCD3Data2;
   dp->mNSubField = 0;
-  dp->mSubField[0] = dp->mSubField[1] = NULL;
-  dp->mSubField[2] = dp->mSubField[3] = NULL;
+  dp->mSubField = NULL;
+  dp->mField = NULL;
+  dp->mMap = NULL;
+  dp->mMapLength = 0;
+  dp->mNarrow = NULL;
+  dp->mValueType = kCD3Double;
+  dp->mScale[0] = dp->mScale[1] = dp->mScale[2] = 1.0;
+  dp->mBlocks = NULL;
+  dp->mLayout = kCD3RowMajor;
+  dp->mMorton = NULL;
+  dp->mIndex = NULL;
   dp->mFieldName = fname;
   //
   //  The ones associated with the structure of the array.
@@ -224,17 +470,38 @@ CDError CD3InitFEMM(CD3Data* dp, const char* fname)
   dp->mMin[1] = dp->mMin[2] = DBL_MAX;
   dp->mMax[1] = dp->mMax[2] = -DBL_MAX;
   //
-  //  And read text file in.
+  //  And read text file in, four numbers to a line.
   //
-  do {
-    int nRead = sscanf(linebuff, "%lf %lf %lf %lf",
-                       &xVals[line], &yVals[line],
-                       &exVals[line], &eyVals[line]);
-    if  (nRead < 4) {
-      fprintf(ifp, "Only read %d of 4 values on line %d of file %s.\n",
+  for (;;) {
+    for (nRead = 0; nRead < 4; nRead++) {
+      if (!CDScanDouble(&scan, &vals[nRead])) {
+        break;
+      }
+    }
+    if ((nRead == 0) && CDScanAtEnd(&scan)) {
+      break;
+    }
+    if (nRead < 4) {
+      fprintf(stderr, "Only read %d of 4 values on line %d of file %s.\n",
               nRead, line, fname);
-      return kCDCantOpenIn;
+      theErr = kCDCantOpenIn;
+      goto Finish;
+    }
+    if ((NULL == xVals) || ((unsigned int) line >= nLine)) {
+      if (NULL != xVals) {
+        nLine *= 2;
+      }
+      if (!GrowArray(&xVals, nLine) || !GrowArray(&yVals, nLine) ||
+          !GrowArray(&exVals, nLine) || !GrowArray(&eyVals, nLine)) {
+        fprintf(stderr, "Failed to alocate %d slots for values.\n", nLine);
+        theErr = kCDAllocFailed;
+        goto Finish;
+      }
     }
+    xVals[line] = vals[0];
+    yVals[line] = vals[1];
+    exVals[line] = vals[2];
+    eyVals[line] = vals[3];
     //
     //  As we go we count the number of identical x values to find the
     //  first dimension of the data.
@@ -262,15 +529,20 @@ CDError CD3InitFEMM(CD3Data* dp, const char* fname)
       dp->mMax[2] = yVals[line];
     }
     line++;
-  } while (fgets(linebuff, 1024, ifp) != NULL);
-  fclose(ifp);
+  }
+  if (line == 0) {
+    fprintf(stderr, "Could not read from file %s.\n", fname);
+    theErr = kCDCantOpenIn;
+    goto Finish;
+  }
   //
   //  Check that x min is 0.
   //
   if (dp->mMin[0] != 0) {
     fprintf(stderr,
             "Loading axisymmetric data, x must have min=0.0.");
-    return kCDBadStructure;
+    theErr = kCDBadStructure;
+    goto Finish;
   }
   //
   //  Make sure that we have a strictly rectangular array.
@@ -278,7 +550,8 @@ CDError CD3InitFEMM(CD3Data* dp, const char* fname)
   if (line % nXCopy != 0) {
     fprintf(stderr, "Error checking rectangular structure. Remainder = %d.\n",
             line % nXCopy);
-    return kCDBadStructure;
+    theErr = kCDBadStructure;
+    goto Finish;
   }
   //
   //  Now can do nVals and the Deltas.
@@ -304,7 +577,8 @@ CDError CD3InitFEMM(CD3Data* dp, const char* fname)
   //
   dp->mField = (double *) malloc(line * 2 * sizeof(double));
   if (dp->mField == NULL) {
-    return kCDAllocFailed;
+    theErr = kCDAllocFailed;
+    goto Finish;
   }
   //
   //  Copy the data into place.
@@ -315,8 +589,30 @@ CDError CD3InitFEMM(CD3Data* dp, const char* fname)
       dp->mField[2*(row * dp->mStride + col)+1] = eyVals[col * nXCopy + row];
     }
   }
-
-  return kCDNoErr;
+  Prepare(dp);
+  //
+  //  All exit paths come through here to throw away the columns.
+  //
+Finish:
+  CDScanFinish(&scan);
+  fclose(ifp);
+  free(xVals);
+  free(yVals);
+  free(exVals);
+  free(eyVals);
+  return theErr;
+}
+//
+//  Resize one of the FEMM column arrays.
+//
+static bool GrowArray(double** vals, unsigned int n)
+{
+  double* newVals = (double *) realloc(*vals, n * sizeof(double));
+  if (NULL == newVals) {
+    return false;
+  }
+  *vals = newVals;
+  return true;
 }
 //
 //  Finish tidies up after us, releasing our storage. Every call of
@@ -324,9 +620,28 @@ CDError CD3InitFEMM(CD3Data* dp, const char* fname)
 //
 void CD3Finish(CD3Data* dp)
 {
-  if (NULL != dp->mField) {
+  if (NULL != dp->mMap) {
+    munmap(dp->mMap, dp->mMapLength);
+    dp->mMap = NULL;
+  } else {
     free(dp->mField);
+    free(dp->mNarrow);
+  }
+  if (NULL != dp->mBlocks) {
+    FreeBlocks(dp->mBlocks);
+    dp->mBlocks = NULL;
   }
+  free(dp->mMorton);
+  dp->mMorton = NULL;
+  if (NULL != dp->mIndex) {
+    FreeIndex(dp->mIndex);
+    dp->mIndex = NULL;
+  }
+  free(dp->mSubField);
+  dp->mSubField = NULL;
+  dp->mNSubField = 0;
+  dp->mField = NULL;
+  dp->mNarrow = NULL;
 }
 //
 //  Accessor.
@@ -337,7 +652,7 @@ bool PtInBounds(const CD3Data* dp, const double coord[3])
 {
   int i;
   for (i = 0; i < 3; i++) {
-    if ((coord[i] < dp->mMin[i]) || (coord[i] > dp->mMax[i])) {
+    if (!((coord[i] >= dp->mMin[i]) && (coord[i] <= dp->mMax[i]))) {
       return false;
     }
   }
@@ -351,31 +666,26 @@ bool PtInBounds(const CD3Data* dp, const double coord[3])
 //
 bool CD3GetEAtPoint(const CD3Data* dp, const double coord[3], double* EField)
 {
-  int i;
-  if (dp->mType > 1) {
-    fprintf(stderr, "Invalid field type %d.\n", dp->mType);
-    return false;
+  const CD3Data* op;
+  if (dp->mType > kCD3Unused) {
+    return false;                       // Invalid field type
   }
   //
-  //  Search daughters.
+  //  Find who owns the point, through the index if there is one. Only
+  //  fields with data of their own own points.
   //
-  for (i = 0; i < dp->mNSubField; i++) {
-    if (PtInBounds(dp->mSubField[i], coord)) {
-      return CD3GetEAtPoint(dp->mSubField[i], coord, EField);
-    }
+  op = Owner(dp, coord);
+  if (NULL == op) {
+    return false;
   }
-  //
-  //  Can we handle it ourselves?
-  //
-  if (PtInBounds(dp, coord)) {
-    return (dp->mType == kCD3Data2) ?
-    GetAxEAtPoint(dp, coord, EField) :
-    Get3DEAtPoint(dp, coord, EField);
+#ifdef CD3BoundsCheck
+  if (!PtInBounds(op, coord)) {
+    return false;
   }
-  //
-  //  Otherwise this was a bust.
-  //
-  return false;
+#endif
+  return (op->mType == kCD3Data2) ?
+  GetAxEAtPoint(op, coord, EField) :
+  Get3DEAtPoint(op, coord, EField);
 }
 //
 //  This is very similar except that intead of returning a field
@@ -384,126 +694,981 @@ bool CD3GetEAtPoint(const CD3Data* dp, const double coord[3], double* EField)
 //
 const char* CD3GetNameAtPoint(const CD3Data* dp, const double coord[3])
 {
-  int i;
-  if (dp->mType > 1) {
-    fprintf(stderr, "Invalid field type %d.\n", dp->mType);
+  const CD3Data* op;
+  if (dp->mType > kCD3Unused) {
     return "Invalid field type";
   }
-  //
-  //  Search daughters.
-  //
-  for (i = 0; i < dp->mNSubField; i++) {
-    if (PtInBounds(dp->mSubField[i], coord)) {
-      return dp->mSubField[i]->mFieldName;
+  op = Owner(dp, coord);
+  return (op == NULL) ? "No field found" : op->mFieldName;
+}
+
+//
+//  The batch version of CD3GetEAtPoint. A single field, the usual case,
+//  has no owners to find: a 3D one hands all the points straight to
+//  Batch3D, which checks each one against the bounds itself, and a 2D
+//  one to Batch2D, which does the same. For a tree we work
+//  through the points kCD3Batch at a time, find the field that owns each
+//  point and then hand each owner all of its points at once. Usually a
+//  whole batch has one owner.
+//
+size_t CD3GetEAtPoints(const CD3Data* dp, size_t n, const double* coords,
+                       CD3PointLayout layout, double* EField, bool* valid)
+{
+  size_t first = 0, i, m, nFound = 0;
+  size_t step = (layout == kCD3SoA) ? 1 : 3;
+  size_t plane = (layout == kCD3SoA) ? n : 1;
+  size_t which[kCD3Batch];
+  const CD3Data* owner[kCD3Batch];
+  const CD3Data* op;
+  double coord[3];
+  int j, k, nBatch = 0, nLeft;
+#ifdef CD3BoundsCheck
+  bool recheck = true;                  // As CD3GetEAtPoint does
+#else
+  bool recheck = false;
+#endif
+  if ((dp->mType == kCD3Data3) && (dp->mNSubField == 0)) {
+    Batch3D(dp, n, NULL, coords, step, plane, true, EField, valid);
+    first = n;
+  } else if ((dp->mType == kCD3Data2) && (dp->mNSubField == 0)) {
+    Batch2D(dp, n, NULL, coords, step, plane, true, EField, valid);
+    first = n;
+  }
+  for (; first < n; first += nBatch) {
+    nBatch = (n - first < kCD3Batch) ? (int) (n - first) : kCD3Batch;
+    //
+    //  Find the owners. Points that have none are done already.
+    //
+    nLeft = 0;
+    for (j = 0; j < nBatch; j++) {
+      i = first + j;
+      for (k = 0; k < 3; k++) {
+        coord[k] = coords[i * step + k * plane];
+      }
+      owner[j] = Owner(dp, coord);
+      if (owner[j] == NULL) {
+        valid[i] = false;
+        for (k = 0; k < 3; k++) {
+          EField[i * step + k * plane] = 0.0;
+        }
+      } else {
+        ++nLeft;
+      }
+    }
+    //
+    //  Pick off the points of one owner at a time.
+    //
+    while (nLeft > 0) {
+      op = NULL;
+      for (j = 0, m = 0; j < nBatch; j++) {
+        if ((owner[j] != NULL) && ((op == NULL) || (owner[j] == op))) {
+          op = owner[j];
+          owner[j] = NULL;
+          which[m++] = first + j;
+        }
+      }
+      nLeft -= (int) m;
+      if (op->mType == kCD3Data3) {
+        Batch3D(op, m, which, coords, step, plane, recheck, EField, valid);
+      } else {
+        Batch2D(op, m, which, coords, step, plane, recheck, EField, valid);
+      }
     }
   }
-  //
-  //  Can we handle it ourselves?
-  //
-  if (PtInBounds(dp, coord)) {
-    return dp->mFieldName;
+  for (i = 0; i < n; i++) {
+    if (valid[i]) {
+      ++nFound;
+    }
   }
-  //
-  //  Otherwise this was a bust.
-  //
-  return "No field found";
+  return nFound;
 }
-
 //
-//  File operations.
-//  The first writes a complete field to binary with the magic header.
-//  It needs a complete CD3Data and a FILE open for writing.
-//  The only difference between a 3D and 3D file is the amount of data
-//  to write.
+//  Owner finds the field in the tree below dp that owns coord, or NULL
+//  if there isn't one. The first subfield whose box holds a point gets
+//  it, and failing all of them the field itself does if it can. With an
+//  index we can skip most or all of the search, and what is left runs
+//  over the compiled tree.
 //
-bool CD3WriteBinary(CD3Data* dp, FILE* ofp)
+static const CD3Data* Owner(const CD3Data* dp, const double coord[3])
 {
-  int i;
-  int success = false;
-  CD3Header* head = (CD3Header *) malloc(gCD3HeadLength);
-  if (head == NULL) {
-    fprintf(stderr, "CD3WriteBinary not allocate header.\n");
-    return false;
+  const CD3Index* ip = dp->mIndex;
+  int k, c[3], node;
+  size_t cell;
+  if (NULL == ip) {
+    return WalkOwner(dp, coord);
   }
-  //
-  //  Start by filling in the header fields.
-  //
-  head->magic = gCD3Magic;
-  head->dataOffset = gCD3HeadLength;
-  if (gFieldFileName != NULL) {
-    strncpy(head->fileName, gFieldFileName, 63);
+  for (k = 0; k < 3; k++) {
+    if (!((coord[k] >= ip->mMin[k]) && (coord[k] <= ip->mMax[k]))) {
+      return NULL;                      // Outside, or not a number
+    }
+    c[k] = (int) ((coord[k] - ip->mMin[k]) * ip->mInv[k]);
+    if (c[k] >= ip->mN[k]) {
+      c[k] = ip->mN[k] - 1;
+    }
   }
-  if (gModelFileName != NULL) {
-    strncpy(head->modelName, gModelFileName, 63);
-  }
-  head->dp.mType = dp->mType;
-  head->dp.mStride = dp->mStride;
-  printf("Field type %d, stride %d\n", head->dp.mType, head->dp.mStride);
-  head->dp.mNSubField = 0;
-  head->dp.mField = 0;
-  head->dp.mSubField[0] = head->dp.mSubField[1] = NULL;
-  head->dp.mSubField[2] = head->dp.mSubField[3] = NULL;
-  for (i = 0; i < 3; i++) {
-    head->dp.mNVal[i] = dp->mNVal[i];
-    head->dp.mMin[i] = dp->mMin[i];
-    head->dp.mMax[i] = dp->mMax[i];
-    head->dp.mDelta[i] = dp->mDelta[i];
-    printf("Dim %d: %d vals %f to %f by %f\n", i,
-           head->dp.mNVal[i],
-           head->dp.mMin[i],
-           head->dp.mMax[i],
-           head->dp.mDelta[i]);
+  cell = ((size_t) c[2] * ip->mN[1] + c[1]) * ip->mN[0] + c[0];
+  node = ip->mCell[cell];
+  if (ip->mExact[cell]) {
+    return (node < 0) ? NULL : ip->mTree[node].mData;
   }
-  //
-  //  Write header and data to disk.
-  //
-  if (fwrite(head, 1, gCD3HeadLength, ofp) == gCD3HeadLength) {
-    int npoint = dp->mNVal[0] *  dp->mNVal[1] *  dp->mNVal[2];
-    switch (dp->mType) {
-      case kCD3Data2:
-        npoint *= 2;
-        break;
-
-      case kCD3Data3:
-        npoint *= 3;
+  return WalkTree(ip->mTree, node, coord);
+}
+//
+//  WalkOwner follows the pointers of a tree that has no index.
+//
+static const CD3Data* WalkOwner(const CD3Data* dp, const double coord[3])
+{
+  int i;
+  for (i = 0; i < dp->mNSubField; i++) {
+    if (PtInBounds(dp->mSubField[i], coord)) {
+      return WalkOwner(dp->mSubField[i], coord);
+    }
+  }
+  return (HasBox(dp) && PtInBounds(dp, coord)) ? dp : NULL;
+}
+//
+//  WalkTree does the same down the compiled tree from node. The daughters
+//  of a node are next to each other so this is a forward scan.
+//
+static const CD3Data* WalkTree(const CD3Node* tree, int node,
+                               const double coord[3])
+{
+  int i, end;
+  for (;;) {
+    end = tree[node].mFirst + tree[node].mNSub;
+    for (i = tree[node].mFirst; i < end; i++) {
+      if (NodeHolds(&tree[i], coord)) {
         break;
-
-      default:
-        fprintf(stderr, "CD3WriteBinary:Invalid file type %d.\n", dp->mType);
-        return false;
+      }
     }
-    printf("%d = %d * %d * %d\n", npoint, dp->mNVal[0],dp->mNVal[1],dp->mNVal[2]);
-    if (fwrite(dp->mField, sizeof(double), npoint, ofp) != npoint) {
-      fprintf(stderr, "CD3WriteBinary:Failed to write data.\n");
-    } else {
-      printf("CD3WriteBinary wrote %d data values.\n", npoint);
-      success = true;
+    if (i == end) {
+      break;
     }
-  } else {
-    fprintf(stderr, "CD3WriteBinary:Failed to write header.\n");
+    node = i;
   }
-  //
-  //  Dispose of header and are done.
-  //
-  free(head);
-  return success;
+  return ((tree[node].mData != NULL) && NodeHolds(&tree[node], coord)) ?
+         tree[node].mData : NULL;
+}
+
+static bool NodeHolds(const CD3Node* np, const double coord[3])
+{
+  int k;
+  for (k = 0; k < 3; k++) {
+    if (!((coord[k] >= np->mMin[k]) && (coord[k] <= np->mMax[k]))) {
+      return false;
+    }
+  }
+  return true;
 }
 //
-//  The second constructs a CD3Data field from a binary file. It is the
-//  binary equivalent of CD3Init for text files.
-//  Because we allocate storage that must be thrown away even if an
-//  error occurs we have to exit with a label!!!
+//  Build the index of the tree below dp. First the tree is compiled into
+//  one array in breadth first order. Then the grid is sized from the
+//  smallest box in the tree and each cell is classified by running its
+//  box down the tree the way Owner runs a point down.
 //
-bool CD3ReadBinary(CD3Data* dp, FILE* ifp)
+bool CD3BuildIndex(CD3Data* dp)
 {
-  int i, npoint, nActive = 0;
-  int success = false;
-  //
-  //  Get space for header, read it in, and make sure it is valid.
-  //
-  CD3Header* head = (CD3Header *) malloc(gCD3HeadLength);
-  if (head == NULL) {
-    fprintf(stderr, "CD3ReadBinary: Could not allocate header.\n");
+  int i, k, c[3];
+  size_t cell, nCell = 1;
+  double lo[3], hi[3], smallest[3], cellLo[3], cellHi[3], size, pad;
+  CD3Index* ip;
+  if (NULL != dp->mIndex) {
+    FreeIndex(dp->mIndex);
+    dp->mIndex = NULL;
+  }
+  if (dp->mNSubField == 0) {
+    return true;                        // Nothing to search anyway
+  }
+  ip = (CD3Index*) calloc(1, sizeof(CD3Index));
+  if ((ip == NULL) || !CompileTree(dp, ip)) {
+    fprintf(stderr, "CD3BuildIndex: Could not allocate index.\n");
+    if (ip != NULL) {
+      FreeIndex(ip);
+    }
+    return false;
+  }
+  for (k = 0; k < 3; k++) {
+    lo[k] = HUGE_VAL;
+    hi[k] = smallest[k] = -HUGE_VAL;
+  }
+  TreeBox(ip, lo, hi, smallest);
+  for (k = 0; k < 3; k++) {
+    ip->mMin[k] = lo[k];
+    ip->mMax[k] = hi[k];
+    size = hi[k] - lo[k];
+    ip->mN[k] = 1;
+    if ((size > 0.0) && (smallest[k] > 0.0)) {
+      ip->mN[k] = (2.0 * size / smallest[k] < kCD3IndexSide) ?
+                  (int) ceil(2.0 * size / smallest[k]) : kCD3IndexSide;
+    }
+    ip->mInv[k] = (size > 0.0) ? ip->mN[k] / size : 0.0;
+    nCell *= ip->mN[k];
+  }
+  ip->mCell = (int*) malloc(nCell * sizeof(int));
+  ip->mExact = (unsigned char*) malloc(nCell);
+  if ((ip->mCell == NULL) || (ip->mExact == NULL)) {
+    fprintf(stderr, "CD3BuildIndex: Could not allocate %lu cells.\n",
+            (unsigned long) nCell);
+    FreeIndex(ip);
+    return false;
+  }
+  for (c[2] = 0; c[2] < ip->mN[2]; c[2]++) {
+    for (c[1] = 0; c[1] < ip->mN[1]; c[1]++) {
+      for (c[0] = 0; c[0] < ip->mN[0]; c[0]++) {
+        for (i = 0; i < 3; i++) {
+          size = (hi[i] - lo[i]) / ip->mN[i];
+          pad = 1.0e-6 * size + 1.0e-12 * (fabs(lo[i]) + fabs(hi[i]));
+          cellLo[i] = lo[i] + c[i] * size - pad;
+          cellHi[i] = lo[i] + (c[i] + 1) * size + pad;
+        }
+        cell = ((size_t) c[2] * ip->mN[1] + c[1]) * ip->mN[0] + c[0];
+        Resolve(ip->mTree, 0, cellLo, cellHi, &ip->mCell[cell],
+                &ip->mExact[cell]);
+      }
+    }
+  }
+  dp->mIndex = ip;
+  return true;
+}
+//
+//  Only fields with data of their own can own points. A cfield without a
+//  file of its own is kCD3Unused and has only the box of its subfields,
+//  which routes points to them.
+//
+static bool HasBox(const CD3Data* dp)
+{
+  return (dp->mType == kCD3Data2) || (dp->mType == kCD3Data3);
+}
+
+static int CountTree(const CD3Data* dp)
+{
+  int i, n = 1;
+  for (i = 0; i < dp->mNSubField; i++) {
+    n += CountTree(dp->mSubField[i]);
+  }
+  return n;
+}
+//
+//  Lay the tree below dp out in ip->mTree, a level at a time. The array
+//  of nodes doubles as the queue: from[j] is the field node j came from
+//  and we hand out places to its daughters as we reach it.
+//
+static bool CompileTree(const CD3Data* dp, CD3Index* ip)
+{
+  int j, i, k, next = 1;
+  const CD3Data* sp;
+  const CD3Data** from;
+  ip->mNNode = CountTree(dp);
+  ip->mTree = (CD3Node*) malloc(ip->mNNode * sizeof(CD3Node));
+  from = (const CD3Data**) malloc(ip->mNNode * sizeof(CD3Data*));
+  if ((ip->mTree == NULL) || (from == NULL)) {
+    free(from);
+    return false;
+  }
+  from[0] = dp;
+  for (j = 0; j < ip->mNNode; j++) {
+    sp = from[j];
+    for (k = 0; k < 3; k++) {
+      ip->mTree[j].mMin[k] = sp->mMin[k];
+      ip->mTree[j].mMax[k] = sp->mMax[k];
+    }
+    ip->mTree[j].mData = HasBox(sp) ? sp : NULL;
+    ip->mTree[j].mFirst = next;
+    ip->mTree[j].mNSub = sp->mNSubField;
+    for (i = 0; i < sp->mNSubField; i++) {
+      from[next++] = sp->mSubField[i];
+    }
+  }
+  free(from);
+  return true;
+}
+//
+//  Grow lo and hi to hold every box in the tree and shrink smallest to
+//  the smallest extent of any of them along each axis.
+//
+static void TreeBox(const CD3Index* ip, double lo[3], double hi[3],
+                    double smallest[3])
+{
+  int j, k;
+  double size;
+  const CD3Node* np;
+  for (j = 0; j < ip->mNNode; j++) {
+    np = &ip->mTree[j];
+    if (np->mData == NULL) {
+      continue;
+    }
+    for (k = 0; k < 3; k++) {
+      lo[k] = fmin(lo[k], np->mMin[k]);
+      hi[k] = fmax(hi[k], np->mMax[k]);
+      size = np->mMax[k] - np->mMin[k];
+      if ((size > 0.0) && ((smallest[k] < 0.0) || (size < smallest[k]))) {
+        smallest[k] = size;
+      }
+    }
+  }
+}
+//
+//  Does the box of np overlap the box lo to hi at all, and does it hold
+//  all of it? Touching counts as overlapping.
+//
+static bool BoxMeets(const CD3Node* np, const double lo[3],
+                     const double hi[3])
+{
+  int k;
+  for (k = 0; k < 3; k++) {
+    if ((hi[k] < np->mMin[k]) || (lo[k] > np->mMax[k])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool BoxHolds(const CD3Node* np, const double lo[3],
+                     const double hi[3])
+{
+  int k;
+  for (k = 0; k < 3; k++) {
+    if ((lo[k] < np->mMin[k]) || (hi[k] > np->mMax[k])) {
+      return false;
+    }
+  }
+  return true;
+}
+//
+//  Work out where the search for any point in the cell lo to hi should
+//  start. If the first daughter of node the cell touches holds all of it,
+//  every point in the cell goes that way so we follow. If the cell
+//  touches no daughter then node owns all of it, none of it, or some of
+//  it.
+//
+static void Resolve(const CD3Node* tree, int node, const double lo[3],
+                    const double hi[3], int* cell, unsigned char* exact)
+{
+  int i;
+  const CD3Node* np = &tree[node];
+  for (i = np->mFirst; i < np->mFirst + np->mNSub; i++) {
+    if (BoxMeets(&tree[i], lo, hi)) {
+      if (BoxHolds(&tree[i], lo, hi)) {
+        Resolve(tree, i, lo, hi, cell, exact);
+      } else {
+        *cell = node;
+        *exact = 0;
+      }
+      return;
+    }
+  }
+  if ((np->mData == NULL) || !BoxMeets(np, lo, hi)) {
+    *cell = -1;
+    *exact = 1;
+  } else if (BoxHolds(np, lo, hi)) {
+    *cell = node;
+    *exact = 1;
+  } else {
+    *cell = node;
+    *exact = 0;
+  }
+}
+
+static void FreeIndex(CD3Index* ip)
+{
+  free(ip->mTree);
+  free(ip->mCell);
+  free(ip->mExact);
+  free(ip);
+}
+
+//
+//  File operations.
+//  The first writes a complete field to binary with the magic header.
+//  It needs a complete CD3Data and a FILE open for writing.
+//  The only difference between a 3D and 3D file is the amount of data
+//  to write. gCD3FileVersion decides which format we write.
+//
+bool CD3WriteBinary(CD3Data* dp, FILE* ofp)
+{
+  int64_t npoint, nValue, i;
+  int c, nComp;
+  int success = false;
+  uint64_t dataOffset = DataOffset();
+  void* head;
+  CD3HeadV2* head2;
+  double scale[3] = {1.0, 1.0, 1.0};
+  double top[3] = {0.0, 0.0, 0.0};
+  //
+  //  A field that is already narrow goes out as it is. A double one
+  //  is narrowed as it is written if gCD3WriteType asks for it. Halfs
+  //  get a scale that brings the largest value of each component up to
+  //  kCD3HalfTop.
+  //
+  CD3ValueType type = (dp->mValueType == kCD3Double) ?
+                      gCD3WriteType : dp->mValueType;
+  CD3GridLayout layout = (dp->mType == kCD3Data3) ?
+                         gCD3WriteLayout : kCD3RowMajor;
+  if (((type != kCD3Double) || gCD3Compress || (layout != kCD3RowMajor)) &&
+      (gCD3FileVersion == 1)) {
+    fprintf(stderr,
+            "CD3WriteBinary: Version 1 files can only hold plain "
+            "row major doubles.\n");
+    return false;
+  }
+  if (gCD3Compress && (layout == kCD3Morton)) {
+    fprintf(stderr, "CD3WriteBinary: Morton files can't be packed.\n");
+    return false;
+  }
+  if (gCD3Compress && ((gCD3BlockPlanes < 1) ||
+                       ((layout == kCD3Brick) && (gCD3BlockPlanes % 4)))) {
+    fprintf(stderr,
+            "CD3WriteBinary: Invalid planes per block %d.\n",
+            gCD3BlockPlanes);
+    return false;
+  }
+  npoint = NPoint(dp);
+  if ((npoint < 0) || !CD3LoadAll(dp)) {
+    return false;
+  }
+  nValue = NValue(dp, layout);
+  if (nValue < 0) {
+    fprintf(stderr, "CD3WriteBinary: Field too big for layout %d.\n", layout);
+    return false;
+  }
+  if (dp->mValueType != kCD3Double) {
+    for (c = 0; c < 3; c++) {
+      scale[c] = dp->mScale[c];
+    }
+  } else if (type == kCD3Half) {
+    nComp = (dp->mType == kCD3Data2) ? 2 : 3;
+    for (i = 0; i < NValue(dp, dp->mLayout); i++) {
+      c = (int) (i % nComp);
+      if (fabs(dp->mField[i]) > top[c]) {
+        top[c] = fabs(dp->mField[i]);
+      }
+    }
+    for (c = 0; c < nComp; c++) {
+      if (top[c] > 0.0) {
+        scale[c] = top[c] / kCD3HalfTop;
+      }
+    }
+  }
+  head = MakeHeader(dp, layout, type, scale);
+  if (head == NULL) {
+    return false;
+  }
+  //
+  //  A packed file has the block index where the values would start
+  //  and the blocks after it.
+  //
+  head2 = (CD3HeadV2*) head;
+  if (gCD3Compress) {
+    head2->packing = 1;
+    head2->blockPlanes = gCD3BlockPlanes;
+    head2->nBlock = (NPlane(dp, layout) + gCD3BlockPlanes - 1) /
+                    gCD3BlockPlanes;
+    head2->indexOffset = head2->dataOffset;
+    head2->dataOffset = head2->indexOffset +
+                        (head2->nBlock + 1) * sizeof(uint64_t);
+  }
+  //
+  //  Write header and data to disk.
+  //
+  if (fwrite(head, 1, dataOffset, ofp) == dataOffset) {
+    printf("%lld = %d * %d * %d\n", (long long) npoint,
+           dp->mNVal[0],dp->mNVal[1],dp->mNVal[2]);
+    if (gCD3Compress) {
+      success = WritePacked(dp, ofp, head2, scale);
+    } else {
+      success = WriteValues(dp, ofp, layout, nValue, type, scale);
+    }
+    if (success) {
+      printf("CD3WriteBinary wrote %lld data values.\n", (long long) nValue);
+    } else {
+      fprintf(stderr, "CD3WriteBinary:Failed to write data.\n");
+    }
+  } else {
+    fprintf(stderr, "CD3WriteBinary:Failed to write header.\n");
+  }
+  //
+  //  Dispose of header and are done.
+  //
+  free(head);
+  return success;
+}
+//
+//  Where the data start in the version we are writing. Version 2 puts
+//  them on a page boundary so they can be mapped or read with O_DIRECT.
+//
+static uint64_t DataOffset(void)
+{
+  return (gCD3FileVersion == 1) ? gCD3HeadLength : kCD3DataAlign;
+}
+//
+//  Bytes taken by one value of each type.
+//
+static size_t ValueSize(CD3ValueType type)
+{
+  switch (type) {
+    case kCD3Float:
+      return sizeof(float);
+
+    case kCD3Half:
+      return sizeof(uint16_t);
+
+    default:
+      return sizeof(double);
+  }
+}
+//
+//  StoreValues puts the n values starting at start of dp laid out as
+//  layout into out as type, converting a double field to float or scaled
+//  half if need be. A field already stored as type and layout is simply
+//  copied. Padding in a brick layout comes out as zero.
+//
+static void StoreValues(const CD3Data* dp, CD3GridLayout layout,
+                        int64_t start, int64_t n, CD3ValueType type,
+                        const double scale[3], void* out)
+{
+  int64_t j, k;
+  int nComp = (dp->mType == kCD3Data2) ? 2 : 3;
+  size_t size = ValueSize(type);
+  const char* from = (const char*) ((dp->mValueType == kCD3Double) ?
+                                    (void*) dp->mField : dp->mNarrow);
+  if ((dp->mValueType == type) && (dp->mLayout == layout)) {
+    memcpy(out, from + start * size, n * size);
+    return;
+  }
+  for (j = 0; j < n; j++) {
+    k = (dp->mLayout == layout) ? start + j :
+        SourceIndex(dp, layout, start + j);
+    if (dp->mValueType == type) {
+      if (k < 0) {
+        memset((char*) out + j * size, 0, size);
+      } else {
+        memcpy((char*) out + j * size, from + k * size, size);
+      }
+    } else if (type == kCD3Float) {
+      ((float*) out)[j] = (k < 0) ? 0.0f : (float) dp->mField[k];
+    } else {
+      ((uint16_t*) out)[j] = (k < 0) ? 0 :
+        DoubleToHalf(dp->mField[k] / scale[(start + j) % nComp]);
+    }
+  }
+}
+//
+//  Write all nValue values of dp out as type in layout. If they are
+//  already stored that way they go straight out, otherwise they are
+//  converted a block at a time.
+//
+static bool WriteValues(const CD3Data* dp, FILE* ofp, CD3GridLayout layout,
+                        int64_t nValue, CD3ValueType type,
+                        const double scale[3])
+{
+  int64_t i, n;
+  double buff[4096];
+  const int64_t kBlock = 4096;
+  if ((dp->mValueType == type) && (dp->mLayout == layout)) {
+    return fwrite((type == kCD3Double) ? (void*) dp->mField : dp->mNarrow,
+                  ValueSize(type), nValue, ofp) == (size_t) nValue;
+  }
+  for (i = 0; i < nValue; i += n) {
+    n = (nValue - i < kBlock) ? nValue - i : kBlock;
+    StoreValues(dp, layout, i, n, type, scale, buff);
+    if (fwrite(buff, ValueSize(type), n, ofp) != (size_t) n) {
+      return false;
+    }
+  }
+  return true;
+}
+//
+//  Write the values as CDPack blocks of head->blockPlanes z planes, then
+//  go back and fill in the index of where they went.
+//
+static bool WritePacked(const CD3Data* dp, FILE* ofp,
+                        const CD3HeadV2* head, const double scale[3])
+{
+  uint64_t b, n, blockValues;
+  size_t size = ValueSize((CD3ValueType) head->valueType), used;
+  uint64_t* offset = NULL;
+  void* vals = NULL;
+  unsigned char* packed = NULL;
+  bool success = false;
+  blockValues = head->nValue / NPlane(dp, (CD3GridLayout) head->layout) *
+                head->blockPlanes;
+  offset = (uint64_t*) malloc((head->nBlock + 1) * sizeof(uint64_t));
+  vals = malloc(blockValues * size);
+  packed = (unsigned char*) malloc(CDPackBound(blockValues, (int) size));
+  if ((offset == NULL) || (vals == NULL) || (packed == NULL)) {
+    fprintf(stderr, "CD3WriteBinary: Could not allocate block buffers.\n");
+    goto Finish;
+  }
+  offset[0] = head->dataOffset;
+  if (fseeko(ofp, (off_t) offset[0], SEEK_SET) != 0) {
+    goto Finish;
+  }
+  for (b = 0; b < head->nBlock; b++) {
+    n = head->nValue - b * blockValues;
+    if (n > blockValues) {
+      n = blockValues;
+    }
+    StoreValues(dp, (CD3GridLayout) head->layout, b * blockValues, n,
+                (CD3ValueType) head->valueType, scale, vals);
+    used = CDPack(vals, n, (int) size, head->nComp, packed);
+    if ((used == 0) || (fwrite(packed, 1, used, ofp) != used)) {
+      goto Finish;
+    }
+    offset[b + 1] = offset[b] + used;
+  }
+  if ((fseeko(ofp, (off_t) head->indexOffset, SEEK_SET) != 0) ||
+      (fwrite(offset, sizeof(uint64_t), head->nBlock + 1, ofp) !=
+       head->nBlock + 1) ||
+      (fseeko(ofp, 0, SEEK_END) != 0)) {
+    goto Finish;
+  }
+  printf("CD3WriteBinary packed %llu bytes of values into %llu.\n",
+         (unsigned long long) (head->nValue * size),
+         (unsigned long long) (offset[head->nBlock] - offset[0]));
+  success = true;
+Finish:
+  free(offset);
+  free(vals);
+  free(packed);
+  return success;
+}
+//
+//  MakeHeader builds the header for a binary file describing dp, all
+//  DataOffset() bytes of it. The header is zeroed first so that unused
+//  bytes on disk are always the same. The caller frees it.
+//
+static void* MakeHeader(const CD3Data* dp, CD3GridLayout layout,
+                        CD3ValueType type, const double scale[3])
+{
+  int i;
+  CD3Header* head;
+  CD3HeadV2* head2;
+  void* buff = calloc(1, DataOffset());
+  if (buff == NULL) {
+    fprintf(stderr, "CD3WriteBinary not allocate header.\n");
+    return NULL;
+  }
+  printf("Field type %d, stride %d\n", dp->mType, dp->mStride);
+  for (i = 0; i < 3; i++) {
+    printf("Dim %d: %d vals %f to %f by %f\n", i,
+           dp->mNVal[i],
+           dp->mMin[i],
+           dp->mMax[i],
+           dp->mDelta[i]);
+  }
+  if (gCD3FileVersion == 1) {
+    //
+    //  Old style. Fill in the frozen copy of CD3Data.
+    //
+    head = (CD3Header *) buff;
+    head->magic = gCD3Magic;
+    head->dataOffset = gCD3HeadLength;
+    if (gFieldFileName != NULL) {
+      strncpy(head->fileName, gFieldFileName, 63);
+    }
+    if (gModelFileName != NULL) {
+      strncpy(head->modelName, gModelFileName, 63);
+    }
+    head->dp.mType = dp->mType;
+    head->dp.mStride = dp->mStride;
+    for (i = 0; i < 3; i++) {
+      head->dp.mNVal[i] = dp->mNVal[i];
+      head->dp.mMin[i] = dp->mMin[i];
+      head->dp.mMax[i] = dp->mMax[i];
+      head->dp.mDelta[i] = dp->mDelta[i];
+    }
+    return buff;
+  }
+  head2 = (CD3HeadV2 *) buff;
+  memcpy(head2->magic, kCD3MagicV2, 8);
+  head2->endian = kCD3Endian;
+  head2->version = 2;
+  head2->headLength = sizeof(CD3HeadV2);
+  head2->dataOffset = kCD3DataAlign;
+  head2->nValue = NValue(dp, layout);
+  head2->type = dp->mType;
+  head2->nComp = (dp->mType == kCD3Data2) ? 2 : 3;
+  head2->valueType = type;
+  head2->layout = layout;
+  head2->pointStride = head2->nComp;
+  head2->compStride = 1;
+  head2->axStride = dp->mStride;
+  for (i = 0; i < 3; i++) {
+    head2->nVal[i] = dp->mNVal[i];
+    head2->min[i] = dp->mMin[i];
+    head2->max[i] = dp->mMax[i];
+    head2->delta[i] = dp->mDelta[i];
+    head2->scale[i] = scale[i];
+  }
+  if (gFieldFileName != NULL) {
+    strncpy(head2->fileName, gFieldFileName, 63);
+  }
+  if (gModelFileName != NULL) {
+    strncpy(head2->modelName, gModelFileName, 63);
+  }
+  return buff;
+}
+//
+//  The number of doubles in the field, or -1 if the type is bad.
+//
+static int64_t NPoint(const CD3Data* dp)
+{
+  int64_t npoint = (int64_t) dp->mNVal[0] * dp->mNVal[1] * dp->mNVal[2];
+  switch (dp->mType) {
+    case kCD3Data2:
+      return npoint * 2;
+
+    case kCD3Data3:
+      return npoint * 3;
+
+    default:
+      fprintf(stderr, "CD3WriteBinary:Invalid file type %d.\n", dp->mType);
+      return -1;
+  }
+}
+//
+//  The number of values it takes to store dp in layout, which for
+//  bricks includes the padding, and the number of z planes they make.
+//
+static int64_t NValue(const CD3Data* dp, CD3GridLayout layout)
+{
+  int bits[3];
+  int64_t npoint = NPoint(dp);
+  if ((layout == kCD3RowMajor) || (npoint < 0)) {
+    return npoint;
+  }
+  if (layout == kCD3Morton) {
+    return (MortonBits(dp, bits) > kCD3MortonMaxBits) ? -1 :
+           ((int64_t) 1 << MortonBits(dp, bits)) * 3;
+  }
+  return (int64_t) ((dp->mNVal[0] + 3) & ~3u) * ((dp->mNVal[1] + 3) & ~3u) *
+         ((dp->mNVal[2] + 3) & ~3u) * 3;
+}
+
+static uint64_t NPlane(const CD3Data* dp, CD3GridLayout layout)
+{
+  return (layout == kCD3Brick) ? ((dp->mNVal[2] + 3) & ~3u) : dp->mNVal[2];
+}
+//
+//  PointAt is CD3IndexAt for a given layout. A brick is 64 points, z
+//  then y then x, and the bricks are numbered the same way. The Morton
+//  code is the OR of those of each index, which only a field with that
+//  layout has.
+//
+static uint64_t PointAt(const CD3Data* dp, CD3GridLayout layout,
+                        uint32_t ix, uint32_t iy, uint32_t iz)
+{
+  uint64_t index = iz;
+  if (layout == kCD3Morton) {
+    return dp->mMorton[ix] | dp->mMorton[dp->mNVal[0] + iy] |
+           dp->mMorton[dp->mNVal[0] + dp->mNVal[1] + iz];
+  }
+  if (layout == kCD3Brick) {
+    index = ((uint64_t) (iz >> 2) * ((dp->mNVal[1] + 3) >> 2) + (iy >> 2)) *
+            ((dp->mNVal[0] + 3) >> 2) + (ix >> 2);
+    return (index << 6) | ((iz & 3) << 4) | ((iy & 3) << 2) | (ix & 3);
+  }
+  //
+  //  Do this step by step to avoid overflow.
+  //
+  index = index * dp->mNVal[1] + iy;
+  index = index * dp->mNVal[0] + ix;
+  return index;
+}
+//
+//  SourceIndex takes value j of dp laid out as layout and says where
+//  that value is in dp as it is stored, or -1 if it is brick padding.
+//
+static int64_t SourceIndex(const CD3Data* dp, CD3GridLayout layout,
+                           int64_t j)
+{
+  int nComp = (dp->mType == kCD3Data2) ? 2 : 3;
+  int i, k, bits[3], pos = 0;
+  uint64_t p = j / nComp, b;
+  uint32_t ix, iy, iz, nb[2], im[3] = {0, 0, 0};
+  if (layout == kCD3Morton) {
+    //
+    //  Deal the bits of the code back out in the order MortonSpread
+    //  dealt them in.
+    //
+    MortonBits(dp, bits);
+    for (i = 0; i < 32; i++) {
+      for (k = 0; k < 3; k++) {
+        if (i < bits[k]) {
+          im[k] |= (uint32_t) ((p >> pos++) & 1) << i;
+        }
+      }
+    }
+    ix = im[0];
+    iy = im[1];
+    iz = im[2];
+  } else if (layout == kCD3Brick) {
+    nb[0] = (dp->mNVal[0] + 3) >> 2;
+    nb[1] = (dp->mNVal[1] + 3) >> 2;
+    b = p >> 6;
+    ix = (uint32_t) (b % nb[0]) * 4 + (p & 3);
+    iy = (uint32_t) ((b / nb[0]) % nb[1]) * 4 + ((p >> 2) & 3);
+    iz = (uint32_t) (b / nb[0] / nb[1]) * 4 + ((p >> 4) & 3);
+  } else {
+    ix = (uint32_t) (p % dp->mNVal[0]);
+    iy = (uint32_t) ((p / dp->mNVal[0]) % dp->mNVal[1]);
+    iz = (uint32_t) (p / dp->mNVal[0] / dp->mNVal[1]);
+  }
+  if ((ix >= dp->mNVal[0]) || (iy >= dp->mNVal[1]) || (iz >= dp->mNVal[2])) {
+    return -1;
+  }
+  return (int64_t) PointAt(dp, dp->mLayout, ix, iy, iz) * nComp + j % nComp;
+}
+//
+//  Reorder a field in memory. StoreValues does the work, and CD3Finish
+//  gets rid of the old values however they were held.
+//
+bool CD3SetLayout(CD3Data* dp, CD3GridLayout layout)
+{
+  int64_t nValue;
+  size_t size = ValueSize(dp->mValueType);
+  void* values;
+  struct CD3IndexTag* index;
+  const struct CD3DataTag** subField;
+  int nSubField;
+  if (dp->mLayout == layout) {
+    return true;
+  }
+  if ((dp->mType != kCD3Data3) || (layout > kCD3Morton)) {
+    fprintf(stderr, "CD3SetLayout: Can't give field type %d layout %d.\n",
+            dp->mType, layout);
+    return false;
+  }
+  if (!CD3LoadAll(dp)) {
+    return false;
+  }
+  nValue = NValue(dp, layout);
+  values = (nValue < 0) ? NULL : malloc(nValue * size);
+  if (values == NULL) {
+    fprintf(stderr, "CD3SetLayout: Failed to allocate %lld values.\n",
+            (long long) nValue);
+    return false;
+  }
+  StoreValues(dp, layout, 0, nValue, dp->mValueType, dp->mScale, values);
+  //
+  //  Only the values change, so keep any tree the field is the root of.
+  //
+  index = dp->mIndex;
+  subField = dp->mSubField;
+  nSubField = dp->mNSubField;
+  dp->mIndex = NULL;
+  dp->mSubField = NULL;
+  CD3Finish(dp);
+  dp->mIndex = index;
+  dp->mSubField = subField;
+  dp->mNSubField = nSubField;
+  dp->mLayout = layout;
+  if (dp->mValueType == kCD3Double) {
+    dp->mField = (double*) values;
+  } else {
+    dp->mNarrow = values;
+  }
+  return (layout != kCD3Morton) || MakeMorton(dp);
+}
+//
+//  The number of bits of each index that go into a Morton code, and
+//  their total. An axis of n points needs enough bits to count to n-1.
+//
+static int MortonBits(const CD3Data* dp, int bits[3])
+{
+  int k;
+  for (k = 0; k < 3; k++) {
+    for (bits[k] = 0; ((uint64_t) 1 << bits[k]) < dp->mNVal[k]; bits[k]++) {
+    }
+  }
+  return bits[0] + bits[1] + bits[2];
+}
+//
+//  Spread the bits of index v along axis out to where they go in the
+//  Morton code. Bit i of x goes before bit i of y and bit i of z, and
+//  an axis with no more bits drops out.
+//
+static uint64_t MortonSpread(const int bits[3], int axis, uint32_t v)
+{
+  int i, k, pos = 0;
+  uint64_t code = 0;
+  for (i = 0; i < 32; i++) {
+    for (k = 0; k < 3; k++) {
+      if (i < bits[k]) {
+        if ((k == axis) && ((v >> i) & 1)) {
+          code |= (uint64_t) 1 << pos;
+        }
+        ++pos;
+      }
+    }
+  }
+  return code;
+}
+//
+//  Build the table of spread indices PointAt uses, one entry for every
+//  x, then every y, then every z.
+//
+static bool MakeMorton(CD3Data* dp)
+{
+  int k, bits[3];
+  uint32_t v;
+  uint64_t* t;
+  if (MortonBits(dp, bits) > kCD3MortonMaxBits) {
+    fprintf(stderr, "MakeMorton: Field too big for a Morton layout.\n");
+    return false;
+  }
+  free(dp->mMorton);
+  t = dp->mMorton = (uint64_t*) malloc(((uint64_t) dp->mNVal[0] +
+                                        dp->mNVal[1] + dp->mNVal[2]) *
+                                       sizeof(uint64_t));
+  if (t == NULL) {
+    fprintf(stderr, "MakeMorton: Could not allocate Morton table.\n");
+    return false;
+  }
+  for (k = 0; k < 3; k++) {
+    for (v = 0; v < dp->mNVal[k]; v++) {
+      *t++ = MortonSpread(bits, k, v);
+    }
+  }
+  return true;
+}
+//
+//  The second constructs a CD3Data field from a binary file. It is the
+//  binary equivalent of CD3Init for text files. It understands both
+//  versions of the format and tells them apart by the magic number.
+//  Because we allocate storage that must be thrown away even if an
+//  error occurs we have to exit with a label!!!
+//  Unless gCD3MapBinary is false the field is not read at all. Instead
+//  mField points into a read-only shared mapping of the file so pages
+//  come in only as they are touched and every process using the same
+//  file shares one copy. If the file can't be mapped, or was written
+//  with the other byte order, we fall back to reading it.
+//
+bool CD3ReadBinary(CD3Data* dp, FILE* ifp)
+{
+  int success = false;
+  bool swap = false;
+  bool packed = false;
+  uint64_t dataOffset = 0;
+  //
+  //  Get space for header, read it in, and see which kind it is. Both
+  //  kinds of file are at least gCD3HeadLength long.
+  //
+  void* head = malloc(gCD3HeadLength);
+  dp->mField = NULL;
+  dp->mMap = NULL;
+  dp->mMapLength = 0;
+  dp->mNarrow = NULL;
+  dp->mValueType = kCD3Double;
+  dp->mScale[0] = dp->mScale[1] = dp->mScale[2] = 1.0;
+  dp->mBlocks = NULL;
+  dp->mLayout = kCD3RowMajor;
+  dp->mMorton = NULL;
+  dp->mIndex = NULL;
+  dp->mNSubField = 0;
+  dp->mSubField = NULL;
+  if (head == NULL) {
+    fprintf(stderr, "CD3ReadBinary: Could not allocate header.\n");
     return false;
   }
   if (fseek(ifp, 0L, SEEK_SET) != 0) {
@@ -514,116 +1679,507 @@ bool CD3ReadBinary(CD3Data* dp, FILE* ifp)
     fprintf(stderr, "CD3ReadBinary: Could not read header.\n");
     goto Finish;
   }
-  if (head->magic != gCD3Magic) {
-    fprintf(stderr,
-            "CD3ReadBinary: Header magic number %x does not match %x.\n",
-            head->magic, gCD3Magic);
-    goto Finish;
+  if (((CD3Header*) head)->magic == gCD3Magic) {
+    if (!ReadHeadV1(dp, (CD3Header*) head, &dataOffset)) {
+      goto Finish;
+    }
+  } else if (memcmp(head, kCD3MagicV2, 8) == 0) {
+    if (!ReadHeadV2(dp, (CD3HeadV2*) head, &swap)) {
+      goto Finish;
+    }
+    dataOffset = ((CD3HeadV2*) head)->dataOffset;
+    packed = (((CD3HeadV2*) head)->packing != 0);
+  } else {
+    fprintf(stderr,
+            "CD3ReadBinary: Header magic number %x does not match %x.\n",
+            ((CD3Header*) head)->magic, gCD3Magic);
+    goto Finish;
+  }
+  if (!CheckShape(dp) ||
+      ((dp->mLayout == kCD3Morton) && !MakeMorton(dp))) {
+    goto Finish;
+  }
+  Prepare(dp);
+  if (packed) {
+    success = LoadPacked(dp, ifp, (CD3HeadV2*) head, swap);
+  } else {
+    success = LoadField(dp, ifp, dataOffset, NValue(dp, dp->mLayout), swap);
+  }
+  //
+  //  All exit paths go through here to clean up.
+  //
+Finish:
+  free(head);
+  if (!success) {
+    CD3Finish(dp);
+  }
+  return success;
+}
+//
+//  Pull what we need out of a version 1 header.
+//
+static bool ReadHeadV1(CD3Data* dp, const CD3Header* head,
+                       uint64_t* dataOffset)
+{
+  int i;
+  dp->mType = (CD3TypeTag) head->dp.mType;
+  dp->mStride = head->dp.mStride;
+  for (i = 0; i < 3; i++) {
+    dp->mNVal[i] = head->dp.mNVal[i];
+    dp->mMin[i] = head->dp.mMin[i];
+    dp->mMax[i] = head->dp.mMax[i];
+    dp->mDelta[i] = head->dp.mDelta[i];
+  }
+  *dataOffset = head->dataOffset;
+  return true;
+}
+//
+//  Same for version 2, which takes a bit more checking. If the file was
+//  written with the other byte order we swap the header in place and
+//  tell the caller to swap the data too.
+//
+static bool ReadHeadV2(CD3Data* dp, CD3HeadV2* head, bool* swap)
+{
+  int i;
+  uint64_t bits;
+  double* dbl[12];
+  if (head->endian == kCD3Endian) {
+    *swap = false;
+  } else if (head->endian == Swap32(kCD3Endian)) {
+    *swap = true;
+    head->version = Swap32(head->version);
+    head->headLength = Swap64(head->headLength);
+    head->dataOffset = Swap64(head->dataOffset);
+    head->nValue = Swap64(head->nValue);
+    head->type = Swap32(head->type);
+    head->nComp = Swap32(head->nComp);
+    head->valueType = Swap32(head->valueType);
+    head->layout = Swap32(head->layout);
+    head->pointStride = Swap64(head->pointStride);
+    head->compStride = Swap64(head->compStride);
+    head->axStride = (int64_t) Swap64((uint64_t) head->axStride);
+    head->packing = Swap32(head->packing);
+    head->blockPlanes = Swap32(head->blockPlanes);
+    head->nBlock = Swap64(head->nBlock);
+    head->indexOffset = Swap64(head->indexOffset);
+    for (i = 0; i < 3; i++) {
+      head->nVal[i] = Swap64(head->nVal[i]);
+      dbl[i] = &head->min[i];
+      dbl[i + 3] = &head->max[i];
+      dbl[i + 6] = &head->delta[i];
+      dbl[i + 9] = &head->scale[i];
+    }
+    for (i = 0; i < 12; i++) {
+      memcpy(&bits, dbl[i], sizeof(bits));
+      bits = Swap64(bits);
+      memcpy(dbl[i], &bits, sizeof(bits));
+    }
+  } else {
+    fprintf(stderr, "CD3ReadBinary: Bad endian marker %x.\n", head->endian);
+    return false;
+  }
+  if (head->version != 2) {
+    fprintf(stderr, "CD3ReadBinary: Can't read version %u files.\n",
+            head->version);
+    return false;
+  }
+  if ((head->valueType > kCD3Half) || (head->layout > kCD3Morton) ||
+      ((head->layout != kCD3RowMajor) && (head->type != kCD3Data3)) ||
+      ((head->layout == kCD3Morton) && (head->packing != 0))) {
+    fprintf(stderr, "CD3ReadBinary: Unknown value type %u or layout %u.\n",
+            head->valueType, head->layout);
+    return false;
+  }
+  if ((head->headLength > head->dataOffset) ||
+      (head->dataOffset % sizeof(double) != 0)) {
+    fprintf(stderr, "CD3ReadBinary: Bad data offset %llu.\n",
+            (unsigned long long) head->dataOffset);
+    return false;
+  }
+  dp->mType = (CD3TypeTag) head->type;
+  dp->mLayout = (CD3GridLayout) head->layout;
+  dp->mStride = (int) head->axStride;
+  dp->mValueType = (CD3ValueType) head->valueType;
+  for (i = 0; i < 3; i++) {
+    if (head->nVal[i] > UINT32_MAX) {
+      fprintf(stderr, "CD3ReadBinary: Dimension %d too big (%llu).\n",
+              i, (unsigned long long) head->nVal[i]);
+      return false;
+    }
+    dp->mNVal[i] = (unsigned int) head->nVal[i];
+    dp->mMin[i] = head->min[i];
+    dp->mMax[i] = head->max[i];
+    dp->mDelta[i] = head->delta[i];
+    dp->mScale[i] = (head->valueType == kCD3Half) ? head->scale[i] : 1.0;
+    if (!(dp->mScale[i] > 0.0)) {
+      fprintf(stderr, "CD3ReadBinary: Bad scale %g for component %d.\n",
+              dp->mScale[i], i);
+      return false;
+    }
+  }
+  //
+  //  We only know how to use interleaved data.
+  //
+  if ((head->pointStride != head->nComp) || (head->compStride != 1) ||
+      (head->nValue != (uint64_t) NValue(dp, dp->mLayout)) ||
+      (head->nComp != ((dp->mType == kCD3Data2) ? 2 : 3))) {
+    fprintf(stderr, "CD3ReadBinary: Data layout does not match field type.\n");
+    return false;
+  }
+  if ((head->packing > 1) ||
+      ((head->packing == 1) &&
+       ((head->blockPlanes == 0) ||
+        ((dp->mLayout == kCD3Brick) && (head->blockPlanes % 4)) ||
+        (NPlane(dp, dp->mLayout) == 0) ||
+        (head->nBlock != (NPlane(dp, dp->mLayout) + head->blockPlanes - 1) /
+                         head->blockPlanes) ||
+        (head->indexOffset < head->headLength) ||
+        (head->indexOffset + (head->nBlock + 1) * sizeof(uint64_t) >
+         head->dataOffset)))) {
+    fprintf(stderr, "CD3ReadBinary: Bad packing %u in %llu blocks.\n",
+            head->packing, (unsigned long long) head->nBlock);
+    return false;
+  }
+  return true;
+}
+//
+//  Check that the shape read from a header makes sense.
+//
+static bool CheckShape(const CD3Data* dp)
+{
+  int i, nActive = 0;
+  if ((dp->mType != kCD3Data2) && (dp->mType != kCD3Data3)) {
+    fprintf(stderr,
+            "CD3ReadBinary: Invalid field type %d.\n",
+            dp->mType);
+    return false;
+  }
+  for (i = 0; i < 3; i++) {
+    if (dp->mNVal[i] > 1) {
+      ++nActive;
+      if (dp->mMax[i] <= dp->mMin[i]) {
+        fprintf(stderr,
+                "CD3ReadBinary: Data error. Dimension %d  max <= min.\n",
+                i);
+        return false;
+      }
+      if (dp->mDelta[i] <= 0.0) {
+        fprintf(stderr,
+                "CD3ReadBinary: Data inalid. Dimension %d  delta = %f.\n",
+                i, dp->mDelta[i]);
+        return false;
+      }
+    }
+  }
+  if (((dp->mType == kCD3Data2) && (nActive != 2)) ||
+      ((dp->mType == kCD3Data3) && (nActive != 3))) {
+    fprintf(stderr,
+            "CD3ReadBinary: Data error. "
+            "Number of active dims does not match type.\n");
+    return false;
+  }
+  return true;
+}
+//
+//  Prepare works out the things every query needs that depend only on
+//  the shape of the field: the inverse of each delta, so queries
+//  multiply rather than divide, the highest index a cell can start at,
+//  the values from one point to the next along each axis of a row major
+//  field and the interpolation kernels. 2D fields keep r and z as axes 1 and 2, with the number
+//  of r values in mStride whichever of x and y they came from.
+//
+static void Prepare(CD3Data* dp)
+{
+  int i;
+  for (i = 0; i < 3; i++) {
+    dp->mInvDelta[i] = (dp->mDelta[i] != 0.0) ? 1.0 / dp->mDelta[i] : 0.0;
+    dp->mTop[i] = (int) dp->mNVal[i] - 2;
+  }
+  if (dp->mType == kCD3Data2) {
+    dp->mTop[1] = dp->mStride - 2;
+    dp->mStep[0] = 0;
+    dp->mStep[1] = 2;
+    dp->mStep[2] = 2 * (int64_t) dp->mStride;
+  } else {
+    dp->mStep[0] = 3;
+    dp->mStep[1] = 3 * (int64_t) dp->mNVal[0];
+    dp->mStep[2] = dp->mStep[1] * dp->mNVal[1];
+  }
+  CD3PickLerp(dp);
+}
+
+void CD3PickLerp(CD3Data* dp)
+{
+  dp->mLerp = CD3Lerp();
+  dp->mLerp4 = CD3Lerp4();
+}
+//
+//  Get the nValue values at dataOffset into mField or mNarrow, mapping
+//  them if we can and reading (and swapping if need be) otherwise.
+//
+static bool LoadField(CD3Data* dp, FILE* ifp, uint64_t dataOffset,
+                      uint64_t nValue, bool swap)
+{
+  uint64_t i, bits;
+  uint32_t bits32;
+  size_t size = ValueSize(dp->mValueType);
+  size_t length = dataOffset + nValue * size;
+  void* map;
+  void* values;
+  struct stat st;
+  if ((fstat(fileno(ifp), &st) == 0) && ((uint64_t) st.st_size < length)) {
+    fprintf(stderr,
+            "CD3ReadBinary: File too short for %llu data values.\n",
+            (unsigned long long) nValue);
+    return false;
+  }
+  if (gCD3MapBinary && !swap) {
+    map = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(ifp), 0);
+    if (map != MAP_FAILED) {
+      dp->mMap = map;
+      dp->mMapLength = length;
+      values = (char*) map + dataOffset;
+      goto Found;
+    }
+  }
+  values = malloc(nValue * size);
+  if (values == NULL) {
+    fprintf(stderr,
+            "CD3ReadBinary: Failed to allocate %llu values for data.\n",
+            (unsigned long long) nValue);
+    return false;
+  }
+  if ((fseeko(ifp, (off_t) dataOffset, SEEK_SET) != 0) ||
+      (fread(values, size, nValue, ifp) != nValue)) {
+    fprintf(stderr,
+            "CD3ReadBinary: Failed to read data.\n");
+    free(values);
+    return false;
+  }
+  if (swap) {
+    for (i = 0; i < nValue; i++) {
+      switch (dp->mValueType) {
+        case kCD3Float:
+          memcpy(&bits32, (uint32_t*) values + i, sizeof(bits32));
+          bits32 = Swap32(bits32);
+          memcpy((uint32_t*) values + i, &bits32, sizeof(bits32));
+          break;
+
+        case kCD3Half:
+          ((uint16_t*) values)[i] = Swap16(((uint16_t*) values)[i]);
+          break;
+
+        default:
+          memcpy(&bits, (uint64_t*) values + i, sizeof(bits));
+          bits = Swap64(bits);
+          memcpy((uint64_t*) values + i, &bits, sizeof(bits));
+          break;
+      }
+    }
+  }
+Found:
+  if (dp->mValueType == kCD3Double) {
+    dp->mField = (double*) values;
+  } else {
+    dp->mNarrow = values;
+  }
+  return true;
+}
+
+//
+//  Set up a field from a packed file. We read the block index and get
+//  hold of the packed blocks, by mapping the file if we can, and make
+//  room for the values. The blocks themselves are only unpacked as they
+//  are needed, or all at once if gCD3LazyBlocks is false. The packed
+//  bytes don't depend on byte order so only the index needs swapping.
+//
+static bool LoadPacked(CD3Data* dp, FILE* ifp, const CD3HeadV2* head,
+                       bool swap)
+{
+  uint64_t b, length;
+  unsigned char* copy;
+  void* map;
+  struct stat st;
+  CD3Blocks* bp = (CD3Blocks*) calloc(1, sizeof(CD3Blocks));
+  if (bp == NULL) {
+    fprintf(stderr, "CD3ReadBinary: Could not allocate block list.\n");
+    return false;
+  }
+  dp->mBlocks = bp;
+  bp->mNBlock = head->nBlock;
+  bp->mNValue = head->nValue;
+  bp->mSize = (int) ValueSize(dp->mValueType);
+  bp->mNComp = head->nComp;
+  bp->mBlockValues = head->nValue / NPlane(dp, dp->mLayout) *
+                     head->blockPlanes;
+  bp->mOffset = (uint64_t*) malloc((bp->mNBlock + 1) * sizeof(uint64_t));
+  bp->mReady = (unsigned char*) calloc(bp->mNBlock, 1);
+  if ((bp->mOffset == NULL) || (bp->mReady == NULL)) {
+    fprintf(stderr, "CD3ReadBinary: Could not allocate block list.\n");
+    return false;
+  }
+  if ((fseeko(ifp, (off_t) head->indexOffset, SEEK_SET) != 0) ||
+      (fread(bp->mOffset, sizeof(uint64_t), bp->mNBlock + 1, ifp) !=
+       bp->mNBlock + 1)) {
+    fprintf(stderr, "CD3ReadBinary: Failed to read block index.\n");
+    return false;
   }
   //
-  //  Copy CD3Data into place doing some checking as we go.
+  //  Check the index makes sense before we trust it.
   //
-  if ((head->dp.mType == kCD3Data2) || (head->dp.mType == kCD3Data3)) {
-    dp->mType = head->dp.mType;
-  } else {
+  for (b = 0; b <= bp->mNBlock; b++) {
+    if (swap) {
+      bp->mOffset[b] = Swap64(bp->mOffset[b]);
+    }
+    if (((b == 0) && (bp->mOffset[b] != head->dataOffset)) ||
+        ((b > 0) && (bp->mOffset[b] < bp->mOffset[b - 1]))) {
+      fprintf(stderr, "CD3ReadBinary: Bad offset for block %llu.\n",
+              (unsigned long long) b);
+      return false;
+    }
+  }
+  length = bp->mOffset[bp->mNBlock];
+  if ((fstat(fileno(ifp), &st) == 0) && ((uint64_t) st.st_size < length)) {
     fprintf(stderr,
-            "CD3ReadBinary: Invalid field type %d.\n",
-            head->dp.mType);
-    goto Finish;
+            "CD3ReadBinary: File too short for %llu blocks.\n",
+            (unsigned long long) bp->mNBlock);
+    return false;
   }
-  //
-  //  Copy header data into dp counting number of inactives.
-  //
-  for (i = 0; i < 3; i++) {
-    dp->mNVal[i] = head->dp.mNVal[i];
-    dp->mMin[i] = head->dp.mMin[i];
-    dp->mMax[i] = head->dp.mMax[i];
-    dp->mDelta[i] = head->dp.mDelta[i];
-    if (dp->mNVal[i] > 1) {
-      ++nActive;
-      if (dp->mMax[i] <= dp->mMin[i]) {
-        fprintf(stderr,
-                "CD3ReadBinary: Data error. Dimension %d  max <= min.\n",
-                i);
-        goto Finish;
-      }
-      if (dp->mDelta[i] <= 0.0) {
-        fprintf(stderr,
-                "CD3ReadBinary: Data inalid. Dimension %d  delta = %f.\n",
-                i, dp->mDelta[i]);
-        goto Finish;
-      }
+  if (gCD3MapBinary) {
+    map = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(ifp), 0);
+    if (map != MAP_FAILED) {
+      bp->mPackMap = map;
+      bp->mPackMapLength = length;
+      bp->mPacked = (const unsigned char*) map;
+      bp->mBase = 0;
     }
   }
-  if (((dp->mType == kCD3Data2) && (nActive != 2)) ||
-      ((dp->mType == kCD3Data3) && (nActive != 3))) {
-    fprintf(stderr,
-            "CD3ReadBinary: Data error. "
-            "Number of active dims does not match type.\n");
-    goto Finish;
+  if (bp->mPacked == NULL) {
+    bp->mBase = bp->mOffset[0];
+    copy = (unsigned char*) malloc(length - bp->mBase + 1);
+    if ((copy == NULL) ||
+        (fseeko(ifp, (off_t) bp->mBase, SEEK_SET) != 0) ||
+        (fread(copy, 1, length - bp->mBase, ifp) != length - bp->mBase)) {
+      fprintf(stderr, "CD3ReadBinary: Failed to read packed blocks.\n");
+      free(copy);
+      return false;
+    }
+    bp->mPacked = copy;
   }
-  dp->mStride = head->dp.mStride;
-  dp->mNSubField = 0;
-  dp->mSubField[0] = dp->mSubField[1] = NULL;
-  dp->mSubField[2] = dp->mSubField[3] = NULL;
   //
-  //  Now figure out how much data we have, get space, and read it in.
+  //  Pages of the values that no query ever touches are never committed.
   //
-  npoint =  dp->mNVal[0] *  dp->mNVal[1] *  dp->mNVal[2];
-  switch (dp->mType) {
-    case kCD3Data2:
-      npoint *= 2;
-      break;
-
-    case kCD3Data3:
-      npoint *= 3;
-      break;
+  bp->mValues = calloc(bp->mNValue, bp->mSize);
+  if (bp->mValues == NULL) {
+    fprintf(stderr,
+            "CD3ReadBinary: Failed to allocate %llu values for data.\n",
+            (unsigned long long) bp->mNValue);
+    return false;
+  }
+  if (dp->mValueType == kCD3Double) {
+    dp->mField = (double*) bp->mValues;
+  } else {
+    dp->mNarrow = bp->mValues;
+  }
+  if (pthread_mutex_init(&bp->mLock, NULL) != 0) {
+    return false;
+  }
+  bp->mLockInit = true;
+  return gCD3LazyBlocks || CD3LoadAll(dp);
+}
+//
+//  Make sure the block holding value idx has been unpacked. Returns
+//  false if it could not be.
+//
+static bool NeedBlock(const CD3Data* dp, uint64_t idx)
+{
+  CD3Blocks* bp = dp->mBlocks;
+  uint64_t b = idx / bp->mBlockValues;
+  uint64_t n;
+  bool ok = true;
+  if (__atomic_load_n(&bp->mReady[b], __ATOMIC_ACQUIRE)) {
+    return true;
+  }
+  pthread_mutex_lock(&bp->mLock);
+  if (!bp->mReady[b]) {
+    n = bp->mNValue - b * bp->mBlockValues;
+    if (n > bp->mBlockValues) {
+      n = bp->mBlockValues;
+    }
+    ok = CDUnpack(bp->mPacked + (bp->mOffset[b] - bp->mBase),
+                  bp->mOffset[b + 1] - bp->mOffset[b],
+                  (char*) bp->mValues + b * bp->mBlockValues * bp->mSize,
+                  n, bp->mSize, bp->mNComp);
+    if (ok) {
+      __atomic_store_n(&bp->mReady[b], 1, __ATOMIC_RELEASE);
+    }
+  }
+  pthread_mutex_unlock(&bp->mLock);
+  return ok;
+}
 
-    default:
-      fprintf(stderr, "CD3ReadBinary:Invalid file type %d.\n", dp->mType);
-      goto Finish;
+bool CD3LoadAll(const CD3Data* dp)
+{
+  uint64_t b;
+  if (NULL == dp->mBlocks) {
+    return true;
   }
-  dp->mField = NULL;
-  dp->mField = (double *) malloc(npoint * sizeof(double));
-  if (dp->mField == NULL) {
-    fprintf(stderr,
-            "CD3ReadBinary: Failed to allocate %d doubles for data.\n",
-            npoint);
-    goto Finish;
+  for (b = 0; b < dp->mBlocks->mNBlock; b++) {
+    if (!NeedBlock(dp, b * dp->mBlocks->mBlockValues)) {
+      fprintf(stderr, "CD3LoadAll: Block %llu is corrupt.\n",
+              (unsigned long long) b);
+      return false;
+    }
   }
-  if (fread(dp->mField, sizeof(double), npoint, ifp) != npoint) {
-    fprintf(stderr,
-            "CD3ReadBinary: Failed to read data.\n");
-    goto Finish;
+  return true;
+}
+//
+//  Throw away what LoadPacked built, except for the values, which
+//  belong to the field.
+//
+static void FreeBlocks(CD3Blocks* bp)
+{
+  if (NULL != bp->mPackMap) {
+    munmap(bp->mPackMap, bp->mPackMapLength);
+  } else {
+    free((void*) bp->mPacked);
   }
-  /*
-  for (i = 0; i < npoint/3; i++) {
-    printf("{%f,%f,%f}\n", dp->mField[3*i], dp->mField[3*i+1], dp->mField[3*i+2]);
-  }*/
-  success = true;
-  //
-  //  All exit paths go through here to clean up.
-  //
-Finish:
-  free(head);
-  if (dp->mField == NULL) {
-    free(dp->mField);
+  if (bp->mLockInit) {
+    pthread_mutex_destroy(&bp->mLock);
   }
-  return success;
+  free(bp->mOffset);
+  free(bp->mReady);
+  free(bp);
+}
+
+static uint32_t Swap32(uint32_t v)
+{
+  return ((v >> 24) & 0xff) | ((v >> 8) & 0xff00) |
+         ((v << 8) & 0xff0000) | (v << 24);
+}
+
+static uint16_t Swap16(uint16_t v)
+{
+  return (uint16_t) ((v >> 8) | (v << 8));
+}
+
+static uint64_t Swap64(uint64_t v)
+{
+  return ((uint64_t) Swap32((uint32_t) v) << 32) | Swap32((uint32_t) (v >> 32));
 }
 
 //
 //  Internal file scope helper functions.
 //  We use these first two to complete the initialization process once
 //  we know how many dimensions the data have.
-//  Note that since these do not malloc till the end they don't need a
-//  fancy error exit but can just return an error code.
+//  Note that since these do not malloc, only adopting the field from
+//  the CDData at the end, they don't need a fancy error exit but can
+//  just return an error code.
 //
-static CDError Init3D(CD3Data* dp, const CDData* cdp)
+static CDError Init3D(CD3Data* dp, CDData* cdp)
 {
   int dim;
-  int nVal;                 // Total number of field points
-  double* fieldVals[3];     // Point to the individual field component arrays.
+  int64_t nVal;             // Total number of field points
   if (cdp->mNExpression != 3) {
     fprintf(stderr,
             "Expected three expressions, found %d.\n",
@@ -658,25 +2214,23 @@ static CDError Init3D(CD3Data* dp, const CDData* cdp)
     dp->mMin[dim] = cdp->mRange[dim].mMin;
     dp->mMax[dim] = cdp->mRange[dim].mMax;
     dp->mDelta[dim] = cdp->mRange[dim].mDelta;
-    fieldVals[dim] = cdp->mDStore[dim + 3];
   }
   //
-  //  Now we know all the dimensions we know how much storage we need for
-  //  the merged data. Get the space and merge the data arrays into the field.
-  //  Because we copy the data we let CDFinish throw the originals away.
+  //  The field arrived interleaved in the file order, which is just the
+  //  order we want, so we simply take it over. Clearing the pointer
+  //  stops CDFinish throwing it away.
   //
-  nVal = dp->mNVal[0] * dp->mNVal[1] * dp->mNVal[2];
-  dp->mField = (double *) malloc(nVal * 3 * sizeof(double));
-  if (dp->mField == NULL) {
-    return kCDAllocFailed;
-  }
-  for (dim = 0; dim < nVal; dim++) {
-    dp->mField[dim*3] = fieldVals[0][dim];
-    dp->mField[dim*3 + 1] = fieldVals[1][dim];
-    dp->mField[dim*3 + 2] = fieldVals[2][dim];
+  nVal = (int64_t) dp->mNVal[0] * dp->mNVal[1] * dp->mNVal[2];
+  if (nVal > cdp->mNLine) {
+    fprintf(stderr, "Grid of %lld points does not fit in %d lines.\n",
+            (long long) nVal, cdp->mNLine);
+    return kCDBadStructure;
   }
+  dp->mField = cdp->mField;
+  cdp->mField = NULL;
   dp->mType = kCD3Data3;
   dp->mFieldName = cdp->mFileName;
+  Prepare(dp);
   return kCDNoErr;
 }
 //
@@ -685,9 +2239,10 @@ static CDError Init3D(CD3Data* dp, const CDData* cdp)
 //  slice of a field that is symmetric about the z axis. That means that
 //  the min of both x and y coordinates in the data must be 0.
 //
-static CDError Init2D(CD3Data* dp, const CDData* cdp)
+static CDError Init2D(CD3Data* dp, CDData* cdp)
 {
-  int dim, nVal;
+  int dim;
+  int64_t nVal;
   uint32_t inactiveDim = -4;
   //
   if (cdp->mNExpression != 2) {
@@ -772,138 +2327,229 @@ static CDError Init2D(CD3Data* dp, const CDData* cdp)
 
   }
   //
-  //  Now we know all the dimensions we know how much storage we need for
-  //  the merged data. Get the space and merge the data arrays into the field.
-  //  Because we copy the data we let CDFinish throw the originals away.
+  //  As for 3D the field is already in the order we want so we take it.
   //
-  nVal = dp->mNVal[0] * dp->mNVal[1] * dp->mNVal[2];
-  dp->mField = (double *) malloc(nVal * 2 * sizeof(double));
-  if (dp->mField == NULL) {
-    return kCDAllocFailed;
-  }
-  for (dim = 0; dim < nVal; dim++) {
-    dp->mField[dim*2] = cdp->mDStore[3][dim];
-    dp->mField[dim*2 + 1] = cdp->mDStore[4][dim];
+  nVal = (int64_t) dp->mNVal[0] * dp->mNVal[1] * dp->mNVal[2];
+  if (nVal > cdp->mNLine) {
+    fprintf(stderr, "Grid of %lld points does not fit in %d lines.\n",
+            (long long) nVal, cdp->mNLine);
+    return kCDBadStructure;
   }
+  dp->mField = cdp->mField;
+  cdp->mField = NULL;
   dp->mType = kCD3Data2;
   dp->mFieldName = cdp->mFileName;
+  Prepare(dp);
   return kCDNoErr;
 }
 
 //
 //  Internal Accessors know the structure of the data so they can take
 //  it to pieces correctly.
-//  They assume that the high level routine has done bounds checking.
+//  They assume that the high level routine has done bounds checking, so
+//  the only thing left to do at the edges is to use the last cell for
+//  points on the top face. Everything else they need Prepare has
+//  worked out already.
 //
 bool Get3DEAtPoint(const CD3Data* dp, const double coord[3], double* EField)
 {
-  int index[3], i;
-  double rc[3], irc[3];                 // Reduced coords and inverses
-  double minc[3];                        // Minima of surrounding box
-  int idx000, idx001, idx010, idx011, idx100, idx101, idx110, idx111;
-  double c00, c01, c10, c11, c0, c1; // Interpolation steps
-//  double x = coord[0], y = coord[1], z = coord[2];
-  //  printf("[%f,%f,%f]\n",x,y,z);
+  int64_t index[3], idx[8];             // Corners as idx<z><y><x>
+  int i;
+  double t, rc[3];                      // Reduced coords
+  double v[8][4];                       // and their values
+  //
+  //  Find the indices of the grid point BELOW the coordinate along each
+  //  axis and how far along the cell from there it is. The eight corners
+  //  can only be found once we have all three indices.
+  //
   for (i = 0; i < 3; i++) {
-    index[i] = (int) ((coord[i] - dp->mMin[i]) / dp->mDelta[i]);
-    if (index[i] == dp->mNVal[i]-1) { // Correct if at top edge
-      --index[i];
-    }
-#ifdef CD3BoundsCheck
-    if ((coord[i] < dp->mMin[i]) || (coord[i] > dp->mMax[i])) {
-      fprintf(stderr, "Get3DEAtPoint: Coordinate %d, %lf, out of range\n",
-              i, coord[i]);
-      return false;
-    }
-    if (index[i] >= dp->mNVal[i]-1) {
-      fprintf(stderr, "Get3DEAtPoint: Index %d out of range\n", i);
-      return false;
+    t = (coord[i] - dp->mMin[i]) * dp->mInvDelta[i];
+    index[i] = (int64_t) t;
+    index[i] = (index[i] > dp->mTop[i]) ? dp->mTop[i] : index[i];
+    rc[i] = t - index[i];
+  }
+  Corners3D(dp, index, idx);
+  if (!GetCorners(dp, idx, 8, 3, v)) {
+    return false;
+  }
+  Lerp3D(dp, (const double (*)[4]) v, rc, EField);
+  return true;
+}
+//
+//  Corners3D works out the array indices of the first value at each
+//  corner of the cell whose lowest corner has indices index, in the
+//  order idx<z><y><x>. In a brick layout most cells are inside one
+//  brick, which we can do with fixed offsets. Fields can hold more than
+//  2^31 values, so all of this is done in 64 bits. It is inline because
+//  both Get3DEAtPoint and Batch3D call it for every point.
+//
+static inline void Corners3D(const CD3Data* dp, const int64_t index[3],
+                             int64_t idx[8])
+{
+  int c;
+  int64_t sy = dp->mStep[1];
+  int64_t sz = dp->mStep[2];
+  if (dp->mLayout == kCD3RowMajor) {
+    idx[0] = index[2] * sz + index[1] * sy + index[0] * 3;
+  } else if ((dp->mLayout == kCD3Brick) &&
+             ((index[0] & 3) != 3) && ((index[1] & 3) != 3) &&
+             ((index[2] & 3) != 3)) {
+    idx[0] = (int64_t) PointAt(dp, kCD3Brick, index[0], index[1],
+                               index[2]) * 3;
+    sy = 4 * 3;
+    sz = 16 * 3;
+  } else {
+    for (c = 0; c < 8; c++) {
+      idx[c] = (int64_t) PointAt(dp, dp->mLayout, index[0] + (c & 1),
+                                 index[1] + ((c >> 1) & 1),
+                                 index[2] + (c >> 2)) * 3;
     }
-#endif
+    return;
   }
-  //
-  //  At this point I have found the indices for the three dimensions. These
-  //  are normally the indices of the coord BELOW the given coord. Use this
-  //  to compute the array indices (idx's) of the eight points that surround
-  //  the cell containing the coordinate.
-  //  They have form idx<z><y><x>.
-  //  NOTE can't do this before we have all three
-  //  indices.
-  //
-  idx000 = (((index[2])*dp->mNVal[1] + (index[1]))*dp->mNVal[0] +
-            index[0])*3;
-  idx001 = (((index[2])*dp->mNVal[1] + (index[1]))*dp->mNVal[0] +
-            index[0] + 1)*3;
-  idx010 = (((index[2])*dp->mNVal[1] + (index[1]+1))*dp->mNVal[0] +
-            index[0])*3;
-  idx011 = (((index[2])*dp->mNVal[1] + (index[1]+1))*dp->mNVal[0] +
-            index[0] + 1)*3;
-  idx100 = (((index[2]+1)*dp->mNVal[1] + (index[1]))*dp->mNVal[0] +
-            index[0])*3;
-  idx101 = (((index[2]+1)*dp->mNVal[1] + (index[1]))*dp->mNVal[0] +
-            index[0] + 1)*3;
-  idx110 = (((index[2]+1)*dp->mNVal[1] + (index[1]+1))*dp->mNVal[0] +
-            index[0])*3;
-  idx111 = (((index[2]+1)*dp->mNVal[1] + (index[1]+1))*dp->mNVal[0] +
-            index[0] + 1)*3;
-  //
-  //  Next have to find where in each dimension of the box the coordinate is.
-  //  This produces a set of reduced coords expressed as a fraction of the
-  //  way from the lower to upper point.
-  //
+  idx[1] = idx[0] + 3;
+  idx[2] = idx[0] + sy;
+  idx[3] = idx[2] + 3;
+  idx[4] = idx[0] + sz;
+  idx[5] = idx[4] + 3;
+  idx[6] = idx[4] + sy;
+  idx[7] = idx[6] + 3;
+}
+//
+//  Now we can do the interpolation, with the kernel from CD3Lerp.c that
+//  Prepare picked. Interpolation is linear so the scale can go on at
+//  the end. v holds the corner values in the order idx<z><y><x>.
+//
+static void Lerp3D(const CD3Data* dp, const double v[8][4],
+                   const double rc[3], double* EField)
+{
+  int i;
+  dp->mLerp(v, rc, EField);
   for (i = 0; i < 3; i++) {
-    minc[i] = dp->mMin[i] + index[i] * dp->mDelta[i];
-    rc[i] = (coord[i] - minc[i])/dp->mDelta[i];
-    irc[i] = 1.0 - rc[i];
-#ifdef CD3BoundsCheck
+    EField[i] *= dp->mScale[i];
+  }
+}
+//
+//  Batch3D interpolates the m points of a 3D field listed in which, or
+//  the first m points if which is NULL. It does what Get3DEAtPoint does
+//  but kCD3Lanes points at a time, with the field's four point kernel.
+//  With check set, points outside the field are marked invalid here, as
+//  PtInBounds would.
+//
+//  Scattered points in a big field miss the cache at nearly every cell,
+//  so we take them kCD3Ahead at a time and fetch the corners of all of
+//  them before interpolating any. The loads don't depend on each other,
+//  so their misses overlap.
+//
+static void Batch3D(const CD3Data* dp, size_t m, const size_t* which,
+                    const double* coords, size_t step, size_t plane,
+                    bool check, double* EField, bool* valid)
+{
+  size_t first, i;
+  int c, g, j, k, l, nAhead, nGroup;
+  bool ok[kCD3Ahead];
+  int64_t index[3], idx[kCD3Ahead][8];
+  int64_t top[3];
+  double t, lo[3], hi[3], invDelta[3], scale[3];
+  double rc[kCD3Ahead / kCD3Lanes][3][kCD3Lanes];
+  double v[kCD3Ahead / kCD3Lanes][8][3][kCD3Lanes];
+  double field[kCD3Ahead / kCD3Lanes][3][kCD3Lanes];
+  for (k = 0; k < 3; k++) {
+    lo[k] = dp->mMin[k];
+    hi[k] = dp->mMax[k];
+    invDelta[k] = dp->mInvDelta[k];
+    top[k] = dp->mTop[k];
+    scale[k] = dp->mScale[k];
+  }
+  for (first = 0; first < m; first += nAhead) {
+    nAhead = (m - first < kCD3Ahead) ? (int) (m - first) : kCD3Ahead;
+    nGroup = (nAhead + kCD3Lanes - 1) / kCD3Lanes;
     //
-    //  Put in a tiny amount of slop for rounding error.
+    //  Find the cells. Lanes past the last point are left empty.
     //
-    if ((rc[i] < -0.001) || (rc[i] > 1.001)) {
-      fprintf(stderr, "Get3DEAtPoint: Reduced coord %d, %lf, out of range.\n",
-              i, rc[i]);
-      return false;
+    for (j = 0; j < nGroup * kCD3Lanes; j++) {
+      g = j / kCD3Lanes;
+      l = j % kCD3Lanes;
+      ok[j] = (j < nAhead);
+      i = !ok[j] ? 0 : (which == NULL) ? first + j : which[first + j];
+      for (k = 0; k < 3; k++) {
+        t = ok[j] ? coords[i * step + k * plane] : lo[k];
+        if (check && !((t >= lo[k]) && (t <= hi[k]))) {
+          ok[j] = false;
+        }
+        t = (t - lo[k]) * invDelta[k];
+        index[k] = ok[j] ? (int64_t) t : 0;
+        index[k] = (index[k] > top[k]) ? top[k] : index[k];
+        rc[g][k][l] = ok[j] ? t - index[k] : 0.0;
+      }
+      if (ok[j]) {
+        Corners3D(dp, index, idx[j]);
+      }
+    }
+    //
+    //  Fetch all the corners, then interpolate.
+    //
+    for (j = 0; j < nGroup * kCD3Lanes; j++) {
+      g = j / kCD3Lanes;
+      l = j % kCD3Lanes;
+      if (ok[j]) {
+        ok[j] = GetLanes(dp, idx[j], l, v[g]);
+      }
+      if (!ok[j]) {
+        for (c = 0; c < 8; c++) {
+          for (k = 0; k < 3; k++) {
+            v[g][c][k][l] = 0.0;
+          }
+        }
+      }
+    }
+    for (g = 0; g < nGroup; g++) {
+      dp->mLerp4((const double (*)[3][kCD3Lanes]) v[g],
+                 (const double (*)[kCD3Lanes]) rc[g], field[g]);
+    }
+    for (j = 0; j < nAhead; j++) {
+      g = j / kCD3Lanes;
+      l = j % kCD3Lanes;
+      i = (which == NULL) ? first + j : which[first + j];
+      valid[i] = ok[j];
+      for (k = 0; k < 3; k++) {
+        EField[i * step + k * plane] =
+          ok[j] ? field[g][k][l] * scale[k] : 0.0;
+      }
     }
-#endif
   }
-  //
-  //  Now we can do the interpolation.
-  //  This follows the notation of the Wikipedia page quite closely.
-  //  Since we are doing the whole field we have to do this three
-  //  times.
-  //
-  //  Ex
-  c00 = irc[0]*dp->mField[idx000 + 0] + rc[0]*dp->mField[idx001 + 0];
-  c10 = irc[0]*dp->mField[idx010 + 0] + rc[0]*dp->mField[idx011 + 0];
-  c01 = irc[0]*dp->mField[idx100 + 0] + rc[0]*dp->mField[idx101 + 0];
-  c11 = irc[0]*dp->mField[idx110 + 0] + rc[0]*dp->mField[idx111 + 0];
-  c0 = irc[1] * c00 + rc[1] * c10;
-  c1 = irc[1] * c01 + rc[1] * c11;
-  EField[0] = irc[2] * c0 + rc[2] * c1;
-  //
-  //  Ey
-  //
-  c00 = irc[0]*dp->mField[idx000 + 1] + rc[0]*dp->mField[idx001 + 1];
-  c10 = irc[0]*dp->mField[idx010 + 1] + rc[0]*dp->mField[idx011 + 1];
-  c01 = irc[0]*dp->mField[idx100 + 1] + rc[0]*dp->mField[idx101 + 1];
-  c11 = irc[0]*dp->mField[idx110 + 1] + rc[0]*dp->mField[idx111 + 1];
-  c0 = irc[1] * c00 + rc[1] * c10;
-  c1 = irc[1] * c01 + rc[1] * c11;
-  EField[1] = irc[2] * c0 + rc[2] * c1;
-  //
-  //  Ez
-  //
-  c00 = irc[0]*dp->mField[idx000 + 2] + rc[0]*dp->mField[idx001 + 2];
-  c10 = irc[0]*dp->mField[idx010 + 2] + rc[0]*dp->mField[idx011 + 2];
-  c01 = irc[0]*dp->mField[idx100 + 2] + rc[0]*dp->mField[idx101 + 2];
-  c11 = irc[0]*dp->mField[idx110 + 2] + rc[0]*dp->mField[idx111 + 2];
-  c0 = irc[1] * c00 + rc[1] * c10;
-  c1 = irc[1] * c01 + rc[1] * c11;
-  EField[2] = irc[2] * c0 + rc[2] * c1;
-  //
-  return true;
 }
 
+//
+//  Batch2D is Batch3D for a 2D field, which takes its points one at a
+//  time. Points in AoS order are looked up where they are. GetAxEAtPoint
+//  reads x and y in one load, and copying them out one at a time just
+//  before makes that load wait for the copies to land.
+//
+static void Batch2D(const CD3Data* dp, size_t m, const size_t* which,
+                    const double* coords, size_t step, size_t plane,
+                    bool check, double* EField, bool* valid)
+{
+  size_t i, j;
+  int k;
+  const double* cp;
+  double coord[3], field[3];
+  for (j = 0; j < m; j++) {
+    i = (which == NULL) ? j : which[j];
+    if (step == 3) {
+      cp = coords + 3 * i;
+    } else {
+      for (k = 0; k < 3; k++) {
+        coord[k] = coords[i + k * plane];
+      }
+      cp = coord;
+    }
+    valid[i] = (!check || PtInBounds(dp, cp)) &&
+               GetAxEAtPoint(dp, cp, field);
+    for (k = 0; k < 3; k++) {
+      EField[i * step + k * plane] = valid[i] ? field[k] : 0.0;
+    }
+  }
+}
 //
 //  This treats the field as a defining slice for an axi-symmetric
 //  field and returns fully 3D values from 3D points.
@@ -913,17 +2559,6 @@ bool GetAxEAtPoint(const CD3Data* dp, const double coord[3], double* EField)
   double coord2D[2];
   double field2D[2];
   double sinval = 0.0, cosval = 0.0, r;
-//  double x = coord[0], y = coord[1], z = coord[2];
-  //
-  //  First check against 3D bounds.
-  //
-#ifdef CD3BoundsCheck
-  if (!PtInBounds(dp, coord)) {
-    fprintf(stderr, "GetEAxAtPoint: Coordinate [%lf, %lf, %lf] out of range\n",
-            coord[0], coord[1], coord[2]);
-    return false;
-    }
-#endif
   //
   //  Start by mapping from 3d point to 2D point.
   //
@@ -951,79 +2586,203 @@ bool GetAxEAtPoint(const CD3Data* dp, const double coord[3], double* EField)
 //
 //  This uses 2D coords to index array as 2D.
 //  It does NOT do coordinate checking because it assumes that a higher
-//  level routine has already done that.
+//  level routine has already done that. The one thing that can't be
+//  checked up there is the radius, as the corners of the box around
+//  the field are further from the axis than the data reach.
 //
 bool Get2DEAtPoint(const CD3Data* dp, const double coord[2], double* EField)
 {
-  int index[2], i;
-  double rc[2], irc[2];                 // Reduced coords and inverses
-  double minc[2];                       // Minima of surrounding box
-  int idx00, idx01, idx10, idx11;
+  int64_t index[2], idx[4];             // Corners as idx<z><r>
+  int i;
+  double t[2], rc[2], irc[2];           // Reduced coords and inverses
+  double v[4][4];                       // and their values
   double c0 = coord[0], c1 = coord[1];  // Interpolation steps
   //
-  //  Compute indices and range check. Limits for r are 0 and xMax or yMax,
-  //  those for z are z so I use y and z.
+  //  Compute indices. Limits for r are 0 and xMax or yMax, those for z
+  //  are z so I use y and z.
   //
-  index[0] = (int) (coord[0] / dp->mDelta[1]);
-  index[1] = (int) ((coord[1] - dp->mMin[2]) / dp->mDelta[2]);
+  t[0] = coord[0] * dp->mInvDelta[1];
+  t[1] = (coord[1] - dp->mMin[2]) * dp->mInvDelta[2];
+  if (t[0] > dp->mTop[1] + 1.001) {
+    return false;                       // Radius out of range
+  }
   for (i = 0; i < 2; i++) {
-    if (index[i] == dp->mNVal[i+1]-1) { // Correct if at top edge
-      --index[i];
-    }
-#ifdef CD3BoundsCheck
-    if (index[i] >= dp->mNVal[i+1]) {
-      fprintf(stderr, "Get2DEAtPoint: Index #%d = %d out of range\n",
-              i, index[i]);
-      return false;
-    }
-#endif
+    index[i] = (int64_t) t[i];
+    index[i] = (index[i] > dp->mTop[i+1]) ? dp->mTop[i+1] : index[i];
+    rc[i] = t[i] - index[i];
+    irc[i] = 1.0 - rc[i];
   }
   //
-  //  At this point I have found the indices for the three dimensions. These
-  //  are normallly the indices of the coord BELOW the given coord. Use this
-  //  to compute the array indices (idx's) of the eight points that surround
-  //  the cell containing the coordinate.
-  //  They have form idx<z><y><x>.
-  //  NOTE can't do this before we have all three
-  //  indices.
+  //  The indices are those of the coord BELOW the given coord. Use them
+  //  to compute the array indices (idx's) of the four points that
+  //  surround the cell containing the coordinate, as idx<z><r>.
   //
-  idx00 = ((index[1])*dp->mStride + index[0])*2;
-  idx01 = ((index[1])*dp->mStride + index[0] + 1)*2;
-  idx10 = ((index[1]+1)*dp->mStride + index[0])*2;
-  idx11 = ((index[1]+1)*dp->mStride + index[0] + 1)*2;
+  idx[0] = index[1] * dp->mStep[2] + index[0] * dp->mStep[1];
+  idx[1] = idx[0] + dp->mStep[1];
+  idx[2] = idx[0] + dp->mStep[2];
+  idx[3] = idx[2] + dp->mStep[1];
+  if (!GetCorners(dp, idx, 4, 2, v)) {
+    return false;
+  }
   //
-  //  Next have to find where in each dimension of the box the coordinate is.
-  //  This produces a set of reduced coords expressed as a fraction of the
-  //  way from the lower to upper point.
-  //  Remember that the 2D bounds are NOT the 3D bounds. We use 0->mMax[0|1].
+  //  Now we can do the interpolations.
   //
-  minc[0] = index[0] * dp->mDelta[1];
-  minc[1] = dp->mMin[2] + index[1] * dp->mDelta[2];
-  for (i = 0; i < 2; i++) {
-    rc[i] = (coord[i] - minc[i])/dp->mDelta[i+1];
-    irc[i] = 1.0 - rc[i];
-#ifdef CD3BoundsCheck
+  c0 = irc[0]*v[0][0] + rc[0]*v[1][0];
+  c1 = irc[0]*v[2][0] + rc[0]*v[3][0];
+  EField[0] = (irc[1] * c0 + rc[1] * c1) * dp->mScale[0];
+  c0 = irc[0]*v[0][1] + rc[0]*v[1][1];
+  c1 = irc[0]*v[2][1] + rc[0]*v[3][1];
+  EField[1] = (irc[1] * c0 + rc[1] * c1) * dp->mScale[1];
+  return true;
+
+}
+//
+//  GetCorners fetches the nComp values at each of the nCorner array
+//  indices in idx into v, widening them to double from however they
+//  are stored. Half values come out unscaled. Each corner gets a row of
+//  four so the vector kernels can load it whole, and what nComp leaves
+//  over is zeroed. It only fails if a packed block they need turns out
+//  to be corrupt.
+//
+static bool GetCorners(const CD3Data* dp, const int64_t idx[], int nCorner,
+                       int nComp, double v[][4])
+{
+  int i, j;
+  const float* f32;
+  const uint16_t* f16;
+  //
+  //  The corners span at most two blocks, the first's and the last's.
+  //
+  if ((NULL != dp->mBlocks) &&
+      (!NeedBlock(dp, idx[0]) || !NeedBlock(dp, idx[nCorner - 1]))) {
+    return false;
+  }
+  switch (dp->mValueType) {
+    case kCD3Float:
+      f32 = (const float*) dp->mNarrow;
+      for (i = 0; i < nCorner; i++) {
+        for (j = 0; j < nComp; j++) {
+          v[i][j] = f32[idx[i] + j];
+        }
+      }
+      break;
+
+    case kCD3Half:
+      f16 = (const uint16_t*) dp->mNarrow;
+      for (i = 0; i < nCorner; i++) {
+        for (j = 0; j < nComp; j++) {
+          v[i][j] = HalfToFloat(f16[idx[i] + j]);
+        }
+      }
+      break;
+
+    default:
+      for (i = 0; i < nCorner; i++) {
+        for (j = 0; j < nComp; j++) {
+          v[i][j] = dp->mField[idx[i] + j];
+        }
+      }
+      break;
+  }
+  for (i = 0; i < nCorner; i++) {
+    for (j = nComp; j < 4; j++) {
+      v[i][j] = 0.0;
+    }
+  }
+  return true;
+}
+//
+//  GetLanes is GetCorners for the four point kernels. It puts the three
+//  components of the eight corners at idx in lane lane of v.
+//
+static bool GetLanes(const CD3Data* dp, const int64_t idx[8], int lane,
+                     double v[8][3][kCD3Lanes])
+{
+  int i, j;
+  const float* f32;
+  const uint16_t* f16;
+  if ((NULL != dp->mBlocks) &&
+      (!NeedBlock(dp, idx[0]) || !NeedBlock(dp, idx[7]))) {
+    return false;
+  }
+  switch (dp->mValueType) {
+    case kCD3Float:
+      f32 = (const float*) dp->mNarrow;
+      for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++) {
+          v[i][j][lane] = f32[idx[i] + j];
+        }
+      }
+      break;
+
+    case kCD3Half:
+      f16 = (const uint16_t*) dp->mNarrow;
+      for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++) {
+          v[i][j][lane] = HalfToFloat(f16[idx[i] + j]);
+        }
+      }
+      break;
+
+    default:
+      for (i = 0; i < 8; i++) {
+        for (j = 0; j < 3; j++) {
+          v[i][j][lane] = dp->mField[idx[i] + j];
+        }
+      }
+      break;
+  }
+  return true;
+}
+//
+//  Conversions between double and IEEE half precision. Done by hand
+//  because not every compiler we use knows about halfs. DoubleToHalf
+//  rounds to nearest and saturates to infinity.
+//
+static float HalfToFloat(uint16_t h)
+{
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f;
+  uint32_t mant = h & 0x3ff;
+  uint32_t bits;
+  float f;
+  if (exp == 0) {
     //
-    //  Put in a tiny amount of slop for rounding error.
+    //  Zero or denormal, worth mant * 2^-24.
     //
-    if ((rc[i] < -0.001) || (rc[i] > 1.001)) {
-      fprintf(stderr, "Get2DValueAtPoint:Reduced coord %d, %lf, out of range.\n",
-              i, rc[i]);
-      return false;
-    }
-#endif
+    f = mant * (1.0f / 16777216.0f);
+    return sign ? -f : f;
+  }
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else {
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  }
+  memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+static uint16_t DoubleToHalf(double x)
+{
+  int e;
+  double a = fabs(x);
+  uint16_t sign = signbit(x) ? 0x8000 : 0;
+  if (x != x) {
+    return 0x7e00;
+  }
+  if (a >= 65520.0) {
+    return sign | 0x7c00;
+  }
+  if (a < 6.103515625e-05) {
+    return sign | (uint16_t) rint(a * 16777216.0);
   }
   //
-  //  Now we can do the interpolations.
+  //  a = m * 2^e with m in [0.5, 1). A mantissa that rounds up to 1024
+  //  carries into the exponent, which is just what we want.
   //
-  c0 = irc[0]*dp->mField[idx00] + rc[0]*dp->mField[idx01];
-  c1 = irc[0]*dp->mField[idx10] + rc[0]*dp->mField[idx11];
-  EField[0] = irc[1] * c0 + rc[1] * c1;
-  c0 = irc[0]*dp->mField[idx00+1] + rc[0]*dp->mField[idx01+1];
-  c1 = irc[0]*dp->mField[idx10+1] + rc[0]*dp->mField[idx11+1];
-  EField[1] = irc[1] * c0 + rc[1] * c1;
-  return true;
-
+  a = frexp(a, &e);
+  return sign | (uint16_t) (((e + 14) << 10) +
+                            (int) rint((2.0 * a - 1.0) * 1024.0));
 }
 
 /***********************************************************************
@@ -1169,13 +2928,7 @@ bool CD3Map(const CD3Data* dp, const double coord[3], uint32_t newIndices[3])
 //
 uint64_t CD3IndexAt(const CD3Data* dp, uint32_t ix, uint32_t iy, uint32_t iz)
 {
-  //
-  //  Do this step by step to avoid overflow.
-  //
-  uint64_t index = iz;
-  index = index * dp->mNVal[1] + iy;
-  index = index * dp->mNVal[0] + ix;
-  return index;
+  return PointAt(dp, dp->mLayout, ix, iy, iz);
 }
 
 
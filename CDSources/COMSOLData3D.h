@@ -24,6 +24,10 @@
  *  the z axis only.
  *  BCollett7/29/15 Add some helper methods to clip points to the bounds
  *  of the field and to map indices to coords and vice-versa.
+ *  Fields may also be stored as floats or as halfs with a scale per
+ *  component, halving or quartering the memory a field map needs.
+ *  Binary files may be compressed in independent blocks of z planes that
+ *  are only unpacked when a query first needs them.
  */
 
 #ifndef __COMSOLData3D__
@@ -31,6 +35,7 @@
 
 #include <stdint.h>
 #include "COMSOLData.h"
+#include "CD3Lerp.h"
 
 //
 //  This distinguishes between our internal formats.
@@ -41,15 +46,50 @@ typedef enum CD3TypeTag {
   kCD3Unused,           // Actual data part unused, only bounds valid
   kCD3Error             // Oh Dear!
 } CD3TypeTag;
+//
+//  How the field values themselves are stored. The numbers are the
+//  valueType codes in the file header. Half values are multiplied by
+//  mScale for their component to get the real value.
+//
+typedef enum CD3ValueTag {
+  kCD3Double = 0,       // IEEE double
+  kCD3Float,            // IEEE single
+  kCD3Half              // IEEE half, scaled per component
+} CD3ValueType;
 
 //
 //  Because we understand the structure of this kind of file much
 //  better we can have a streamlined class. For example, we no longer
 //  need to store the coordinate data.
 //
-//  How many sub-fields can we have?
+//  The compressed blocks of a field read from a packed file. Private to
+//  COMSOLData3D.c.
+//
+struct CD3BlocksTag;
+//
+//  A grid over the bounds of a tree of fields that says which field owns
+//  the points in each cell. Private to COMSOLData3D.c.
+//
+struct CD3IndexTag;
 //
-#define kNSub 20
+//  How the points of a 3D field are ordered in mField or mNarrow.
+//  kCD3RowMajor has x fastest, then y, then z. kCD3Brick cuts the grid
+//  into bricks of 4 x 4 x 4 points, padded with zeros out to whole
+//  bricks. The bricks are row major and so are the points inside each
+//  one. The eight corners of most cells then lie in one brick a few
+//  cache lines long rather than in four rows two planes apart.
+//  kCD3Morton orders the points along a Z-order curve, interleaving the
+//  bits of the x, y and z indices, so points close in any direction are
+//  usually close in memory. Each axis is padded with zeros out to a
+//  power of two; once the shorter axes run out of bits the longer ones
+//  carry on alone. The padding can cost up to eight times the memory.
+//  2D fields are always row major.
+//
+typedef enum CD3GridLayoutTag {
+  kCD3RowMajor = 0,
+  kCD3Brick,
+  kCD3Morton
+} CD3GridLayout;
 //
 typedef struct CD3DataTag {
   //
@@ -61,27 +101,154 @@ typedef struct CD3DataTag {
   double mMin[3];                       // and corresponding minima
   double mMax[3];                       // Max values of each coord.
   double mDelta[3];                     // Deltas needed for coord conversion
+  double mInvDelta[3];                  // and their inverses
+  int mTop[3];                          // Last index a cell can start at
+  int64_t mStep[3];                     // Values between row major points
   int mStride;                          // Used only for 2D data.
   int mNSubField;                       // Number of subfields
-  const struct CD3DataTag* mSubField[kNSub];  // Stored here
-  double* mField;                       // Field data
+  const struct CD3DataTag** mSubField;  // Stored here, or NULL
+  double* mField;                       // Field data if stored as double
+  void* mNarrow;                        // or if stored as float or half
+  CD3ValueType mValueType;              // Which of them is in use
+  double mScale[3];                     // Component scales for half values
+  struct CD3BlocksTag* mBlocks;         // Blocks still to unpack, or NULL
+  CD3GridLayout mLayout;                // Order of the points in the field
+  uint64_t* mMorton;                    // Morton bits of each x, y then z
+  struct CD3IndexTag* mIndex;           // Owners of points below, or NULL
   const char* mFieldName;
+  void* mMap;                           // Mapping mField lives in, or NULL
+  size_t mMapLength;                    // and its length
+  CD3LerpFn mLerp;                      // Interpolation kernels, one point
+  CD3Lerp4Fn mLerp4;                    // and four points at a time
 } CD3Data;
 //
+//  If true (the default) CD3ReadBinary maps the field read-only rather
+//  than reading it into memory. Set it false if you need to modify a
+//  field you have loaded.
+//
+extern bool gCD3MapBinary;
+//
 //  Have a second structure that we use as the header for a binary file.
 //  It incorporates extras such as a data offset, space for a filename,
 //  and, of course, a magic number.
 //
+//  Version 1 files have a 512 byte header holding a raw copy of the
+//  CD3Data as laid out by the 64 bit Mac compiler, pointers and all,
+//  and a multi-char magic number in native byte order. CD3DataV1 freezes
+//  that layout so that CD3Data itself is free to change.
+//
 extern uint32_t gCD3Magic;
 //
+typedef struct CD3DataV1Tag {
+  uint32_t mType;
+  uint32_t mNVal[3];
+  double mMin[3];
+  double mMax[3];
+  double mDelta[3];
+  int32_t mStride;
+  int32_t mNSubField;
+  uint64_t mSubField[20];               // Were pointers
+  uint64_t mField;
+  uint64_t mFieldName;
+} CD3DataV1;
+//
 typedef struct CD3HeadTag {
   uint32_t magic;
   uint32_t dataOffset;
   char modelName[64];
   char fileName[64];
-  CD3Data dp;
-  char filler[0];           // On disk will be stored as 256 bytes.
+  CD3DataV1 dp;
+  char filler[0];           // On disk will be stored as 512 bytes.
 } CD3Header;
+//
+//  Version 2 files have a fixed header built only from explicitly sized
+//  fields with no padding, so the layout does not depend on the compiler.
+//    offset size
+//       0     8  magic        the characters "CD3Field"
+//       8     4  endian       0x01020304 in the byte order of the writer
+//      12     4  version      2
+//      16     8  headLength   bytes of header in use (sizeof(CD3HeadV2))
+//      24     8  dataOffset   start of the data, a multiple of 4096
+//      32     8  nValue       number of values in the data
+//      40     4  type         a CD3TypeTag
+//      44     4  nComp        field components per point
+//      48     4  valueType    a CD3ValueType
+//      52     4  layout       a CD3GridLayout
+//      56    24  nVal[3]      points along each dimension
+//      80     8  pointStride  values from one point to the next
+//      88     8  compStride   values from one component to the next
+//      96     8  axStride     mStride of a 2D field
+//     104    72  min[3], max[3], delta[3]
+//     176    64  modelName
+//     240    64  fileName
+//     304    24  scale[3]     multiplier for each component's values
+//     328     4  packing      0 for plain values, 1 for CDPack blocks
+//     332     4  blockPlanes  z planes in each packed block
+//     336     8  nBlock       number of packed blocks
+//     344     8  indexOffset  where the nBlock + 1 block offsets are
+//  A packed file has the block offsets at indexOffset followed by the
+//  blocks themselves. Block i runs from offset i to offset i + 1, both
+//  measured from the start of the file, and unpacks to blockPlanes
+//  planes of nVal[0] * nVal[1] points (fewer for the last block).
+//  In a brick file nValue, the planes and blocks all include the padding
+//  and blockPlanes is a multiple of 4 so blocks hold whole bricks.
+//  Morton files are never packed.
+//  Everything after the header up to dataOffset is zero. A reader finding
+//  the endian marker reversed swaps every field and value as it loads.
+//
+#define kCD3MagicV2 "CD3Field"
+#define kCD3Endian 0x01020304u
+#define kCD3DataAlign 4096
+//
+typedef struct CD3HeadV2Tag {
+  char magic[8];
+  uint32_t endian;
+  uint32_t version;
+  uint64_t headLength;
+  uint64_t dataOffset;
+  uint64_t nValue;
+  uint32_t type;
+  uint32_t nComp;
+  uint32_t valueType;
+  uint32_t layout;
+  uint64_t nVal[3];
+  uint64_t pointStride;
+  uint64_t compStride;
+  int64_t axStride;
+  double min[3];
+  double max[3];
+  double delta[3];
+  char modelName[64];
+  char fileName[64];
+  double scale[3];
+  uint32_t packing;
+  uint32_t blockPlanes;
+  uint64_t nBlock;
+  uint64_t indexOffset;
+} CD3HeadV2;
+//
+//  Version of binary file that CD3WriteBinary and CD3StreamBinary write.
+//  2 by default. Set it to 1 for programs that only know the old format.
+//
+extern int gCD3FileVersion;
+//
+//  How CD3WriteBinary stores a double field. Anything but kCD3Double
+//  needs a version 2 file. CD3StreamBinary always writes doubles.
+//
+extern CD3ValueType gCD3WriteType;
+//
+//  If gCD3Compress is true CD3WriteBinary packs the values in blocks of
+//  gCD3BlockPlanes z planes. CD3ReadBinary leaves the blocks of a packed
+//  file packed until a query touches them unless gCD3LazyBlocks is false.
+//
+extern bool gCD3Compress;
+extern int gCD3BlockPlanes;
+extern bool gCD3LazyBlocks;
+//
+//  The layout CD3WriteBinary stores a 3D field in, whatever the layout
+//  in memory. Anything but kCD3RowMajor needs a version 2 file.
+//
+extern CD3GridLayout gCD3WriteLayout;
 
 #if defined(__cplusplus)
 extern "C" {
@@ -97,6 +264,12 @@ CDError CD3Init(CD3Data* dp, const char* fname);
 //
 CDError CD3InitFEMM(CD3Data* dp, const char* fname);
 //
+//  StreamBinary converts a COMSOL text file straight to a binary file
+//  open for writing on ofp, never holding more than a block of the
+//  field. On return dp describes the field but its mField is NULL.
+//
+CDError CD3StreamBinary(CD3Data* dp, const char* fname, FILE* ofp);
+//
 //  Finish tidies up after us, releasing our storage. Every call of
 //  CD3Init should be balanced by a call to CD3Finish.
 //
@@ -104,6 +277,8 @@ void CD3Finish(CD3Data* dp);
 //
 //  File operations.
 //  CD3ReadBinary fills in the data structure with info from binary file.
+//  The FILE can be closed as soon as it returns. Balance it with a call
+//  of CD3Finish.
 //
 bool CD3ReadBinary(CD3Data* dp, FILE* ifp);
 //
@@ -112,7 +287,44 @@ bool CD3ReadBinary(CD3Data* dp, FILE* ifp);
 //
 bool CD3WriteBinary(CD3Data* dp, FILE* ofp);
 //
+//  Code that works on mField or mNarrow directly must first call
+//  CD3LoadAll to be sure that every block of a packed field is there.
+//  The accessors below look after themselves.
+//
+bool CD3LoadAll(const CD3Data* dp);
+//
+//  CD3SetLayout reorders the points of a 3D field in memory, which
+//  leaves it unpacked and unmapped. Only dp itself changes, not its
+//  subfields. Code that indexes mField itself expects kCD3RowMajor.
+//
+bool CD3SetLayout(CD3Data* dp, CD3GridLayout layout);
+//
+//  CD3PickLerp sets the interpolation kernels of a field from
+//  gCD3LerpKernel. Loading a field does it, so only call it after
+//  changing gCD3LerpKernel. Only dp itself changes, not its subfields.
+//
+void CD3PickLerp(CD3Data* dp);
+//
+//  CD3BuildIndex compiles the tree below dp into a single array and
+//  builds the grid that lets the accessors go straight to the field that
+//  owns a point, rather than search the subfields level by level.
+//  ParseFieldSet calls it once the tree is complete. Call it again if you
+//  change the tree. The fields themselves are not copied, so they must
+//  outlive the index.
+//
+bool CD3BuildIndex(CD3Data* dp);
+//
 //  Accessors.
+//  Once a field or tree of fields is loaded (and indexed, and put in the
+//  layout you want) the accessors below only read it, so any number of
+//  threads may query it at once. They take no locks, keep no state
+//  between calls and print nothing; a point they can't handle just gets
+//  false. The one exception is the first touch of each block of a lazily
+//  unpacked file, which takes a lock while that block is unpacked. Call
+//  CD3LoadAll first to avoid even that. Loading, converting, indexing and
+//  writing fields, and changing the g settings, use globals such as
+//  gFieldFileName and must not overlap with each other or with queries.
+//
 //  First checks whether a point is inside this field.
 //
 bool PtInBounds(const CD3Data* dp, const double coord[3]);
@@ -122,6 +334,23 @@ bool PtInBounds(const CD3Data* dp, const double coord[3]);
 //
 bool CD3GetEAtPoint(const CD3Data* dp, const double coord[3], double* EField);
 //
+//  The batch version looks up n points at once and gives the same
+//  answers as n calls of CD3GetEAtPoint. For a 3D field it overlaps the
+//  cache misses of neighbouring points, which helps a little when the
+//  points are scattered over a big field; otherwise it is a convenience
+//  and about as fast as the calls. With kCD3AoS coords holds x0 y0 z0 x1 ...
+//  and with kCD3SoA all the x values, then all the y, then all the z.
+//  EField gets the fields in the same layout. valid[i] says whether
+//  point i was in a field; if not its field is zero. Returns the number
+//  of points found.
+//
+typedef enum CD3PointLayoutTag {
+  kCD3AoS = 0,          // Points one after another
+  kCD3SoA               // Coordinates one after another
+} CD3PointLayout;
+size_t CD3GetEAtPoints(const CD3Data* dp, size_t n, const double* coords,
+                       CD3PointLayout layout, double* EField, bool* valid);
+//
 //  This can tell you what file the data for a particular point
 //  came from.
 //
@@ -149,7 +378,8 @@ void CD3ClipPt(const CD3Data* dp, const double coord[3], double newCoord[3]);
 bool CD3Map(const CD3Data* dp, const double coord[3], uint32_t newIndices[3]);
 
 //
-//  This translates an index trio into a single index.
+//  This translates an index trio into a single point index, following
+//  the layout of the field.
 //
 uint64_t CD3IndexAt(const CD3Data* dp, uint32_t ix, uint32_t iy, uint32_t iz);
 
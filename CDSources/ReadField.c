@@ -52,6 +52,7 @@ static bool FieldInField(const CD3Data* od, const CD3Data* nd);
 static bool AddField(CD3Data* od, const CD3Data* nd, const char* linBuff);
 static void CheckDir();
 static bool SoftPtInBounds(const CD3Data* dp, const double coord[3]);
+static void UnionBounds(CD3Data* dp);
 //
 //  ParseFieldSet constucts a complete tree of nested fields from a text
 //  description in an open file.
@@ -62,6 +63,7 @@ bool ParseFieldSet(CD3Data* dp, FILE* ifp)
 {
   char linBuff[1028];
   char *verb;
+  char *save;
   for (;;) {
     //
     //  Read in a line.
@@ -74,13 +76,13 @@ bool ParseFieldSet(CD3Data* dp, FILE* ifp)
     //
     //  Extract first word.
     //
-    verb = strtok(linBuff, delims);
+    verb = strtok_r(linBuff, delims, &save);
     //
     // See what we have, if anything.
     //
-    if (verb == NULL) return true;
+    if (verb == NULL) break;
     if (strcmp(verb, "fields") == 0) {
-      char* path = strtok(NULL, delims);
+      char* path = strtok_r(NULL, delims, &save);
       if (strlen(path) > 0) {
         int theErr = chdir(path);
         if (theErr != 0) {
@@ -111,13 +113,13 @@ bool ParseFieldSet(CD3Data* dp, FILE* ifp)
         }
       }
     } else     if (strcmp(verb, "cfield") == 0) {
-      if (!ParseCField(dp, ifp)) {
+      if (!ParseCField(dp, ifp, &save)) {
         eprintf("ParseFieldSet: Failed to find cfield starting at %s\n",
                 linBuff);
         return false;
       }
     } else if (strcmp(verb, "field") == 0) {
-      const char* iname = strtok(NULL, delims);
+      const char* iname = strtok_r(NULL, delims, &save);
       if (!ParseField(dp, iname)) {
         eprintf("ParseFieldSet: Failed to find field starting at %s\n",
                 linBuff);
@@ -129,7 +131,10 @@ bool ParseFieldSet(CD3Data* dp, FILE* ifp)
       return false;
     }
   }
-  return true;
+  //
+  //  Now the tree is complete we can index it.
+  //
+  return CD3BuildIndex(dp);
 }
 //
 //  This is simple. It reads in a terminal field.
@@ -168,22 +173,30 @@ bool ParseField(CD3Data* dp, const char* name)
 //  This is more complex.
 //  It may or may not read in a field itself but then it looks
 //  for child fields and gets them created. The FILE leads to the
-//  text description of the field hierarchy.
+//  text description of the field hierarchy and save to the rest of the
+//  line that started the cfield, as left by strtok_r.
 //
-bool ParseCField(CD3Data* dp, FILE* ifp)
+bool ParseCField(CD3Data* dp, FILE* ifp, char** save)
 {
   char cname[64];
   char linBuff[1028];
   char* verb;
+  char* lineSave;
   const char* ename;
   CD3Data* newData;
   //
   //  If we got a name then we start by reading in that field.
   //  In any case we save name info for end matching.
   //
-  const char* name = strtok(NULL, delims);
+  const char* name = strtok_r(NULL, delims, save);
   if (name == NULL) {
     cname[0] = 0;
+    //
+    //  With no field of our own we are just a box around our daughters.
+    //
+    memset(dp, 0, sizeof(CD3Data));
+    dp->mType = kCD3Unused;
+    dp->mFieldName = "";
   } else {
     strncpy(cname, name, 63);
     if (!ParseField(dp, name)) {
@@ -201,7 +214,7 @@ bool ParseCField(CD3Data* dp, FILE* ifp)
     //
     //  Extract first word.
     //
-    verb = strtok(linBuff, delims);
+    verb = strtok_r(linBuff, delims, &lineSave);
     //
     // See what we have
     //
@@ -214,7 +227,7 @@ bool ParseCField(CD3Data* dp, FILE* ifp)
         eprintf("ParseCField: Failed to get space for new CField.\n");
         return false;
       }
-      if (ParseCField(newData, ifp)) {
+      if (ParseCField(newData, ifp, &lineSave)) {
         if (!AddField(dp, newData, linBuff)) {
           free(newData);
         }
@@ -223,7 +236,7 @@ bool ParseCField(CD3Data* dp, FILE* ifp)
       //
       //  Get the file name.
       //
-      const char* iname = strtok(NULL, delims);
+      const char* iname = strtok_r(NULL, delims, &lineSave);
       if (NULL == iname) {
         eprintf("ParseCField: Could not find name of field file in %s.\n",
                 linBuff);
@@ -243,7 +256,7 @@ bool ParseCField(CD3Data* dp, FILE* ifp)
         }
       }
     }  else if (strcmp(verb, "end") == 0) {
-      ename = strtok(NULL, delims);
+      ename = strtok_r(NULL, delims, &lineSave);
       if (ename == NULL) {
         ename = "";
       }
@@ -259,6 +272,9 @@ bool ParseCField(CD3Data* dp, FILE* ifp)
       return false;
     }
   }
+  if (name == NULL) {
+    UnionBounds(dp);
+  }
   return true;
 }
 //
@@ -270,7 +286,7 @@ bool ParseCField(CD3Data* dp, FILE* ifp)
 bool FieldInField(const CD3Data* od, const CD3Data* nd)
 {
   double coord[3];
-  if (od->mField == NULL) {
+  if ((od->mField == NULL) && (od->mNarrow == NULL)) {
     return true;    // If no containing field then succeed.
   }
   coord[0] = nd->mMin[0];
@@ -289,16 +305,21 @@ bool FieldInField(const CD3Data* od, const CD3Data* nd)
 }
 //
 //  AddField installs a new field (nd) into the next subfield spot in the
-//  the old field (od).
+//  the old field (od), growing the list to make room.
 //
 static bool AddField(CD3Data* od, const CD3Data* nd, const char* linBuff)
 {
+  const CD3Data** subField;
   //
   //  Check that the new field is totally contained inside this one
-  //  and if so install in a free slot.
+  //  and if so install in a new slot.
   //
   if (FieldInField(od, nd)) {
-    if (od->mNSubField < kNSub) {
+    subField = (const CD3Data**) realloc((void*) od->mSubField,
+                                         (od->mNSubField + 1) *
+                                         sizeof(CD3Data*));
+    if (subField != NULL) {
+      od->mSubField = subField;
       od->mSubField[od->mNSubField++] = nd;
     } else {
       eprintf("ParseCField: No room for new field at %s.\n",
@@ -332,6 +353,24 @@ void CheckDir()
     perror ("Couldn't open the directory");
 }
 //
+//  Give a cfield without a field of its own the bounds of its daughters
+//  so that points can be routed through it.
+//
+static void UnionBounds(CD3Data* dp)
+{
+  int i, k;
+  for (i = 0; i < dp->mNSubField; i++) {
+    for (k = 0; k < 3; k++) {
+      if ((i == 0) || (dp->mSubField[i]->mMin[k] < dp->mMin[k])) {
+        dp->mMin[k] = dp->mSubField[i]->mMin[k];
+      }
+      if ((i == 0) || (dp->mSubField[i]->mMax[k] > dp->mMax[k])) {
+        dp->mMax[k] = dp->mSubField[i]->mMax[k];
+      }
+    }
+  }
+}
+//
 //  Slightly soft pt in bounds check.
 //
 bool SoftPtInBounds(const CD3Data* dp, const double coord[3])
@@ -31,7 +31,7 @@
 
 __BEGIN_DECLS
 bool ParseFieldSet(CD3Data* dp, FILE* ifp);
-bool ParseCField(CD3Data* dp, FILE* ifp);
+bool ParseCField(CD3Data* dp, FILE* ifp, char** save);
 bool ParseField(CD3Data* dp, const char* name);
 __END_DECLS
 
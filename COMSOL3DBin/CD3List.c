@@ -20,6 +20,8 @@
 //
 //  The file is compiled into an internal representation (a simple list)
 //  I have forced 2-step construction because reading from a file can fail.
+//  A bounding volume hierarchy over the list lets CD3ListPointIn skip
+//  the geometries that can't hold a point.
 //
 //  Created by Brian Collett on 7/24/15.
 //  Copyright (c) 2015 Brian Collett. All rights reserved.
@@ -47,6 +49,18 @@ static bool BuildICylinder(CD3List* l);
 //  BuildTorus wants eight since it has two radii.
 //
 static bool BuildTorus(CD3List* l);
+//
+//  Most geometries in a leaf of the hierarchy.
+//
+#define kCD3LeafGeoms 4
+//
+//  BuildHierarchy makes the bounding volume hierarchy once the list is
+//  read and Split builds the part of it over geometries first to last.
+//
+static bool BuildHierarchy(CD3List* l);
+static void Split(CD3List* l, int first, int last);
+static bool InBox(const Box3D* b, const Point3D* p, double tol);
+static bool Meets(const Box3D* a, const Box3D* b, double tol);
 
 //
 //  CD3List
@@ -55,15 +69,24 @@ static bool BuildTorus(CD3List* l);
 void CD3ListInit(CD3List* l)
 {
   l->mGList = NULL;
+  l->mGeoms = NULL;
+  l->mNode = NULL;
+  l->mNNode = 0;
+  l->mNGeom = 0;
   l->mLineBuff = (char*) malloc(512*sizeof(char));
   l->mNArg = 0;
 }
 
 void CD3ListFinish(CD3List* l)
 {
-  if (NULL != l->mGList) {
-    free(l->mGList);
+  Geom* g;
+  while (NULL != l->mGList) {
+    g = l->mGList;
+    l->mGList = g->mNext;
+    free(g);
   }
+  free(l->mGeoms);
+  free(l->mNode);
   free(l->mLineBuff);
 }
 
@@ -126,6 +149,10 @@ bool CD3ListReadGeom(CD3List* l, const char* inFilename)
     }
   }
   fclose(ifp);
+  if (!BuildHierarchy(l)) {
+    fprintf(stderr, "Cannot index geometry from %s, checking it all.\n",
+            inFilename);
+  }
   return true;
 }
 
@@ -274,31 +301,224 @@ void CD3ListPrintOn(CD3List* l, FILE* ofp)
 int CD3ListPointIn(CD3List* l, Point3D* p, double tol)
 {
   Geom* g = NULL;
-  int test;
+  CD3GeomNode* np;
+  int test, i, nStack = 0;
+  int stack[64];
+  if (NULL != l->mNode) {
+    //
+    //  Walk down every branch whose box, grown by tol, holds the point.
+    //  The PointIn functions never reach further than that.
+    //
+    stack[nStack++] = 0;
+    while (nStack > 0) {
+      np = &l->mNode[stack[--nStack]];
+      if (!InBox(&np->mBox, p, tol)) {
+        continue;
+      }
+      if (np->mNGeom > 0) {
+        for (i = np->mFirst; i < np->mFirst + np->mNGeom; i++) {
+          if (GeomPointIn(l->mGeoms[i], p, tol)) {
+            return true;
+          }
+        }
+      } else {
+        stack[nStack++] = np->mFirst;
+        stack[nStack++] = (int) (np - l->mNode) + 1;
+      }
+    }
+    return false;
+  }
   for (g = l->mGList; NULL != g; g = g->mNext) {
 //    if ((fabs(p->m[0] - g->mMin.m[0]) <= 0.1) && (fabs(p->m[1] - g->mMin.m[1]) <= 0.1)) {
 //      test = true;
 //    }
-    test = false;
-    switch (g->mId) {
-      case kSD3ICyl:
-        test = ICylinderPointIn(g, p, tol);
-        break;
-
-      case kSD3Torus:
-        test = TorusPointIn(g, p, tol);
-        break;
-        
-      default:
-        fprintf(stderr, "Unsupported geometry type %d.\n", g->mId);
-        break;
-    }
+    test = GeomPointIn(g, p, tol);
     if (test) {   // As soon as we see inside we are done
       return true;
     }
   }
   return false;
 }
+//
+//  CD3ListNear walks the hierarchy the same way CD3ListPointIn does,
+//  but collects every geometry it reaches rather than stopping at the
+//  first that holds a point.
+//
+int CD3ListNear(CD3List* l, const Box3D* b, double tol, Geom** found)
+{
+  Geom* g = NULL;
+  CD3GeomNode* np;
+  int i, nFound = 0, nStack = 0;
+  int stack[64];
+  if (NULL == l->mNode) {
+    for (g = l->mGList; NULL != g; g = g->mNext) {
+      if (Meets(&g->mBounds, b, tol)) {
+        found[nFound++] = g;
+      }
+    }
+    return nFound;
+  }
+  stack[nStack++] = 0;
+  while (nStack > 0) {
+    np = &l->mNode[stack[--nStack]];
+    if (!Meets(&np->mBox, b, tol)) {
+      continue;
+    }
+    if (np->mNGeom > 0) {
+      for (i = np->mFirst; i < np->mFirst + np->mNGeom; i++) {
+        if (Meets(&l->mGeoms[i]->mBounds, b, tol)) {
+          found[nFound++] = l->mGeoms[i];
+        }
+      }
+    } else {
+      stack[nStack++] = np->mFirst;
+      stack[nStack++] = (int) (np - l->mNode) + 1;
+    }
+  }
+  return nFound;
+}
+//
+//  BuildHierarchy puts the geometries into an array and splits it up.
+//  A tree of n leaves has 2n - 1 nodes and we have at most one leaf per
+//  geometry.
+//
+static bool BuildHierarchy(CD3List* l)
+{
+  Geom* g = NULL;
+  int n = 0;
+  free(l->mGeoms);
+  free(l->mNode);
+  l->mGeoms = NULL;
+  l->mNode = NULL;
+  l->mNNode = 0;
+  for (g = l->mGList; NULL != g; g = g->mNext) {
+    n++;
+  }
+  l->mNGeom = n;
+  if (n == 0) {
+    return true;
+  }
+  l->mGeoms = (Geom**) malloc(n * sizeof(Geom*));
+  l->mNode = (CD3GeomNode*) malloc((2 * n - 1) * sizeof(CD3GeomNode));
+  if ((NULL == l->mGeoms) || (NULL == l->mNode)) {
+    free(l->mGeoms);
+    free(l->mNode);
+    l->mGeoms = NULL;
+    l->mNode = NULL;
+    return false;
+  }
+  n = 0;
+  for (g = l->mGList; NULL != g; g = g->mNext) {
+    l->mGeoms[n++] = g;
+  }
+  Split(l, 0, n);
+  return true;
+}
+//
+//  Split makes the node for geometries first up to last. If there are
+//  too many for a leaf they are sorted along the longest side of the
+//  box holding their centres, well enough to put the smaller half in
+//  the first child and the larger in the second.
+//
+static void Split(CD3List* l, int first, int last)
+{
+  int node = l->mNNode++;
+  int i, j, k, axis = 0, mid, lo, hi;
+  double cMin[3], cMax[3], c, pivot;
+  Box3D* box = &l->mNode[node].mBox;
+  Geom* t;
+  *box = l->mGeoms[first]->mBounds;
+  for (k = 0; k < 3; k++) {
+    cMin[k] = cMax[k] = 0.5 * (box->mMin.m[k] + box->mMax.m[k]);
+  }
+  for (i = first + 1; i < last; i++) {
+    for (k = 0; k < 3; k++) {
+      box->mMin.m[k] = fmin(box->mMin.m[k], l->mGeoms[i]->mBounds.mMin.m[k]);
+      box->mMax.m[k] = fmax(box->mMax.m[k], l->mGeoms[i]->mBounds.mMax.m[k]);
+      c = 0.5 * (l->mGeoms[i]->mBounds.mMin.m[k] +
+                 l->mGeoms[i]->mBounds.mMax.m[k]);
+      cMin[k] = fmin(cMin[k], c);
+      cMax[k] = fmax(cMax[k], c);
+    }
+  }
+  if (last - first <= kCD3LeafGeoms) {
+    l->mNode[node].mFirst = first;
+    l->mNode[node].mNGeom = last - first;
+    return;
+  }
+  for (k = 1; k < 3; k++) {
+    if (cMax[k] - cMin[k] > cMax[axis] - cMin[axis]) {
+      axis = k;
+    }
+  }
+  //
+  //  Quickselect the middle centre along axis.
+  //
+  mid = (first + last) / 2;
+  lo = first;
+  hi = last - 1;
+  while (lo < hi) {
+    pivot = 0.5 * (l->mGeoms[mid]->mBounds.mMin.m[axis] +
+                   l->mGeoms[mid]->mBounds.mMax.m[axis]);
+    i = lo;
+    j = hi;
+    while (i <= j) {
+      while (0.5 * (l->mGeoms[i]->mBounds.mMin.m[axis] +
+                    l->mGeoms[i]->mBounds.mMax.m[axis]) < pivot) {
+        i++;
+      }
+      while (0.5 * (l->mGeoms[j]->mBounds.mMin.m[axis] +
+                    l->mGeoms[j]->mBounds.mMax.m[axis]) > pivot) {
+        j--;
+      }
+      if (i <= j) {
+        t = l->mGeoms[i];
+        l->mGeoms[i] = l->mGeoms[j];
+        l->mGeoms[j] = t;
+        i++;
+        j--;
+      }
+    }
+    if (mid <= j) {
+      hi = j;
+    } else if (mid >= i) {
+      lo = i;
+    } else {
+      break;
+    }
+  }
+  l->mNode[node].mNGeom = 0;
+  Split(l, first, mid);
+  l->mNode[node].mFirst = l->mNNode;
+  Split(l, mid, last);
+}
+//
+//  Is p in b grown by tol on every side?
+//
+static bool InBox(const Box3D* b, const Point3D* p, double tol)
+{
+  int k;
+  for (k = 0; k < 3; k++) {
+    if ((p->m[k] < b->mMin.m[k] - tol) || (p->m[k] > b->mMax.m[k] + tol)) {
+      return false;
+    }
+  }
+  return true;
+}
+//
+//  Does the box a, grown by tol on every side, meet the box b?
+//
+static bool Meets(const Box3D* a, const Box3D* b, double tol)
+{
+  int k;
+  for (k = 0; k < 3; k++) {
+    if ((b->mMax.m[k] < a->mMin.m[k] - tol) ||
+        (b->mMin.m[k] > a->mMax.m[k] + tol)) {
+      return false;
+    }
+  }
+  return true;
+}
 /*
  *  Write into a Smoothable.
  *
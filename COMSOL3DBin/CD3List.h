@@ -25,6 +25,10 @@
 //  themselves to a pointArray to the model in which the smoother
 //  asks the list about each point in the array. Replace CD3ListAddTo
 //  by CD3ListPointIn.
+//  Once the file is read a bounding volume hierarchy is built over the
+//  bounding boxes of the geometries, so CD3ListPointIn only has to ask
+//  the geometries whose boxes are near the point, and CD3ListNear can
+//  hand the smoother just those that reach a plane.
 //
 //  Created by Brian Collett on 7/24/15.
 //  Copyright (c) 2015 Brian Collett. All rights reserved.
@@ -38,12 +42,31 @@
 #include "Geometries.h"
 
 
+//
+//  A node of the hierarchy. Its box holds the boxes of all the
+//  geometries below it. A leaf has mNGeom geometries starting at
+//  mGeoms[mFirst]. Otherwise it has two children, the first right
+//  after it in the array and the second at mFirst.
+//
+typedef struct CD3GeomNodeTag {
+  Box3D mBox;
+  int mFirst;
+  int mNGeom;
+} CD3GeomNode;
+
 typedef struct CD3ListTag {
   //
   //  The list of geometries.
   //
   Geom* mGList;
   //
+  //  The hierarchy over them, or NULL if we don't have one.
+  //
+  Geom** mGeoms;
+  CD3GeomNode* mNode;
+  int mNNode;
+  int mNGeom;                           // Geometries in the list
+  //
   //  Temps used for reading.
   //
   char* mLineBuff;
@@ -71,6 +94,12 @@ void CD3ListPrintOn(CD3List* l, FILE* ofp);
 //
 int CD3ListPointIn(CD3List* l, Point3D* p, double tol);
 //
+//  Put into found every geometry whose bounding box, grown by tol,
+//  meets the box b and return how many there were. found must have
+//  room for mNGeom of them. Safe to call from several threads at once.
+//
+int CD3ListNear(CD3List* l, const Box3D* b, double tol, Geom** found);
+//
 //  Write into a Smoothable.
 //
 //bool CD3ListAddGeomTo(CD3List* l, uint8_t* type, CD3Data* d);
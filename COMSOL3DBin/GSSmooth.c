@@ -11,6 +11,27 @@
 //  We now run over the whole array and ask the geometry
 //  list whether each point is inside the geometry (inactive)
 //  or not.
+//  Each colour sweep is split into slabs of z planes, one per thread.
+//  Points of one colour only read points of the other, so the slabs
+//  don't interfere and the result is the same however many threads
+//  share the work.
+//  Each change can be stretched by a relaxation factor omega to make
+//  this successive over-relaxation. Omega of 1 is plain Gauss-Seidel.
+//  MGSmooth uses the same red-black sweeps as the smoother for a
+//  multigrid V-cycle, with the type array halved for each coarser
+//  level. Coarse point i sits on fine point 2 i, so along an axis with
+//  an even number of points the coarse border can't sit on the fine
+//  one. It goes one fine point inside or outside it, whichever is
+//  nearer where the wall of the finest grid really is.
+//  GSSmooth can also fuse several passes into one trip through memory,
+//  which matters once the field is much bigger than the cache.
+//  The type array is boiled down to runs of active points along each
+//  row before we start, so the sweeps never look at inactive points.
+//  The type array itself has just one bit per point, and each geometry
+//  marks whole spans of rows through its bounding box at a time.
+//  The geometry is marked by several threads at once, each taking its
+//  own z planes and asking the list's hierarchy which geometries reach
+//  each one.
 //
 
 #include <stdio.h>
@@ -19,41 +40,298 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <math.h>
+#include <pthread.h>
 #include "assert.h"
 #include "GSSmooth.h"
 #include "CD3List.h"
 #include "Geometries.h"
 
+//
+//  Multigrid settings: the most levels we will make and the smoothing
+//  passes before and after the correction from the level below.
+//
+#define kMGMaxLevel 16
+#define kMGPre 2
+#define kMGPost 2
+//
+//  The most Gauss-Seidel passes we will fuse into one.
+//
+#define kGSMaxFuse 16
+//
+//  A grid to smooth. For Gauss-Seidel there is just the field. For
+//  multigrid the field is the finest level and each level below has
+//  every other point of the one above along each axis and holds a
+//  correction to it, made to satisfy the residual of the one above,
+//  in mF. The active points of row y of plane z run from mRun[2 r] up
+//  to mRun[2 r + 1] for each r from mRowRun[z * mNVal[1] + y] up to
+//  the next row's first.
+//
+typedef struct GSLevelTag {
+  uint32_t mNVal[3];
+  double* mA;                           // The field, or a correction
+  double* mF;                           // NULL on the finest level
+  uint64_t* mType;                      // One bit per point, set if active
+  uint64_t* mRowRun;                    // First run of each row
+  uint32_t* mRun;                       // Start and end of each run
+  int mNSlab;
+  struct GSSlabTag* mSlabs;             // How to share out the work
+} GSLevel;
+//
+//  One thread's share of the work on a level: the z planes from mZ0 up
+//  to mZ1. mErr gets the sum of the squares of the changes it made, or
+//  mPassErr the sum for each pass when passes are fused.
+//
+typedef struct GSSlabTag {
+  GSLevel* mLevel;
+  GSLevel* mOther;                      // Level above or below, if needed
+  double mW[3];                         // Neighbour weights along x, y, z
+  double mOver;                         // omega - 1
+  int mColour;                          // 0 for red, 1 for black
+  uint64_t mZ0;
+  uint64_t mZ1;
+  double mErr;
+  int mNHalf;                           // Half passes to fuse
+  bool mWedge;                          // Doing the wedge below mZ0
+  double mPassErr[kGSMaxFuse];
+} GSSlab;
+//
+//  One thread's share of marking the geometry: the z planes mFirst,
+//  mFirst + mStep and so on.
+//
+typedef struct GSRasterTag {
+  CD3Data* mData;
+  CD3List* mList;
+  uint64_t* mType;
+  double* mCoord[3];                    // Coordinates along each axis
+  double mTol;
+  Geom** mFound;                        // Room for the whole list
+  uint64_t mFirst;
+  uint64_t mStep;
+} GSRaster;
 //
 //  Helpers.
 //
-static uint8_t* NewTypeArray(uint32_t nVal[3]);
-static void SmoothPrintOn(CD3Data* d, uint8_t* type, FILE* ofp);
-static void AddGeometryTo(CD3Data* d, CD3List* l, uint8_t* type);
+static int SetUp(const char* fname, CD3Data* dp, uint64_t** type,
+                 double w[3]);
+static bool InitLevel(GSLevel* lp, const double w[3], double omega,
+                      int width);
+static bool BuildRuns(GSLevel* lp);
+static double BestOmega(const uint32_t nVal[3], const double w[3]);
+static double VCycle(GSLevel* levels, int l, int nLevel);
+static double Sweep(GSLevel* lp, int colour);
+static void Fuse(GSLevel* lp, int nFuse, double passErr[]);
+static void RunSlabs(GSLevel* lp, GSLevel* other, void* (*fn)(void*));
+static void* SweepSlab(void* arg);
+static void* FuseSlab(void* arg);
+static void SweepPlane(const GSSlab* sp, int colour, uint64_t idz,
+                       double* err);
+static void* RestrictSlab(void* arg);
+static void* ProlongSlab(void* arg);
+static uint64_t* NewTypeArray(uint32_t nVal[3]);
+static bool Active(const uint64_t* type, uint64_t i);
+static void ClearRun(uint64_t* type, uint64_t from, uint64_t to);
+static void SmoothPrintOn(CD3Data* d, uint64_t* type, FILE* ofp);
+static bool AddGeometryTo(CD3Data* d, CD3List* l, uint64_t* type);
+static void* RasterPlanes(void* arg);
+static uint64_t CountBelow(const double* x, uint64_t n, double v,
+                           bool orEqual);
 
-int GSSmooth(const char* fname, CD3Data* dp, int nPass)
+int GSSmooth(const char* fname, CD3Data* dp, int nPass, double omega,
+             double tol, int nFuse)
 {
-  int errCode = 0, pass, comp;
-  uint8_t* pointType = NULL;
-  CD3List gList;
-  double err = 0.0;
-  uint64_t idx, idy, idz, index, rIndex;
-  double newVal;
-  double terr, wa, wx, wy, wz;
-  double* a = dp->mField;
+  int errCode = 0, pass, nDo, j;
+  uint64_t* pointType = NULL;
+  GSLevel grid;
+  double passErr[kGSMaxFuse];
+  double w[3];
+  bool done = false;
+  errCode = SetUp(fname, dp, &pointType, w);
+  if (errCode != kCDNoErr) {
+    return errCode;
+  }
+  //
+  //  And run the smooth.
+  //
+  memcpy(grid.mNVal, dp->mNVal, sizeof(grid.mNVal));
+  grid.mA = dp->mField;
+  grid.mF = NULL;
+  grid.mType = pointType;
+  if (omega <= 0.0) {
+    omega = BestOmega(grid.mNVal, w);
+    fprintf(stderr, "Using omega = %lf.\n", omega);
+  }
+  if (nFuse < 1) {
+    nFuse = 1;
+  } else if (nFuse > kGSMaxFuse) {
+    nFuse = kGSMaxFuse;
+  }
+  if (!InitLevel(&grid, w, omega, (nFuse > 1) ? 4 * nFuse : 1)) {
+    fprintf(stderr, "Attempt to get storage for slabs and runs failed.\n");
+    errCode = kCDAllocFailed;
+    goto Finish;
+  }
   /*
-   *  Start by computing offsets for the neighbours. The x neigbours are
-   *  always 1 higher and 1 lower in index but the y neighbours are a
-   *  distance mNVal[0] (the number of possible x values) away while the
-   *  z neighbours are even further.
-   *  These are all multiplied by three because there are 3 components
-   *  per vector.
+   *  Now we do the fancy red-black scanning, red then black on every
+   *  pass, until we run out of passes or the error is small enough.
+   *  Fused passes all get done before we can look at their errors.
    */
-  const uint64_t dx = 3;
-  const uint64_t dy = 3 * dp->mNVal[0];
-  const uint64_t dz = 3 * dp->mNVal[0] * dp->mNVal[1];
+  for (pass = 0; !done && ((nPass <= 0) || (pass < nPass)); pass += nDo) {
+    nDo = nFuse;
+    if ((nPass > 0) && (nDo > nPass - pass)) {
+      nDo = nPass - pass;
+    }
+    if (nDo == 1) {
+      passErr[0] = Sweep(&grid, 0);
+//    SmoothPrintOn(dp, pointType, stdout);
+      passErr[0] += Sweep(&grid, 1);
+    } else {
+      Fuse(&grid, nDo, passErr);
+    }
+    for (j = 0; j < nDo; j++) {
+      fprintf(stderr, "Pass %d error = %lf.\n", pass + j, passErr[j]);
+      done = done || ((tol > 0.0) && (passErr[j] < tol));
+    }
+    if (done) {
+      fprintf(stderr, "Converged after %d passes.\n", pass + nDo);
+    }
+  }
+  SmoothPrintOn(dp, pointType, stdout);
+Finish:
+  free(grid.mSlabs);
+  free(grid.mRowRun);
+  free(grid.mRun);
+  free(pointType);
+  return errCode;
+}
+
+int MGSmooth(const char* fname, CD3Data* dp, int nCycle, double tol)
+{
+  int errCode = 0, cycle, l, k, nLevel = 1;
+  uint64_t* pointType = NULL;
+  GSLevel levels[kMGMaxLevel];
+  GSLevel* fine;
+  GSLevel* coarse;
+  uint64_t ix, iy, iz, nPoint, index;
+  double err = 0.0;
+  double w[3], wall[3];
+  bool small = false;
+  errCode = SetUp(fname, dp, &pointType, w);
+  if (errCode != kCDNoErr) {
+    return errCode;
+  }
+  memset(levels, 0, sizeof(levels));
+  memcpy(levels[0].mNVal, dp->mNVal, sizeof(levels[0].mNVal));
+  for (k = 0; k < 3; k++) {
+    wall[k] = dp->mNVal[k] - 1.0;
+  }
+  levels[0].mA = dp->mField;
+  levels[0].mType = pointType;
+  if (!InitLevel(&levels[0], w, 1.0, 1)) {
+    errCode = kCDAllocFailed;
+    goto Finish;
+  }
+  //
+  //  Halve the grid until it gets too small to be worth it. A coarse
+  //  point is only active if the fine point on top of it is and it is
+  //  not on the border. With n fine points the last coarse point is
+  //  over fine point n - 1 if n is odd. If n is even it is over n - 2 or
+  //  one past the end, whichever is nearer wall, where the border of
+  //  the finest grid is in this level's units. Going inside every time
+  //  pins the correction to zero one point short of the wall, and going
+  //  outside every time lets the wall drift out level by level. Past the
+  //  end it only stands in for the border at zero.
+  //
+  while (nLevel < kMGMaxLevel) {
+    fine = &levels[nLevel - 1];
+    for (k = 0; k < 3; k++) {
+      small = small || (fine->mNVal[k] < 5);
+    }
+    if (small) {
+      break;
+    }
+    coarse = &levels[nLevel++];
+    for (k = 0; k < 3; k++) {
+      wall[k] *= 0.5;
+      coarse->mNVal[k] = (fine->mNVal[k] + 1) / 2;
+      if ((fine->mNVal[k] % 2 == 0) &&
+          (wall[k] >= coarse->mNVal[k] - 0.5)) {
+        coarse->mNVal[k]++;             // Past the end is nearer
+      }
+    }
+    nPoint = (uint64_t) coarse->mNVal[0] * coarse->mNVal[1] *
+             coarse->mNVal[2];
+    coarse->mA = (double*) calloc(3 * nPoint, sizeof(double));
+    coarse->mF = (double*) calloc(3 * nPoint, sizeof(double));
+    coarse->mType = NewTypeArray(coarse->mNVal);
+    if ((NULL == coarse->mA) || (NULL == coarse->mF) ||
+        (NULL == coarse->mType)) {
+      errCode = kCDAllocFailed;
+      goto Finish;
+    }
+    for (iz = 0; iz < coarse->mNVal[2]; iz++) {
+      for (iy = 0; iy < coarse->mNVal[1]; iy++) {
+        for (ix = 0; ix < coarse->mNVal[0]; ix++) {
+          if ((2 * ix >= fine->mNVal[0]) || (2 * iy >= fine->mNVal[1]) ||
+              (2 * iz >= fine->mNVal[2]) ||
+              !Active(fine->mType, (2 * iz * fine->mNVal[1] + 2 * iy) *
+                                   fine->mNVal[0] + 2 * ix)) {
+            index = (iz * coarse->mNVal[1] + iy) * coarse->mNVal[0] + ix;
+            ClearRun(coarse->mType, index, index + 1);
+          }
+        }
+      }
+    }
+    if (!InitLevel(coarse, w, 1.0, 1)) {
+      errCode = kCDAllocFailed;
+      goto Finish;
+    }
+  }
+  //
+  //  The coarsest level gets over-relaxed.
+  //
+  for (k = 0; k < levels[nLevel - 1].mNSlab; k++) {
+    levels[nLevel - 1].mSlabs[k].mOver =
+      BestOmega(levels[nLevel - 1].mNVal, w) - 1.0;
+  }
+  fprintf(stderr, "Using %d levels.\n", nLevel);
+  for (cycle = 0; (nCycle <= 0) || (cycle < nCycle); cycle++) {
+    err = VCycle(levels, 0, nLevel);
+    fprintf(stderr, "Cycle %d error = %lf.\n", cycle, err);
+    if ((tol > 0.0) && (err < tol)) {
+      fprintf(stderr, "Converged after %d cycles.\n", cycle + 1);
+      break;
+    }
+  }
+  SmoothPrintOn(dp, pointType, stdout);
+Finish:
+  if (errCode == kCDAllocFailed) {
+    fprintf(stderr, "Attempt to get storage for multigrid level %d failed.\n",
+            nLevel - 1);
+  }
+  for (l = 0; l < nLevel; l++) {
+    free(levels[l].mSlabs);
+    free(levels[l].mType);
+    free(levels[l].mRowRun);
+    free(levels[l].mRun);
+    if (l > 0) {                        // The field is the caller's
+      free(levels[l].mA);
+      free(levels[l].mF);
+    }
+  }
+  return errCode;
+}
+//
+//  SetUp checks that dp can be smoothed, builds its type array from the
+//  geometry in fname and works out the neighbour weights.
+//
+static int SetUp(const char* fname, CD3Data* dp, uint64_t** type,
+                 double w[3])
+{
+  uint64_t* pointType = NULL;
+  CD3List gList;
+  double wa;
   assert(NULL != dp);
-  assert(NULL != a);
+  assert(NULL != dp->mField);
   //
   //  First make sure that we have a 3D leaf array.
   //
@@ -83,144 +361,559 @@ int GSSmooth(const char* fname, CD3Data* dp, int nPass)
   //
   CD3ListInit(&gList);
   if (CD3ListReadGeom(&gList, fname)) {
-    AddGeometryTo(dp, &gList, pointType);
+    if (!AddGeometryTo(dp, &gList, pointType)) {
+      fprintf(stderr, "Attempt to get storage for coordinates failed.\n");
+      CD3ListFinish(&gList);
+      free(pointType);
+      return kCDAllocFailed;
+    }
   } else {
     fprintf(stderr, "Cannot read geometry from file %s.\n", fname);
+    CD3ListFinish(&gList);
+    free(pointType);
     return kCDBadGeom;
   }
+  CD3ListFinish(&gList);
 //  SmoothPrintOn(dp, pointType, stdout);
-  //
-  //  And run the smooth.
-  //
   /*
-   *  Weightings to compensate for non-isotropic grid.
+   *  Weightings to compensate for non-isotropic grid. They add up to
+   *  one, so they don't change when the grid spacing doubles.
    */
   wa = 1.0 / (1.0/(dp->mDelta[0]*dp->mDelta[0]) +
                     1.0/(dp->mDelta[1]*dp->mDelta[1]) +
                     1.0/(dp->mDelta[2]*dp->mDelta[2]));
-  wx = wa / (2.0 *dp->mDelta[0]*dp->mDelta[0]);
-  wy = wa / (2.0 *dp->mDelta[1]*dp->mDelta[1]);
-  wz = wa / (2.0 *dp->mDelta[2]*dp->mDelta[2]);
+  w[0] = wa / (2.0 *dp->mDelta[0]*dp->mDelta[0]);
+  w[1] = wa / (2.0 *dp->mDelta[1]*dp->mDelta[1]);
+  w[2] = wa / (2.0 *dp->mDelta[2]*dp->mDelta[2]);
+  *type = pointType;
+  return kCDNoErr;
+}
+//
+//  InitLevel shares the z planes of a level out as evenly as we can,
+//  one slab per thread, but with at least width planes in each slab,
+//  and finds the runs of active points.
+//
+static bool InitLevel(GSLevel* lp, const double w[3], double omega,
+                      int width)
+{
+  int c;
+  lp->mSlabs = NULL;
+  if (!BuildRuns(lp)) {
+    return false;
+  }
+  lp->mNSlab = CDNThread();
+  if (lp->mNSlab > (int) lp->mNVal[2] / width) {
+    lp->mNSlab = lp->mNVal[2] / width;
+  }
+  if (lp->mNSlab < 1) {
+    lp->mNSlab = 1;
+  }
+  lp->mSlabs = (GSSlab*) malloc(lp->mNSlab * sizeof(GSSlab));
+  if (NULL == lp->mSlabs) {
+    return false;
+  }
+  for (c = 0; c < lp->mNSlab; c++) {
+    lp->mSlabs[c].mLevel = lp;
+    lp->mSlabs[c].mOther = NULL;
+    memcpy(lp->mSlabs[c].mW, w, sizeof(lp->mSlabs[c].mW));
+    lp->mSlabs[c].mOver = omega - 1.0;
+    lp->mSlabs[c].mZ0 = (uint64_t) lp->mNVal[2] * c / lp->mNSlab;
+    lp->mSlabs[c].mZ1 = (uint64_t) lp->mNVal[2] * (c + 1) / lp->mNSlab;
+  }
+  return true;
+}
+//
+//  BuildRuns finds the runs of active points along each row of a level,
+//  counting them first so we know how much room they need.
+//
+static bool BuildRuns(GSLevel* lp)
+{
+  uint64_t row, nRow, nRun = 0, x;
+  bool active, wasActive;
+  int fill;
+  nRow = (uint64_t) lp->mNVal[2] * lp->mNVal[1];
+  lp->mRun = NULL;
+  lp->mRowRun = (uint64_t*) malloc((nRow + 1) * sizeof(uint64_t));
+  if (NULL == lp->mRowRun) {
+    return false;
+  }
+  for (fill = 0; fill < 2; fill++) {
+    nRun = 0;
+    for (row = 0; row < nRow; row++) {
+      lp->mRowRun[row] = nRun;
+      wasActive = false;
+      for (x = 0; x < lp->mNVal[0]; x++) {
+        active = Active(lp->mType, row * lp->mNVal[0] + x);
+        if (active && !wasActive) {
+          if (fill) {
+            lp->mRun[2 * nRun] = (uint32_t) x;
+          }
+        } else if (!active && wasActive) {
+          if (fill) {
+            lp->mRun[2 * nRun + 1] = (uint32_t) x;
+          }
+          nRun++;
+        }
+        wasActive = active;
+      }
+      if (wasActive) {
+        if (fill) {
+          lp->mRun[2 * nRun + 1] = lp->mNVal[0];
+        }
+        nRun++;
+      }
+    }
+    lp->mRowRun[nRow] = nRun;
+    if (fill == 0) {
+      lp->mRun = (uint32_t*) malloc((2 * nRun + 1) * sizeof(uint32_t));
+      if (NULL == lp->mRun) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+//
+//  BestOmega estimates the best relaxation factor for the grid from
+//  the largest eigenvalue of the Jacobi iteration for the box with
+//  fixed faces, rho = sum of 2 w cos(pi / (n - 1)) over the axes, as
+//  omega = 2 / (1 + sqrt(1 - rho^2)). Electrodes inside the box only
+//  make the regions smaller, which wants a smaller omega, but a
+//  little too much omega costs less than too little.
+//
+static double BestOmega(const uint32_t nVal[3], const double w[3])
+{
+  int k;
+  double rho = 0.0;
+  for (k = 0; k < 3; k++) {
+    if (nVal[k] > 2) {
+      rho += 2.0 * w[k] * cos(M_PI / (nVal[k] - 1));
+    }
+  }
+  if (rho >= 1.0) {
+    return 1.0;
+  }
+  return 2.0 / (1.0 + sqrt(1.0 - rho * rho));
+}
+//
+//  VCycle smooths level l, hands what is left of its residual down to
+//  the level below to correct, adds the correction back and smooths
+//  again. It returns the error of the last pass on level l. The
+//  coarsest level is just smoothed a couple of times per point along
+//  its longest side.
+//
+static double VCycle(GSLevel* levels, int l, int nLevel)
+{
+  GSLevel* lp = &levels[l];
+  double err = 0.0;
+  int pass, nPass;
+  if (l == nLevel - 1) {
+    nPass = 2 * lp->mNVal[0];
+    if (nPass < 2 * (int) lp->mNVal[1]) {
+      nPass = 2 * lp->mNVal[1];
+    }
+    if (nPass < 2 * (int) lp->mNVal[2]) {
+      nPass = 2 * lp->mNVal[2];
+    }
+    for (pass = 0; pass < nPass; pass++) {
+      err = Sweep(lp, 0);
+      err += Sweep(lp, 1);
+    }
+    return err;
+  }
+  for (pass = 0; pass < kMGPre; pass++) {
+    Sweep(lp, 0);
+    Sweep(lp, 1);
+  }
+  RunSlabs(&levels[l + 1], lp, RestrictSlab);
+  memset(levels[l + 1].mA, 0, 3 * sizeof(double) * levels[l + 1].mNVal[0] *
+         levels[l + 1].mNVal[1] * levels[l + 1].mNVal[2]);
+  VCycle(levels, l + 1, nLevel);
+  RunSlabs(lp, &levels[l + 1], ProlongSlab);
+  for (pass = 0; pass < kMGPost; pass++) {
+    err = Sweep(lp, 0);
+    err += Sweep(lp, 1);
+  }
+  return err;
+}
+//
+//  Sweep does one colour over the whole level and returns the total of
+//  the squared changes.
+//
+static double Sweep(GSLevel* lp, int colour)
+{
+  double err = 0.0;
+  int c;
+  for (c = 0; c < lp->mNSlab; c++) {
+    lp->mSlabs[c].mColour = colour;
+  }
+  RunSlabs(lp, NULL, SweepSlab);
+  for (c = 0; c < lp->mNSlab; c++) {
+    err += lp->mSlabs[c].mErr;
+  }
+  return err;
+}
+//
+//  Fuse does nFuse passes over the whole level and puts the error of
+//  each in passErr. Each slab does what it can on its own first and
+//  then the wedges between them get filled in.
+//
+static void Fuse(GSLevel* lp, int nFuse, double passErr[])
+{
+  int c, j;
+  for (j = 0; j < nFuse; j++) {
+    passErr[j] = 0.0;
+  }
+  for (c = 0; c < lp->mNSlab; c++) {
+    lp->mSlabs[c].mNHalf = 2 * nFuse;
+    lp->mSlabs[c].mWedge = false;
+  }
+  RunSlabs(lp, NULL, FuseSlab);
+  for (c = 0; c < lp->mNSlab; c++) {
+    for (j = 0; j < nFuse; j++) {
+      passErr[j] += lp->mSlabs[c].mPassErr[j];
+    }
+    lp->mSlabs[c].mWedge = true;
+  }
+  RunSlabs(lp, NULL, FuseSlab);
+  for (c = 0; c < lp->mNSlab; c++) {
+    for (j = 0; j < nFuse; j++) {
+      passErr[j] += lp->mSlabs[c].mPassErr[j];
+    }
+  }
+}
+//
+//  RunSlabs runs fn on each slab of a level, a slab per thread. If we
+//  can't get a thread we just do that slab ourselves.
+//
+static void RunSlabs(GSLevel* lp, GSLevel* other, void* (*fn)(void*))
+{
+  GSSlab* slabs = lp->mSlabs;
+  int nSlab = lp->mNSlab;
+  pthread_t* threads;
+  bool* started;
+  int c;
+  for (c = 0; c < nSlab; c++) {
+    slabs[c].mOther = other;
+  }
+  threads = (pthread_t*) malloc(nSlab * sizeof(pthread_t));
+  started = (bool*) malloc(nSlab * sizeof(bool));
+  if ((NULL == threads) || (NULL == started) || (nSlab == 1)) {
+    for (c = 0; c < nSlab; c++) {
+      fn(&slabs[c]);
+    }
+  } else {
+    for (c = 0; c < nSlab; c++) {
+      started[c] = (pthread_create(&threads[c], NULL, fn, &slabs[c]) == 0);
+      if (!started[c]) {
+        fn(&slabs[c]);
+      }
+    }
+    for (c = 0; c < nSlab; c++) {
+      if (started[c]) {
+        pthread_join(threads[c], NULL);
+      }
+    }
+  }
+  free(threads);
+  free(started);
+}
+//
+//  SweepSlab updates the points of one colour in one slab.
+//
+static void* SweepSlab(void* arg)
+{
+  GSSlab* sp = (GSSlab*) arg;
+  uint64_t idz;
+  double err = 0.0;
+  for (idz = sp->mZ0; idz < sp->mZ1; idz ++) {
+    SweepPlane(sp, sp->mColour, idz, &err);
+  }
+  sp->mErr = err;
+  return NULL;
+}
+//
+//  FuseSlab does mNHalf half passes, red then black, over a slab in a
+//  single trip through memory. At step t half pass h does plane t - h,
+//  so each half pass trails the one before by a plane and finds what it
+//  needs still in the cache. Where the slab meets another each half pass
+//  has to stop a plane short of the one before, as the planes beyond
+//  aren't ready yet. The wedges this leaves are filled in afterwards,
+//  with mWedge set, working outwards from each join the same way.
+//
+static void* FuseSlab(void* arg)
+{
+  GSSlab* sp = (GSSlab*) arg;
+  int64_t nz = sp->mLevel->mNVal[2];
+  int64_t t, z, lo, hi, loSlope, hiSlope;
+  int h;
+  for (h = 0; h < sp->mNHalf / 2; h++) {
+    sp->mPassErr[h] = 0.0;
+  }
+  if (sp->mWedge) {
+    if (sp->mZ0 == 0) {
+      return NULL;
+    }
+    lo = hi = sp->mZ0;
+    loSlope = -1;
+    hiSlope = 1;
+  } else {
+    lo = sp->mZ0;
+    hi = sp->mZ1;
+    loSlope = (lo > 0) ? 1 : 0;
+    hiSlope = (hi < nz) ? -1 : 0;
+  }
+  for (t = lo - sp->mNHalf; t < hi + 2 * sp->mNHalf; t++) {
+    for (h = 0; h < sp->mNHalf; h++) {
+      z = t - h;
+      if ((z >= 0) && (z < nz) &&
+          (z >= lo + loSlope * h) && (z < hi + hiSlope * h)) {
+        SweepPlane(sp, h & 1, z, &sp->mPassErr[h / 2]);
+      }
+    }
+  }
+  return NULL;
+}
+//
+//  SweepPlane updates the points of one colour in plane idz and adds
+//  the squares of the changes to err.
+//  This is made a little more complex because we have to
+//  do all three components at each point. The error is the
+//  Gauss-Seidel change, before over-relaxation, so that it
+//  means the same whatever omega is.
+//
+static void SweepPlane(const GSSlab* sp, int colour, uint64_t idz,
+                       double* err)
+{
+  const GSLevel* lp = sp->mLevel;
+  double* a = lp->mA;
+  const double* f = lp->mF;
+  double newVal, terr;
+  double wx = sp->mW[0], wy = sp->mW[1], wz = sp->mW[2];
+  double over = sp->mOver;
+  uint64_t idx, idy, index, run, row, end;
+  int comp;
   /*
-   *  Now we do the fancy red-black scanning.
-   *  This is made a little more complex because we have to
-   *  do all three components at each point.
+   *  Start by computing offsets for the neighbours. The x neigbours are
+   *  always 1 higher and 1 lower in index but the y neighbours are a
+   *  distance mNVal[0] (the number of possible x values) away while the
+   *  z neighbours are even further.
+   *  These are all multiplied by three because there are 3 components
+   *  per vector.
    */
-  for (pass = 0; pass < nPass; pass++) {
-    err = 0.0;
-    for (idz = 0; idz < dp->mNVal[2]; idz ++) {  // Red
-      for (idy = 0; idy < dp->mNVal[1]; idy ++) {  // Red
-        for (idx = ((idy + idz) & 1); idx < dp->mNVal[0]; idx += 2) {  // Red
-          index = idz * dz + idy * dy + idx*dx;
-          rIndex = index / 3;
-          switch (pointType[rIndex]) {
-            case 0:
-              break;
-
-            case 1:
-              for (comp = 0; comp < 3; comp++) {
-                newVal = wx*(a[index+dx+comp]+a[index-dx+comp])+
-                wy*(a[index+dy+comp]+a[index-dy+comp])+
-                wz*(a[index+dz+comp]+a[index-dz+comp]);
-                terr = newVal - a[index+comp];
-                err += terr * terr;
-                //              fprintf(gDebugFile, "V[%lld]=%6.3lf -> %6.3lf\n", index, mData[index], newVal);
-                a[index+comp] = newVal;
+  const uint64_t dx = 3;
+  const uint64_t dy = 3 * (uint64_t) lp->mNVal[0];
+  const uint64_t dz = 3 * (uint64_t) lp->mNVal[0] * lp->mNVal[1];
+  for (idy = 0; idy < lp->mNVal[1]; idy ++) {
+    row = idz * lp->mNVal[1] + idy;
+    for (run = lp->mRowRun[row]; run < lp->mRowRun[row + 1]; run++) {
+      idx = lp->mRun[2 * run];
+      idx += (idx + idy + idz + colour) & 1;
+      end = lp->mRun[2 * run + 1];
+      for (index = idz * dz + idy * dy + idx*dx; idx < end;
+           idx += 2, index += 2 * dx) {
+        for (comp = 0; comp < 3; comp++) {
+          newVal = wx*(a[index+dx+comp]+a[index-dx+comp])+
+          wy*(a[index+dy+comp]+a[index-dy+comp])+
+          wz*(a[index+dz+comp]+a[index-dz+comp]);
+          if (NULL != f) {
+            newVal += f[index+comp];
+          }
+          terr = newVal - a[index+comp];
+          *err += terr * terr;
+          //              fprintf(gDebugFile, "V[%lld]=%6.3lf -> %6.3lf\n", index, mData[index], newVal);
+          a[index+comp] = newVal + over * terr;
+        }
+      }
+    }
+  }
+}
+//
+//  RestrictSlab works out mF for the active points of a slab of the
+//  coarse level from the residual of the fine level above, mOther.
+//  Each coarse point gets the full weighted average of the residuals
+//  at the 27 fine points around it, times four because the coarse grid
+//  is twice as wide and the weights don't know that.
+//
+static void* RestrictSlab(void* arg)
+{
+  GSSlab* sp = (GSSlab*) arg;
+  const GSLevel* cp = sp->mLevel;
+  const GSLevel* fp = sp->mOther;
+  const double* a = fp->mA;
+  double* f = cp->mF;
+  double wx = sp->mW[0], wy = sp->mW[1], wz = sp->mW[2];
+  double sum[3], r, wt;
+  uint64_t idx, idy, idz, index, cIndex, run, row;
+  int i, j, k, comp;
+  const uint64_t dx = 3;
+  const uint64_t dy = 3 * (uint64_t) fp->mNVal[0];
+  const uint64_t dz = 3 * (uint64_t) fp->mNVal[0] * fp->mNVal[1];
+  for (idz = sp->mZ0; idz < sp->mZ1; idz++) {
+    for (idy = 0; idy < cp->mNVal[1]; idy++) {
+      row = idz * cp->mNVal[1] + idy;
+      for (run = cp->mRowRun[row]; run < cp->mRowRun[row + 1]; run++) {
+        for (idx = cp->mRun[2 * run]; idx < cp->mRun[2 * run + 1]; idx++) {
+          cIndex = row * cp->mNVal[0] + idx;
+          sum[0] = sum[1] = sum[2] = 0.0;
+          for (k = -1; k <= 1; k++) {
+            for (j = -1; j <= 1; j++) {
+              for (i = -1; i <= 1; i++) {
+                index = (2 * idz + k) * dz + (2 * idy + j) * dy +
+                        (2 * idx + i) * dx;
+                if (!Active(fp->mType, index / 3)) {
+                  continue;
+                }
+                wt = ((k == 0) ? 0.5 : 0.25) * ((j == 0) ? 0.5 : 0.25) *
+                     ((i == 0) ? 0.5 : 0.25);
+                for (comp = 0; comp < 3; comp++) {
+                  r = wx*(a[index+dx+comp]+a[index-dx+comp])+
+                      wy*(a[index+dy+comp]+a[index-dy+comp])+
+                      wz*(a[index+dz+comp]+a[index-dz+comp]) -
+                      a[index+comp];
+                  if (NULL != fp->mF) {
+                    r += fp->mF[index+comp];
+                  }
+                  sum[comp] += wt * r;
+                }
               }
-              break;
-
-            default:
-              fprintf(stderr, "Unknown element type at index %" PRIu64 ".\n", idx);
+            }
+          }
+          for (comp = 0; comp < 3; comp++) {
+            f[3 * cIndex + comp] = 4.0 * sum[comp];
           }
         }
       }
     }
-//    SmoothPrintOn(dp, pointType, stdout);
-    for (idz = 0; idz < dp->mNVal[2]; idz ++) {  // Black
-      for (idy = 0; idy < dp->mNVal[1]; idy ++) {  // Black
-        for (idx = ((idy + idz + 1) & 1); idx < dp->mNVal[0]; idx += 2) {  // Black
-          index = idz * dz + idy * dy + idx*dx;
-          rIndex = index / 3;
-          switch (pointType[rIndex]) {
-            case 0:
-              break;
-
-            case 1:
-              for (comp = 0; comp < 3; comp++) {
-                newVal = wx*(a[index+dx+comp]+a[index-dx+comp])+
-                wy*(a[index+dy+comp]+a[index-dy+comp])+
-                wz*(a[index+dz+comp]+a[index-dz+comp]);
-                terr = newVal - a[index+comp];
-                err += terr * terr;
-                //              fprintf(gDebugFile, "V[%lld]=%6.3lf -> %6.3lf\n", index, mData[index], newVal);
-                a[index+comp] = newVal;
+  }
+  return NULL;
+}
+//
+//  ProlongSlab adds the correction from the coarse level below, mOther,
+//  to the active points of a slab of the fine level, interpolating
+//  linearly between coarse points along each axis.
+//
+static void* ProlongSlab(void* arg)
+{
+  GSSlab* sp = (GSSlab*) arg;
+  const GSLevel* fp = sp->mLevel;
+  const GSLevel* cp = sp->mOther;
+  const double* e = cp->mA;
+  double* a = fp->mA;
+  double wt;
+  uint64_t idx, idy, idz, index, cIndex, run, row;
+  uint64_t i, j, k;
+  int comp;
+  for (idz = sp->mZ0; idz < sp->mZ1; idz++) {
+    for (idy = 0; idy < fp->mNVal[1]; idy++) {
+      row = idz * fp->mNVal[1] + idy;
+      for (run = fp->mRowRun[row]; run < fp->mRowRun[row + 1]; run++) {
+        for (idx = fp->mRun[2 * run]; idx < fp->mRun[2 * run + 1]; idx++) {
+          index = row * fp->mNVal[0] + idx;
+          wt = ((idz & 1) ? 0.5 : 1.0) * ((idy & 1) ? 0.5 : 1.0) *
+               ((idx & 1) ? 0.5 : 1.0);
+          for (k = idz / 2; k <= (idz + 1) / 2; k++) {
+            for (j = idy / 2; j <= (idy + 1) / 2; j++) {
+              for (i = idx / 2; i <= (idx + 1) / 2; i++) {
+                cIndex = (k * cp->mNVal[1] + j) * cp->mNVal[0] + i;
+                for (comp = 0; comp < 3; comp++) {
+                  a[3 * index + comp] += wt * e[3 * cIndex + comp];
+                }
               }
-              break;
-
-            default:
-              fprintf(stderr, "Unknown element type at index %" PRIu64 ".\n", idx);
+            }
           }
         }
       }
     }
-    fprintf(stderr, "Pass %d error = %lf.\n", pass, err);
   }
-  SmoothPrintOn(dp, pointType, stdout);
-  return errCode;
+  return NULL;
 }
 /*
  *  Create a new type array with its guts set to active and its border
  *  to inactive.
  */
-uint8_t* NewTypeArray(uint32_t nVal[3]) {
-  uint8_t* pointType = NULL;
-  uint64_t arraySize;
-  uint32_t ix, iy, iz;
-  uint32_t ixMax, iyMax, izMax;
+uint64_t* NewTypeArray(uint32_t nVal[3]) {
+  uint64_t* pointType = NULL;
+  uint64_t arraySize, plane, row;
+  uint32_t iy, iz;
+  uint32_t iyMax, izMax;
   assert(NULL != nVal);
   //
-  //  Now get space for the point type array.
+  //  Now get space for the point type array, a bit per point.
   //  Build size a bit at a time to avoid overflow.
   //
   arraySize = nVal[0];
   arraySize *= nVal[1];
+  plane = arraySize;
   arraySize *= nVal[2];
-  pointType = (uint8_t*) malloc(arraySize * sizeof(uint8_t));
+  pointType = (uint64_t*) malloc(((arraySize + 63) / 64) * sizeof(uint64_t));
   if (NULL == pointType) {
     return NULL;
 
   }
-  ixMax = nVal[0]-1;
   iyMax = nVal[1]-1;
   izMax = nVal[2]-1;
   /*
    *  Set the guts to active and the border to inactive.
    */
-  memset(pointType, 1, arraySize);
-  for (iy = 0; iy <= iyMax; iy++) {     // Mark z ends inactive
-    for (ix = 0; ix <= ixMax; ix++) {
-      pointType[(izMax * nVal[1] + iy)*nVal[0]+ix] = 0;
-      pointType[(0 * nVal[1] + iy)*nVal[0]+ix] = 0;
-    }
-  }
-  for (iz = 0; iz <= izMax; iz++) {     // Mark y ends inactive
-    for (ix = 0; ix <= ixMax; ix++) {
-      pointType[(iz * nVal[1] + 0)*nVal[0]+ix] = 0;
-      pointType[(iz * nVal[1] + iyMax)*nVal[0]+ix] = 0;
-    }
+  memset(pointType, 0xff, ((arraySize + 63) / 64) * sizeof(uint64_t));
+  ClearRun(pointType, 0, plane);                  // Mark z ends inactive
+  ClearRun(pointType, izMax * plane, arraySize);
+  for (iz = 0; iz <= izMax; iz++) {               // Mark y ends inactive
+    ClearRun(pointType, iz * plane, iz * plane + nVal[0]);
+    ClearRun(pointType, iz * plane + iyMax * nVal[0], (iz + 1) * plane);
   }
-  for (iz = 0; iz <= izMax; iz++) {     // Mark x ends inactive
+  for (iz = 0; iz <= izMax; iz++) {               // Mark x ends inactive
     for (iy = 0; iy <= iyMax; iy++) {
-      pointType[(iz * nVal[1] + iy)*nVal[0]+0] = 0;
-      pointType[(iz * nVal[1] + iy)*nVal[0]+ixMax] = 0;
+      row = iz * plane + iy * nVal[0];
+      ClearRun(pointType, row, row + 1);
+      ClearRun(pointType, row + nVal[0] - 1, row + nVal[0]);
     }
   }
   return pointType;
 }
+//
+//  Is point i active?
+//
+static bool Active(const uint64_t* type, uint64_t i)
+{
+  return (type[i >> 6] >> (i & 63)) & 1;
+}
+//
+//  ClearRun makes the points from from up to to inactive, a word at a
+//  time where it can. A word the run only covers part of may hold points
+//  another thread is clearing, so those are cleared atomically. Words it
+//  covers completely are ours alone.
+//
+static void ClearRun(uint64_t* type, uint64_t from, uint64_t to)
+{
+  uint64_t mask;
+  if (from >= to) {
+    return;
+  }
+  if ((from >> 6) == ((to - 1) >> 6)) {
+    mask = (~(uint64_t) 0 >> (64 - (to - from))) << (from & 63);
+    __atomic_fetch_and(&type[from >> 6], ~mask, __ATOMIC_RELAXED);
+    return;
+  }
+  if ((from & 63) != 0) {
+    mask = ~(uint64_t) 0 << (from & 63);
+    __atomic_fetch_and(&type[from >> 6], ~mask, __ATOMIC_RELAXED);
+    from = (from | 63) + 1;
+  }
+  while (to - from >= 64) {
+    type[from >> 6] = 0;
+    from += 64;
+  }
+  if (from < to) {
+    mask = ~(uint64_t) 0 >> (64 - (to - from));
+    __atomic_fetch_and(&type[from >> 6], ~mask, __ATOMIC_RELAXED);
+  }
+}
 
 //#define ShowFields 1
 
-void SmoothPrintOn(CD3Data* d, uint8_t* type, FILE* ofp)
+void SmoothPrintOn(CD3Data* d, uint64_t* type, FILE* ofp)
 {
   int i,j,k;
 #ifdef ShowFields
@@ -231,8 +924,8 @@ void SmoothPrintOn(CD3Data* d, uint8_t* type, FILE* ofp)
     fprintf(ofp, "k=%d\n", k);
     for (j = 0; j < d->mNVal[1]; j++) {
       for (i = 0; i < d->mNVal[0]; i++) {
-        fprintf(ofp, "%d", type[((k*d->mNVal[1] + j)*d->mNVal[0] +
-                                  i)]);
+        fprintf(ofp, "%d", Active(type, ((uint64_t) k*d->mNVal[1] + j)*
+                                        d->mNVal[0] + i) ? 1 : 0);
       }
 #ifdef ShowFields
       fprintf(ofp, "   ");
@@ -250,27 +943,144 @@ void SmoothPrintOn(CD3Data* d, uint8_t* type, FILE* ofp)
 }
 
 //
-//  AddGeometryTo runs over every point in the array asking the
-//  geometry whether the point is inside and thus should be
-//  made inactive.
-//  NOTE that it runs over it in real space and index space
-//  at the same time.
+//  AddGeometryTo marks inactive every point in the array that the
+//  geometry says is inside. The z planes are dealt out to the threads
+//  in turn, rather than in slabs, so a geometry bunched up at one end
+//  of the grid still gets shared out. For each plane a thread asks the
+//  list which geometries have bounding boxes, grown by the tolerance,
+//  that reach it. Each of those only looks at the rows through its box
+//  and works out for itself which points of each row it holds.
+//  The coordinates are worked out from the index rather than by adding
+//  on mDelta over and over, so they don't drift along the axis.
+//
+bool AddGeometryTo(CD3Data* d, CD3List* l, uint64_t* type)
+{
+  GSRaster* rasters = NULL;
+  pthread_t* threads = NULL;
+  bool* started = NULL;
+  double* coord[3] = {NULL, NULL, NULL};
+  uint64_t ix;
+  int k, c, nThread = CDNThread();
+  bool success = false;
+  for (k = 0; k < 3; k++) {
+    coord[k] = (double*) malloc(d->mNVal[k] * sizeof(double));
+    if (NULL == coord[k]) {
+      goto Finish;
+    }
+    for (ix = 0; ix < d->mNVal[k]; ix++) {
+      coord[k][ix] = d->mMin[k] + ix * d->mDelta[k];
+    }
+  }
+  if (nThread > (int) d->mNVal[2]) {
+    nThread = d->mNVal[2];
+  }
+  if (nThread < 1) {
+    nThread = 1;
+  }
+  rasters = (GSRaster*) calloc(nThread, sizeof(GSRaster));
+  if (NULL == rasters) {
+    goto Finish;
+  }
+  for (c = 0; c < nThread; c++) {
+    rasters[c].mFound = (Geom**) malloc((l->mNGeom + 1) * sizeof(Geom*));
+    if (NULL == rasters[c].mFound) {
+      goto Finish;
+    }
+    rasters[c].mData = d;
+    rasters[c].mList = l;
+    rasters[c].mType = type;
+    memcpy(rasters[c].mCoord, coord, sizeof(rasters[c].mCoord));
+    rasters[c].mTol = d->mDelta[0];
+    rasters[c].mFirst = c;
+    rasters[c].mStep = nThread;
+  }
+  threads = (pthread_t*) malloc(nThread * sizeof(pthread_t));
+  started = (bool*) malloc(nThread * sizeof(bool));
+  if ((NULL == threads) || (NULL == started) || (nThread == 1)) {
+    for (c = 0; c < nThread; c++) {
+      RasterPlanes(&rasters[c]);
+    }
+  } else {
+    for (c = 0; c < nThread; c++) {
+      started[c] = (pthread_create(&threads[c], NULL, RasterPlanes,
+                                   &rasters[c]) == 0);
+      if (!started[c]) {
+        RasterPlanes(&rasters[c]);
+      }
+    }
+    for (c = 0; c < nThread; c++) {
+      if (started[c]) {
+        pthread_join(threads[c], NULL);
+      }
+    }
+  }
+  success = true;
+Finish:
+  for (k = 0; k < 3; k++) {
+    free(coord[k]);
+  }
+  for (c = 0; (NULL != rasters) && (c < nThread); c++) {
+    free(rasters[c].mFound);
+  }
+  free(rasters);
+  free(threads);
+  free(started);
+  return success;
+}
+//
+//  RasterPlanes marks the geometry in one thread's z planes.
 //
-void AddGeometryTo(CD3Data* d, CD3List* l, uint8_t* type)
+static void* RasterPlanes(void* arg)
 {
+  GSRaster* rp = (GSRaster*) arg;
+  CD3Data* d = rp->mData;
+  double** coord = rp->mCoord;
+  double tol = rp->mTol;
   Point3D p;
-  uint32_t ix, iy, iz;
-  int check = 0;
-  for (iz = 0, p.m[2] = d->mMin[2]; iz < d->mNVal[2]; iz++, p.m[2] += d->mDelta[2]) {
-    for (iy = 0, p.m[1] = d->mMin[1]; iy < d->mNVal[1]; iy++, p.m[1] += d->mDelta[1]) {
-      for (ix = 0, p.m[0] = d->mMin[0]; ix < d->mNVal[0]; ix++, p.m[0] += d->mDelta[0]) {
-        if (fabs(p.m[0]) < 0.1) {
-          check++;
-        }
-        if (CD3ListPointIn(l, &p, d->mDelta[0])) {
-          type[(iz * d->mNVal[1] + iy) * d->mNVal[0] + ix] = 0;
+  Box3D plane;
+  Geom* g;
+  uint64_t iy, iz, row, lo, hi;
+  int k, s, i, nFound, nSpan, span[4];
+  for (k = 0; k < 2; k++) {
+    plane.mMin.m[k] = coord[k][0];
+    plane.mMax.m[k] = coord[k][d->mNVal[k] - 1];
+  }
+  for (iz = rp->mFirst; iz < d->mNVal[2]; iz += rp->mStep) {
+    p.m[2] = plane.mMin.m[2] = plane.mMax.m[2] = coord[2][iz];
+    nFound = CD3ListNear(rp->mList, &plane, tol, rp->mFound);
+    for (i = 0; i < nFound; i++) {
+      g = rp->mFound[i];
+      lo = CountBelow(coord[1], d->mNVal[1], g->mBounds.mMin.m[1] - tol,
+                      false);
+      hi = CountBelow(coord[1], d->mNVal[1], g->mBounds.mMax.m[1] + tol,
+                      true);
+      for (iy = lo; iy < hi; iy++) {
+        p.m[1] = coord[1][iy];
+        nSpan = GeomRowSpans(g, &p, coord[0], d->mNVal[0], tol, span);
+        row = (iz * d->mNVal[1] + iy) * d->mNVal[0];
+        for (s = 0; s < nSpan; s++) {
+          ClearRun(rp->mType, row + span[2 * s], row + span[2 * s + 1]);
         }
       }
     }
   }
+  return NULL;
+}
+//
+//  How many of the n rising values in x are below v, or no more than v
+//  if orEqual?
+//
+static uint64_t CountBelow(const double* x, uint64_t n, double v,
+                           bool orEqual)
+{
+  uint64_t lo = 0, mid;
+  while (lo < n) {
+    mid = lo + (n - lo) / 2;
+    if ((x[mid] < v) || (orEqual && (x[mid] == v))) {
+      lo = mid + 1;
+    } else {
+      n = mid;
+    }
+  }
+  return lo;
 }
@@ -15,6 +15,20 @@
 #include <stdio.h>
 #include "COMSOLData3D.h"
 
-int GSSmooth(const char* fname, CD3Data* dp, int nPass);
+//
+//  Smooth dp for nPass passes, or with no limit if nPass is 0 or less,
+//  stopping early if tol is positive and the sum of the squares of the
+//  changes in a pass falls below it. omega is the relaxation factor,
+//  between 0 and 2 with 1 for plain Gauss-Seidel, or 0 or less to have
+//  one worked out from the size of the grid. nFuse passes at a time are
+//  done in one trip through memory, which is quicker for big grids.
+//
+int GSSmooth(const char* fname, CD3Data* dp, int nPass, double omega,
+             double tol, int nFuse);
+//
+//  Smooth dp by multigrid V-cycles instead, with the same meaning for
+//  nCycle and tol as for passes.
+//
+int MGSmooth(const char* fname, CD3Data* dp, int nCycle, double tol);
 
 #endif /* defined(__COMSOL3DBin__GSSmooth__) */
@@ -15,6 +15,9 @@
 //  takes care of passing in relevant points and updating the arrays.
 //  To make this more efficient each Geometry adds the idea of a BoundingBox
 //  that can be queried by the outside world.
+//  Each Geometry can also work out which points of a row of the grid it
+//  holds without asking about every one, so whole rows can be marked at
+//  a time.
 //
 //  Created by Brian Collett on 7/27/15.
 //  Copyright (c) 2015 Brian Collett. All rights reserved.
@@ -26,6 +29,13 @@
 #include "Geometries.h"
 //#include "Smoothable3D.h"
 //
+//  Helpers.
+//
+static void SetBounds(Geom* g, double r);
+static void Snap(Geom* g, Point3D* p, const double* x, int nx,
+                 double tol, int span[2]);
+static int InAt(Geom* g, Point3D* p, double x, double tol);
+//
 //  Geometries.
 //
 int GeomInit(Geom* g, int id)
@@ -72,6 +82,107 @@ void GeomPrintOn(Geom* g, FILE* ofp)
       break;
   }
 }
+//
+//  GeomPointIn asks whichever kind of Geometry g is whether p is in it.
+//
+int GeomPointIn(Geom* g, Point3D* p, double tol)
+{
+  switch (g->mId) {
+    case kSD3ICyl:
+      return ICylinderPointIn(g, p, tol);
+
+    case kSD3Torus:
+      return TorusPointIn(g, p, tol);
+
+    default:
+      fprintf(stderr, "Unsupported geometry type %d.\n", g->mId);
+      return false;
+  }
+}
+//
+//  GeomRowSpans finds the points of the row of the grid through p along
+//  x that are in g. The x coordinates of the points are in x and p gives
+//  y and z. It puts the first point in each span and the one after the
+//  last into span and returns how many spans there are. A torus can cut
+//  a row in two, anything else just once.
+//  The ends are worked out from the shape and then checked, and moved if
+//  need be, with GeomPointIn, so the answer is exactly what asking about
+//  each point would give.
+//
+int GeomRowSpans(Geom* g, Point3D* p, const double* x, int nx, double tol,
+                 int span[4])
+{
+  double c, d, outer, inner, x0, dx;
+  int i, nSpan = 0, nKept = 0;
+  if ((nx < 1) || ((g->mId != kSD3ICyl) && (g->mId != kSD3Torus))) {
+    return 0;
+  }
+  x0 = x[0];
+  dx = (nx > 1) ? x[1] - x[0] : 1.0;
+  if (g->mIdx2 == 0) {
+    //
+    //  The axis runs along the row so the whole length of the geometry is
+    //  in or none of it is.
+    //
+    p->m[0] = g->mMin.m[0];
+    if (!GeomPointIn(g, p, tol)) {
+      return 0;
+    }
+    span[0] = (int) ceil((g->mMin.m[0] - x0) / dx);
+    span[1] = (int) floor((g->mMax.m[0] - x0) / dx) + 1;
+    nSpan = 1;
+  } else {
+    //
+    //  The row crosses the axis. Find how far either side of the axis
+    //  the row is in, allowing for tol as the PointIn functions do.
+    //
+    if ((p->m[g->mIdx2] < g->mMin.m[g->mIdx2]) ||
+        (p->m[g->mIdx2] > g->mMax.m[g->mIdx2])) {
+      return 0;
+    }
+    c = g->mMin.m[0];
+    d = (g->mIdx0 == 0) ? p->m[g->mIdx1] - g->mMin.m[g->mIdx1] :
+                          p->m[g->mIdx0] - g->mMin.m[g->mIdx0];
+    outer = ((g->mId == kSD3Torus) ? g->mR2Squared : g->mR1Squared) +
+            tol * tol - d * d;
+    if (outer <= 0.0) {
+      return 0;
+    }
+    outer = sqrt(outer);
+    inner = (g->mId == kSD3Torus) ? g->mR1Squared - tol * tol - d * d : -1.0;
+    if (inner < 0.0) {
+      span[0] = (int) ceil((c - outer - x0) / dx);
+      span[1] = (int) floor((c + outer - x0) / dx) + 1;
+      nSpan = 1;
+    } else {
+      inner = sqrt(inner);
+      span[0] = (int) ceil((c - outer - x0) / dx);
+      span[1] = (int) floor((c - inner - x0) / dx) + 1;
+      span[2] = (int) ceil((c + inner - x0) / dx);
+      span[3] = (int) floor((c + outer - x0) / dx) + 1;
+      nSpan = 2;
+    }
+  }
+  //
+  //  Fix up the ends, drop any spans that turn out to be empty and join
+  //  the two halves of a torus if no point falls in the hole.
+  //
+  for (i = 0; i < nSpan; i++) {
+    Snap(g, p, x, nx, tol, span + 2 * i);
+    if (span[2 * i] < span[2 * i + 1]) {
+      span[2 * nKept] = span[2 * i];
+      span[2 * nKept + 1] = span[2 * i + 1];
+      nKept++;
+    }
+  }
+  if ((nKept == 2) && (span[2] <= span[1])) {
+    if (span[3] > span[1]) {
+      span[1] = span[3];
+    }
+    nKept = 1;
+  }
+  return nKept;
+}
 /*
 ICylinder::ICylinder(int idx, double *args) : Geom(kSD3ICyl)
 {
@@ -138,6 +249,7 @@ void ICylinderInit(Geom* g, int axis, double* args)
       g->mIdx2 = 2;
   };
   g->mR1Squared = args[6] * args[6];
+  SetBounds(g, fabs(args[6]));
 }
 //
 //  ICylinderPointIn returns true of the point falls inside
@@ -216,6 +328,7 @@ void TorusInit(Geom* g, int axis, double* args)
   };
   g->mR1Squared = args[6] * args[6];
   g->mR2Squared = args[7] * args[7];
+  SetBounds(g, fmax(fabs(args[6]), fabs(args[7])));
 }
 //
 //  TorusPointIn returns true of the point falls inside
@@ -244,6 +357,58 @@ int TorusPointIn(Geom* g, Point3D* p, double tol)
   return false;
 }
 
+//
+//  SetBounds makes the bounding box of a geometry with radius r about
+//  its axis.
+//
+static void SetBounds(Geom* g, double r)
+{
+  int i;
+  for (i = 0; i < 3; i++) {
+    g->mBounds.mMin.m[i] = g->mMin.m[i] - ((i == g->mIdx2) ? 0.0 : r);
+    g->mBounds.mMax.m[i] = g->mMax.m[i] + ((i == g->mIdx2) ? 0.0 : r);
+  }
+}
+//
+//  Snap clips the span of points [span[0], span[1]) to the row and
+//  then moves each end until the points just inside are in g and the
+//  points just outside are not.
+//
+static void Snap(Geom* g, Point3D* p, const double* x, int nx,
+                 double tol, int span[2])
+{
+  int k;
+  for (k = 0; k < 2; k++) {
+    if (span[k] < 0) {
+      span[k] = 0;
+    } else if (span[k] > nx) {
+      span[k] = nx;
+    }
+  }
+  if (span[1] < span[0]) {
+    span[1] = span[0];
+  }
+  while ((span[0] < span[1]) && !InAt(g, p, x[span[0]], tol)) {
+    span[0]++;
+  }
+  while ((span[0] > 0) && InAt(g, p, x[span[0] - 1], tol)) {
+    span[0]--;
+  }
+  while ((span[1] > span[0]) && !InAt(g, p, x[span[1] - 1], tol)) {
+    span[1]--;
+  }
+  while ((span[1] < nx) && InAt(g, p, x[span[1]], tol)) {
+    span[1]++;
+  }
+}
+//
+//  Is the point at x along the row through p in g?
+//
+static int InAt(Geom* g, Point3D* p, double x, double tol)
+{
+  p->m[0] = x;
+  return GeomPointIn(g, p, tol);
+}
 /*
  *  Add to a type array.
  *
@@ -74,7 +74,7 @@ typedef enum {
 typedef struct GeomTag {
   int mId;
   struct GeomTag* mNext;
-  Box3D mBounds;
+  Box3D mBounds;            // Everything inside, not allowing for tol
   Point3D mMin;
   Point3D mMax;
   int mIdx0, mIdx1, mIdx2;  // Idx2 is axis of symmetry if present
@@ -89,6 +89,13 @@ int GeomFinish(Geom* g);
 //
 void GeomPrintOn(Geom* g, FILE* ofp);
 //
+//  Ask any kind of Geometry whether a point is in it, and find the spans
+//  of a row of grid points that are in it. See Geometries.c.
+//
+int GeomPointIn(Geom* g, Point3D* p, double tol);
+int GeomRowSpans(Geom* g, Point3D* p, const double* x, int nx, double tol,
+                 int span[4]);
+//
 //  Individual actual geometries support a few more functions.
 //
 //
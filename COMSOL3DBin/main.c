@@ -5,15 +5,46 @@
 //  Converts a text COMSOL data file containing a 3D grid
 //  section of field into a binary format file.
 //
-//  COMSOL3D2Bin [-a] [-c] [-f] [-s:<geomfile.txt>] [-n:<nPass>] <textfile.txt>
+//  COMSOL3D2Bin [-a] [-b] [-c] [-f] [-s:<geomfile.txt>] [-n:<nPass>]
+//               [-o[:<omega>]] [-e:<tol>] [-g] [-k[:<nFuse>]] [-l:<r|b|m>]
+//               [-m[:<nQuery>]] [-p:<d|f|h>] [-q[:<nQuery>]]
+//               [-t:<nThread>] [-v:<version>] [-w[:<nStep>]] [-z[:<nPlane>]]
+//               <textfile.txt>
 //
 //  will produce textfile.bin.
 //  -c  Move to checking phase after build phase.
 //  -a  Four-fold average (only for 3D input files)
+//  -b  Benchmark the text parser on the input files instead of
+//      converting them.
+//  -e  Keep smoothing until the sum of the squares of the changes in a
+//      pass falls below tol. -n then sets the most passes to make, with
+//      no limit if it is not given.
 //  -f  Process a FEMM input file rather than a
 //      COMSOL file--input order is altered.
+//  -g  Smooth by multigrid V-cycles rather than Gauss-Seidel passes.
+//      -n and -e then count and stop cycles, and -o is ignored.
+//  -k  Fuse smoothing passes, nFuse (default 4) at a time, into one trip
+//      through memory. The field comes out the same; only the speed
+//      differs. Helps most when the field is much bigger than the cache.
+//  -l  Store 3D fields row major (default), in 4x4x4 bricks, or in
+//      Morton order. With -q the field is put in that layout after it is
+//      read.
+//  -m  Stress test binary input files: every thread (see -t) looks up the
+//      same nQuery random points in one shared copy of the field, which
+//      is left packed if it was, and checks the answers against a copy
+//      of its own.
 //  -n  Set number of smoothing passes (only meaningful if -s present)
+//  -o  Smooth by successive over-relaxation with factor omega, or one
+//      worked out from the grid size if omega is not given.
+//  -p  Store values as double (default), float, or scaled half.
+//  -q  Time nQuery random lookups in binary input files, one at a time
+//      and in batches, instead of converting them.
 //  -s  Use the geometry info to GS smooth the data.
+//  -t  Set the number of threads to use (default one per processor).
+//  -v  Set the binary file version to write (default 2, 1 for old readers).
+//  -w  Time nStep lookups along random walks through binary input files
+//      with the field in each layout, instead of converting them.
+//  -z  Compress the output in blocks of nPlane z planes (default 4).
 //
 //  Created by Brian Collett on 3/13/14.
 //  Copyright (c) 2014 Brian Collett. All rights reserved.
@@ -30,23 +61,71 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <math.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include "COMSOLData3D.h"
+#include "CDScan.h"
 #include "CD3List.h"
+#include "CD3Lerp.h"
 
 int ProcessArguments(int argc, const char** argv);
 int QuadAverage(CD3Data* cd);
 void DoCheck(const char* name);
 int DoFile(const char* filename);
+int StreamFile(const char* filename);
+void OutputName(const char* filename, char outName[256]);
+int DoBench(const char* name);
+int DoQuery(const char* name);
+int DoWalk(const char* name);
+int DoStress(const char* name);
 
 //static const int kMaxNFiles = 20;   Not sure which version of C this needs
 #define kMaxNFiles 20
+//
+//  Times DoQuery runs each kind of lookup, keeping the best.
+//
+#define kQueryRounds 3
+//
+//  Steps each particle takes in DoWalk.
+//
+#define kWalkLength 10000
+//
+//  Names of the grid layouts for reports.
+//
+static const char* kLayoutName[] = {"row major", "brick", "Morton"};
+//
+//  Points each DoStress thread hands to CD3GetEAtPoints at a time.
+//
+#define kStressBatch 1000
+//
+//  What each DoStress thread is given, and what it found.
+//
+typedef struct StressTag {
+  const CD3Data* mData;                 // Field all the threads share
+  const double* mPoints;                // Points to look up
+  const double* mExpect;                // and the answers to expect
+  long mFirst;                          // Where this thread starts
+  bool mBatch;                          // Use CD3GetEAtPoints
+  long mNMismatch;                      // Values that differed
+} Stress;
+static void* StressThread(void* arg);
+static long QueryEach(const CD3Data* dp, const double* aos, double* field);
 
 bool gDoAverage = false;
+bool gBenchParse = false;
+long gNQuery = 0;
+long gNWalk = 0;
+long gNStress = 0;
 bool gCheckFile = false;
 bool gFEMMFile = false;
 int gNFile = 0;
-int gNPass = 1;
+int gNPass = 0;
+double gOmega = 1.0;
+double gTolerance = 0.0;
+bool gMultigrid = false;
+int gNFuse = 1;
 const char* gGeomFilename = NULL;
 const char* gFilenames[kMaxNFiles];
 
@@ -69,7 +148,17 @@ int main(int argc, const char * argv[])
   //
   while (fileNum < gNFile) {
     filename = gFilenames[fileNum++];
-    theErr = DoFile(filename);
+    if (gBenchParse) {
+      theErr = DoBench(filename);
+    } else if (gNQuery > 0) {
+      theErr = DoQuery(filename);
+    } else if (gNWalk > 0) {
+      theErr = DoWalk(filename);
+    } else if (gNStress > 0) {
+      theErr = DoStress(filename);
+    } else {
+      theErr = DoFile(filename);
+    }
     fprintf(stderr, "Processing file %s terminated with error %d.\n",
             filename, theErr);
   }
@@ -81,11 +170,21 @@ int main(int argc, const char * argv[])
 int DoFile(const char* filename)
 {
   char outName[256];
-  char* ext;
   FILE* ofp;
   CD3Data cData;
   CDError theErr;
   //
+  //  A plain conversion of a COMSOL file doesn't need the field in
+  //  memory at all, so stream it straight to the output. Narrow values
+  //  need the whole field first to find their scales, and packed ones
+  //  a whole block.
+  //
+  if (!gFEMMFile && !gDoAverage && (NULL == gGeomFilename) &&
+      (gCD3WriteType == kCD3Double) && !gCD3Compress &&
+      (gCD3WriteLayout == kCD3RowMajor)) {
+    return StreamFile(filename);
+  }
+  //
   //  Read the file in.
   //
   if (gFEMMFile) {
@@ -112,18 +211,20 @@ int DoFile(const char* filename)
     }
   }
   if (NULL != gGeomFilename) {
-    GSSmooth(gGeomFilename, &cData, gNPass);
+    if (gMultigrid) {
+      MGSmooth(gGeomFilename, &cData,
+               (gNPass > 0) ? gNPass : ((gTolerance > 0.0) ? 0 : 1),
+               gTolerance);
+    } else {
+      GSSmooth(gGeomFilename, &cData,
+               (gNPass > 0) ? gNPass : ((gTolerance > 0.0) ? 0 : 1),
+               gOmega, gTolerance, gNFuse);
+    }
   }
   //
   //  Construct output file name.
   //
-  strncpy(outName, filename, 254);
-  ext = strrchr(outName, '.');
-  if (gDoAverage) {
-    strcpy(ext, "_av.bin");
-  } else {
-    strcpy(ext, ".bin");
-  }
+  OutputName(filename, outName);
   ofp = fopen(outName, "wb");
   if (ofp == NULL) {
     fprintf(stderr, "Failed to open %s for writing.", outName);
@@ -147,6 +248,520 @@ int DoFile(const char* filename)
   return 0;
 }
 //
+//  Streaming version of DoFile. The output is opened first and filled
+//  in as the text is read. If anything goes wrong we remove the partial
+//  file rather than leave a broken one lying around.
+//
+int StreamFile(const char* filename)
+{
+  char outName[256];
+  FILE* ofp;
+  CD3Data cData;
+  CDError theErr;
+  OutputName(filename, outName);
+  ofp = fopen(outName, "wb");
+  if (ofp == NULL) {
+    fprintf(stderr, "Failed to open %s for writing.", outName);
+    return 3;
+  }
+  theErr = CD3StreamBinary(&cData, filename, ofp);
+  if (fclose(ofp) != 0) {
+    fprintf(stderr, "Failed to close %s.\n", outName);
+    theErr = kCDError;
+  }
+  if (theErr != kCDNoErr) {
+    fprintf(stderr, "Error %d: Failed to convert file %s.\n",
+            theErr, filename);
+    remove(outName);
+    return 2;
+  }
+  if (gCheckFile) {
+    DoCheck(outName);
+  }
+  return 0;
+}
+//
+//  Build the output file name from the input name by swapping the
+//  extension for .bin, or _av.bin if averaging.
+//
+void OutputName(const char* filename, char outName[256])
+{
+  char* ext;
+  strncpy(outName, filename, 254);
+  outName[254] = 0;
+  ext = strrchr(outName, '.');
+  if (NULL == ext) {
+    ext = outName + strlen(outName);
+  }
+  if (gDoAverage) {
+    strcpy(ext, "_av.bin");
+  } else {
+    strcpy(ext, ".bin");
+  }
+}
+//
+//  This times the ways of reading the data section of a COMSOL file,
+//  the old one-fscanf-per-value loop and the CDScan parser reading
+//  through a buffer and straight from a mapping of the file, and reports
+//  the throughput of each in MB/s. It also checks that they all produce
+//  bit for bit the same numbers.
+//
+static double Now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + 1.0e-6 * tv.tv_usec;
+}
+//
+//  Pull up to nVal numbers through a scanner, returning how many we got
+//  and a hash of their bits.
+//
+static uint64_t ScanAll(CDScan* scan, uint64_t nVal, uint64_t* hash)
+{
+  uint64_t i, bits;
+  double v;
+  *hash = 0;
+  for (i = 0; i < nVal; i++) {
+    if (!CDScanDouble(scan, &v)) {
+      break;
+    }
+    memcpy(&bits, &v, sizeof(bits));
+    *hash = (*hash ^ bits) * 1099511628211ULL;
+  }
+  CDScanFinish(scan);
+  return i;
+}
+
+int DoBench(const char* name)
+{
+  CDData cData;
+  CDScan scan;
+  long start;
+  uint64_t i, nVal, nOld = 0, nBuff = 0, nMap = 0, bits;
+  uint64_t hashOld = 0, hashBuff = 0, hashMap = 0;
+  double v, t, tOld, tBuff, tMap, mBytes;
+  FILE* ifp = fopen(name, "rt");
+  if (NULL == ifp) {
+    fprintf(stderr, "Failed to open %s for reading.\n", name);
+    return kCDCantOpenIn;
+  }
+  cData.mExprNames = NULL;
+  if (CDParseHeader(ifp, &cData) != kCDNoErr) {
+    fprintf(stderr, "Failed to parse header of %s.\n", name);
+    fclose(ifp);
+    return kCDIncompleteHeader;
+  }
+  if (NULL != cData.mExprNames) {
+    free(cData.mExprNames[0]);
+    free(cData.mExprNames);
+  }
+  nVal = (uint64_t) cData.mNLine * (cData.mNDimension + cData.mNExpression);
+  start = ftell(ifp);
+  //
+  //  Old way.
+  //
+  t = Now();
+  for (i = 0; i < nVal; i++) {
+    if (fscanf(ifp, "%lg", &v) != 1) {
+      break;
+    }
+    memcpy(&bits, &v, sizeof(bits));
+    hashOld = (hashOld ^ bits) * 1099511628211ULL;
+    nOld++;
+  }
+  tOld = Now() - t;
+  mBytes = (ftell(ifp) - start) / 1.0e6;
+  //
+  //  Buffered.
+  //
+  fseek(ifp, start, SEEK_SET);
+  t = Now();
+  if (CDScanInitBuffered(&scan, ifp)) {
+    nBuff = ScanAll(&scan, nVal, &hashBuff);
+  }
+  tBuff = Now() - t;
+  //
+  //  Mapped.
+  //
+  fseek(ifp, start, SEEK_SET);
+  t = Now();
+  if (CDScanInitMapped(&scan, ifp)) {
+    nMap = ScanAll(&scan, nVal, &hashMap);
+  }
+  tMap = Now() - t;
+  fclose(ifp);
+  printf("%s: %" PRIu64 " values, %.1f MB of data.\n", name, nVal, mBytes);
+  printf("fscanf:          %" PRIu64 " values in %.3f s, %.1f MB/s\n",
+         nOld, tOld, mBytes / tOld);
+  printf("CDScan buffered: %" PRIu64 " values in %.3f s, %.1f MB/s\n",
+         nBuff, tBuff, mBytes / tBuff);
+  printf("CDScan mapped:   %" PRIu64 " values in %.3f s, %.1f MB/s\n",
+         nMap, tMap, mBytes / tMap);
+  printf("Speedup %.1f buffered, %.1f mapped. Results %s.\n",
+         tOld / tBuff, tOld / tMap,
+         ((nOld == nBuff) && (hashOld == hashBuff) &&
+          (nOld == nMap) && (hashOld == hashMap)) ? "identical" : "DIFFER");
+  return kCDNoErr;
+}
+//
+//  This times looking up gNQuery random points in a binary field file,
+//  one at a time with CD3GetEAtPoint, one at a time again with the plain
+//  C interpolation kernel, which should match the vector one bit for bit,
+//  and all at once with CD3GetEAtPoints with the points in both orders,
+//  and checks they all agree. An untimed pass of each comes first, so the
+//  field, the points and the results are all in memory before we time
+//  anything. Then they take turns kQueryRounds times and we report the
+//  best time of each. A 3D field is first put in the grid layout asked
+//  for with -l. The points fill the bounding box, so some may miss a 2D
+//  field.
+//
+int DoQuery(const char* name)
+{
+  CD3Data cData;
+  long i, nOne = 0, nAoS = 0, nSoA = 0, nMismatch = 0;
+  int k, round;
+  double t, tOne, tAoS, tSoA, tC, diff = 0.0;
+  CD3LerpKernel kernel = gCD3LerpKernel;
+  double* aos = NULL;
+  double* soa = NULL;
+  double* one = NULL;
+  double* eAoS = NULL;
+  double* eSoA = NULL;
+  bool* valid = NULL;
+  int theErr = kCDNoErr;
+  FILE* ifp = fopen(name, "rb");
+  if (NULL == ifp) {
+    fprintf(stderr, "Failed to open %s for reading.\n", name);
+    return kCDCantOpenIn;
+  }
+  if (!CD3ReadBinary(&cData, ifp)) {
+    fclose(ifp);
+    return kCDError;
+  }
+  fclose(ifp);
+  if ((cData.mType == kCD3Data3) &&
+      !CD3SetLayout(&cData, gCD3WriteLayout)) {
+    CD3Finish(&cData);
+    return kCDError;
+  }
+  aos = (double*) malloc(3 * gNQuery * sizeof(double));
+  soa = (double*) malloc(3 * gNQuery * sizeof(double));
+  one = (double*) malloc(3 * gNQuery * sizeof(double));
+  eAoS = (double*) malloc(3 * gNQuery * sizeof(double));
+  eSoA = (double*) malloc(3 * gNQuery * sizeof(double));
+  valid = (bool*) malloc(gNQuery * sizeof(bool));
+  if ((aos == NULL) || (soa == NULL) || (one == NULL) ||
+      (eAoS == NULL) || (eSoA == NULL) || (valid == NULL)) {
+    fprintf(stderr, "Failed to allocate %ld query points.\n", gNQuery);
+    theErr = kCDAllocFailed;
+    goto Finish;
+  }
+  srand(1);
+  for (i = 0; i < gNQuery; i++) {
+    for (k = 0; k < 3; k++) {
+      aos[3 * i + k] = soa[k * gNQuery + i] = cData.mMin[k] +
+        (cData.mMax[k] - cData.mMin[k]) * (rand() / (double) RAND_MAX);
+    }
+  }
+  QueryEach(&cData, aos, one);
+  CD3GetEAtPoints(&cData, gNQuery, aos, kCD3AoS, eAoS, valid);
+  CD3GetEAtPoints(&cData, gNQuery, soa, kCD3SoA, eSoA, valid);
+  tOne = tC = tAoS = tSoA = HUGE_VAL;
+  for (round = 0; round < kQueryRounds; round++) {
+    t = Now();
+    nOne = QueryEach(&cData, aos, one);
+    tOne = fmin(tOne, Now() - t);
+    gCD3LerpKernel = kCD3LerpC;
+    CD3PickLerp(&cData);
+    t = Now();
+    QueryEach(&cData, aos, eAoS);
+    tC = fmin(tC, Now() - t);
+    gCD3LerpKernel = kernel;
+    CD3PickLerp(&cData);
+    for (i = 0, nMismatch = 0; i < 3 * gNQuery; i++) {
+      if (memcmp(&one[i], &eAoS[i], sizeof(double)) != 0) {
+        ++nMismatch;
+      }
+    }
+    t = Now();
+    nAoS = CD3GetEAtPoints(&cData, gNQuery, aos, kCD3AoS, eAoS, valid);
+    tAoS = fmin(tAoS, Now() - t);
+    t = Now();
+    nSoA = CD3GetEAtPoints(&cData, gNQuery, soa, kCD3SoA, eSoA, valid);
+    tSoA = fmin(tSoA, Now() - t);
+  }
+  for (i = 0; i < gNQuery; i++) {
+    for (k = 0; k < 3; k++) {
+      diff = fmax(diff, fabs(one[3 * i + k] - eAoS[3 * i + k]));
+      diff = fmax(diff, fabs(one[3 * i + k] - eSoA[k * gNQuery + i]));
+    }
+  }
+  printf("%s: %ld random points, %s interpolation (%s in batches), "
+         "%s layout, best of %d.\n", name, gNQuery, CD3LerpName(),
+         CD3Lerp4Name(), kLayoutName[cData.mLayout], kQueryRounds);
+  printf("One at a time: %ld found in %.3f s, %.2f Mpoint/s\n",
+         nOne, tOne, gNQuery / tOne / 1.0e6);
+  printf("Plain C:       %.3f s, %.2f Mpoint/s, %ld values differ\n",
+         tC, gNQuery / tC / 1.0e6, nMismatch);
+  printf("Batch AoS:     %ld found in %.3f s, %.2f Mpoint/s\n",
+         nAoS, tAoS, gNQuery / tAoS / 1.0e6);
+  printf("Batch SoA:     %ld found in %.3f s, %.2f Mpoint/s\n",
+         nSoA, tSoA, gNQuery / tSoA / 1.0e6);
+  printf("Largest difference %g.\n", diff);
+Finish:
+  free(aos);
+  free(soa);
+  free(one);
+  free(eAoS);
+  free(eSoA);
+  free(valid);
+  CD3Finish(&cData);
+  return theErr;
+}
+//
+//  Look up the gNQuery points in aos one at a time, leaving zero for any
+//  that miss. Returns how many were found.
+//
+static long QueryEach(const CD3Data* dp, const double* aos, double* field)
+{
+  long i, nFound = 0;
+  for (i = 0; i < gNQuery; i++) {
+    if (CD3GetEAtPoint(dp, aos + 3 * i, field + 3 * i)) {
+      ++nFound;
+    } else {
+      field[3 * i] = field[3 * i + 1] = field[3 * i + 2] = 0.0;
+    }
+  }
+  return nFound;
+}
+//
+//  This times gNWalk lookups along random walks through a 3D binary field
+//  file with the field in each layout in turn, and checks that they all
+//  give the same answers. Each particle takes kWalkLength steps of up to
+//  half a cell along each axis, bouncing off the walls, so lookups that
+//  follow one another are close in all three directions.
+//
+int DoWalk(const char* name)
+{
+  CD3Data cData;
+  long i, nFound[3];
+  int k, l;
+  double t, tWalk[3], x, diff = 0.0;
+  double* path = NULL;
+  double* field[3] = {NULL, NULL, NULL};
+  int theErr = kCDNoErr;
+  FILE* ifp = fopen(name, "rb");
+  if (NULL == ifp) {
+    fprintf(stderr, "Failed to open %s for reading.\n", name);
+    return kCDCantOpenIn;
+  }
+  if (!CD3ReadBinary(&cData, ifp)) {
+    fclose(ifp);
+    return kCDError;
+  }
+  fclose(ifp);
+  if (cData.mType != kCD3Data3) {
+    fprintf(stderr, "%s is not a 3D field.\n", name);
+    theErr = kCDError;
+    goto Finish;
+  }
+  path = (double*) malloc(3 * gNWalk * sizeof(double));
+  for (l = 0; l < 3; l++) {
+    field[l] = (double*) malloc(3 * gNWalk * sizeof(double));
+  }
+  if ((path == NULL) || (field[0] == NULL) || (field[1] == NULL) ||
+      (field[2] == NULL)) {
+    fprintf(stderr, "Failed to allocate %ld walk steps.\n", gNWalk);
+    theErr = kCDAllocFailed;
+    goto Finish;
+  }
+  srand(1);
+  for (i = 0; i < gNWalk; i++) {
+    for (k = 0; k < 3; k++) {
+      if (i % kWalkLength == 0) {
+        x = cData.mMin[k] +
+            (cData.mMax[k] - cData.mMin[k]) * (rand() / (double) RAND_MAX);
+      } else {
+        x = path[3 * (i - 1) + k] +
+            cData.mDelta[k] * (rand() / (double) RAND_MAX - 0.5);
+        if (x < cData.mMin[k]) {
+          x = 2.0 * cData.mMin[k] - x;
+        } else if (x > cData.mMax[k]) {
+          x = 2.0 * cData.mMax[k] - x;
+        }
+      }
+      path[3 * i + k] = x;
+    }
+  }
+  printf("%s: %ld steps in walks of %d.\n", name, gNWalk, kWalkLength);
+  for (l = 0; l < 3; l++) {
+    if (!CD3SetLayout(&cData, (CD3GridLayout) l)) {
+      theErr = kCDError;
+      goto Finish;
+    }
+    nFound[l] = 0;
+    t = Now();
+    for (i = 0; i < gNWalk; i++) {
+      if (CD3GetEAtPoint(&cData, path + 3 * i, field[l] + 3 * i)) {
+        ++nFound[l];
+      } else {
+        field[l][3 * i] = field[l][3 * i + 1] = field[l][3 * i + 2] = 0.0;
+      }
+    }
+    tWalk[l] = Now() - t;
+    for (i = 0; i < 3 * gNWalk; i++) {
+      diff = fmax(diff, fabs(field[l][i] - field[0][i]));
+    }
+    printf("%-10s %ld found in %.3f s, %.2f Mpoint/s\n", kLayoutName[l],
+           nFound[l], tWalk[l], gNWalk / tWalk[l] / 1.0e6);
+  }
+  printf("Largest difference %g.\n", diff);
+Finish:
+  free(path);
+  for (l = 0; l < 3; l++) {
+    free(field[l]);
+  }
+  CD3Finish(&cData);
+  return theErr;
+}
+//
+//  This checks that one field can be shared by many threads. The field
+//  is read twice: once to be shared, left packed if the file is so that
+//  the threads also race to unpack it, and once to be read in full and
+//  queried one point at a time to get the answers to expect. Then each
+//  thread looks up all gNStress points, starting at a different place,
+//  alternately one at a time and in batches, and counts the values that
+//  are not bit for bit what was expected.
+//
+int DoStress(const char* name)
+{
+  CD3Data shared, own;
+  bool haveShared = false, haveOwn = false;
+  long i, nMismatch = 0;
+  int c, nThread = CDNThread();
+  double t;
+  double* points = NULL;
+  double* expect = NULL;
+  Stress* work = NULL;
+  pthread_t* threads = NULL;
+  bool* started = NULL;
+  int theErr = kCDNoErr;
+  FILE* ifp = fopen(name, "rb");
+  if (NULL == ifp) {
+    fprintf(stderr, "Failed to open %s for reading.\n", name);
+    return kCDCantOpenIn;
+  }
+  haveShared = CD3ReadBinary(&shared, ifp);
+  rewind(ifp);
+  haveOwn = haveShared && CD3ReadBinary(&own, ifp) && CD3LoadAll(&own);
+  fclose(ifp);
+  if (!haveOwn) {
+    theErr = kCDError;
+    goto Finish;
+  }
+  points = (double*) malloc(3 * gNStress * sizeof(double));
+  expect = (double*) malloc(3 * gNStress * sizeof(double));
+  work = (Stress*) malloc(nThread * sizeof(Stress));
+  threads = (pthread_t*) malloc(nThread * sizeof(pthread_t));
+  started = (bool*) malloc(nThread * sizeof(bool));
+  if ((points == NULL) || (expect == NULL) || (work == NULL) ||
+      (threads == NULL) || (started == NULL)) {
+    fprintf(stderr, "Failed to allocate %ld stress points.\n", gNStress);
+    theErr = kCDAllocFailed;
+    goto Finish;
+  }
+  srand(1);
+  for (i = 0; i < 3 * gNStress; i++) {
+    points[i] = own.mMin[i % 3] +
+      (own.mMax[i % 3] - own.mMin[i % 3]) * (rand() / (double) RAND_MAX);
+  }
+  for (i = 0; i < gNStress; i++) {
+    if (!CD3GetEAtPoint(&own, points + 3 * i, expect + 3 * i)) {
+      expect[3 * i] = expect[3 * i + 1] = expect[3 * i + 2] = 0.0;
+    }
+  }
+  for (c = 0; c < nThread; c++) {
+    work[c].mData = &shared;
+    work[c].mPoints = points;
+    work[c].mExpect = expect;
+    work[c].mFirst = (gNStress / nThread) * c;
+    work[c].mBatch = (c % 2 == 1);
+    work[c].mNMismatch = 0;
+  }
+  t = Now();
+  for (c = 0; c < nThread; c++) {
+    started[c] = (pthread_create(&threads[c], NULL, StressThread,
+                                 &work[c]) == 0);
+  }
+  for (c = 0; c < nThread; c++) {
+    if (started[c]) {
+      pthread_join(threads[c], NULL);
+    } else {
+      StressThread(&work[c]);
+    }
+  }
+  t = Now() - t;
+  for (c = 0; c < nThread; c++) {
+    nMismatch += work[c].mNMismatch;
+  }
+  printf("%s: %d threads each looked up %ld points in %.3f s, "
+         "%.2f Mpoint/s.\n", name, nThread, gNStress, t,
+         nThread * gNStress / t / 1.0e6);
+  printf("%ld values differ.\n", nMismatch);
+  if (nMismatch > 0) {
+    theErr = kCDError;
+  }
+Finish:
+  free(points);
+  free(expect);
+  free(work);
+  free(threads);
+  free(started);
+  if (haveShared) {
+    CD3Finish(&shared);
+  }
+  if (haveOwn) {
+    CD3Finish(&own);
+  }
+  return theErr;
+}
+
+static void* StressThread(void* arg)
+{
+  Stress* sp = (Stress*) arg;
+  long i, j, n;
+  int k;
+  double field[3 * kStressBatch];
+  bool valid[kStressBatch];
+  for (i = 0; i < gNStress; i += n) {
+    j = (sp->mFirst + i) % gNStress;
+    n = gNStress - j;
+    if (n > kStressBatch) {
+      n = kStressBatch;
+    }
+    if (n > gNStress - i) {
+      n = gNStress - i;
+    }
+    if (sp->mBatch) {
+      CD3GetEAtPoints(sp->mData, n, sp->mPoints + 3 * j, kCD3AoS, field,
+                      valid);
+    } else {
+      for (k = 0; k < n; k++) {
+        if (!CD3GetEAtPoint(sp->mData, sp->mPoints + 3 * (j + k),
+                            field + 3 * k)) {
+          field[3 * k] = field[3 * k + 1] = field[3 * k + 2] = 0.0;
+        }
+      }
+    }
+    for (k = 0; k < 3 * n; k++) {
+      if (memcmp(&field[k], &sp->mExpect[3 * j + k], sizeof(double)) != 0) {
+        ++sp->mNMismatch;
+      }
+    }
+  }
+  return NULL;
+}
+//
 //  This allows you to probe the resulting file.
 //
 void DoCheck(const char* name)
@@ -292,6 +907,8 @@ void DoCheck(const char* name)
 int ProcessArguments(int argc, const char** argv)
 {
   int iVal, argn;
+  long lVal;
+  double dVal;
   if (argc < 2) {
     fprintf(stderr, "No arguments given.\n");
     return 1;
@@ -307,10 +924,72 @@ int ProcessArguments(int argc, const char** argv)
           gDoAverage = true;
           break;
 
+        case 'b':
+          gBenchParse = true;
+          break;
+
+        case 'e':
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%lf", &dVal) == 1) && (dVal > 0.0)) {
+              gTolerance = dVal;
+            } else {
+              fprintf(stderr, "Failed to find valid tolerance in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
         case 'f':
           gFEMMFile = true;
           break;
 
+        case 'g':
+          gMultigrid = true;
+          break;
+
+        case 'k':
+          gNFuse = 4;
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%d", &iVal) == 1) && (iVal > 0)) {
+              gNFuse = iVal;
+            } else {
+              fprintf(stderr, "Failed to find valid number of passes to fuse in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
+        case 'l':
+          if (argv[argn][2] == ':') {
+            switch (argv[argn][3]) {
+              case 'r':
+                gCD3WriteLayout = kCD3RowMajor;
+                break;
+
+              case 'b':
+                gCD3WriteLayout = kCD3Brick;
+                break;
+
+              case 'm':
+                gCD3WriteLayout = kCD3Morton;
+                break;
+
+              default:
+                fprintf(stderr, "Layout must be r, b, or m in argument %s\n", argv[argn]);
+                break;
+            }
+          }
+          break;
+
+        case 'm':
+          gNStress = 1000000;
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%ld", &lVal) == 1) && (lVal > 0)) {
+              gNStress = lVal;
+            } else {
+              fprintf(stderr, "Failed to find valid number of queries in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
         case 'n':
           if (argv[argn][2] == ':') {
             if (sscanf(&argv[argn][3], "%d", &iVal) == 1) {
@@ -321,12 +1000,100 @@ int ProcessArguments(int argc, const char** argv)
           }
           break;
 
+        case 'o':
+          gOmega = 0.0;
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%lf", &dVal) == 1) &&
+                (dVal > 0.0) && (dVal < 2.0)) {
+              gOmega = dVal;
+            } else {
+              fprintf(stderr, "Omega must be between 0 and 2 in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
+        case 'p':
+          if (argv[argn][2] == ':') {
+            switch (argv[argn][3]) {
+              case 'd':
+                gCD3WriteType = kCD3Double;
+                break;
+
+              case 'f':
+                gCD3WriteType = kCD3Float;
+                break;
+
+              case 'h':
+                gCD3WriteType = kCD3Half;
+                break;
+
+              default:
+                fprintf(stderr, "Precision must be d, f, or h in argument %s\n", argv[argn]);
+                break;
+            }
+          }
+          break;
+
+        case 'q':
+          gNQuery = 1000000;
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%ld", &lVal) == 1) && (lVal > 0)) {
+              gNQuery = lVal;
+            } else {
+              fprintf(stderr, "Failed to find valid number of queries in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
         case 's':
           if (argv[argn][2] == ':') {
             gGeomFilename = &argv[argn][3];
           }
           break;
 
+        case 't':
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%d", &iVal) == 1) && (iVal > 0)) {
+              gCDNThread = iVal;
+            } else {
+              fprintf(stderr, "Failed to find valid number of threads in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
+        case 'v':
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%d", &iVal) == 1) &&
+                ((iVal == 1) || (iVal == 2))) {
+              gCD3FileVersion = iVal;
+            } else {
+              fprintf(stderr, "Binary file version must be 1 or 2 in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
+        case 'w':
+          gNWalk = 1000000;
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%ld", &lVal) == 1) && (lVal > 0)) {
+              gNWalk = lVal;
+            } else {
+              fprintf(stderr, "Failed to find valid number of steps in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
+        case 'z':
+          gCD3Compress = true;
+          if (argv[argn][2] == ':') {
+            if ((sscanf(&argv[argn][3], "%d", &iVal) == 1) && (iVal > 0)) {
+              gCD3BlockPlanes = iVal;
+            } else {
+              fprintf(stderr, "Failed to find valid number of planes in argument %s\n", argv[argn]);
+            }
+          }
+          break;
+
         default:
           fprintf(stderr, "Ignored unknown option %s.\n", argv[argn]);
           break;